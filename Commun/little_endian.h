@@ -0,0 +1,33 @@
+#ifndef LITTLE_ENDIAN_H
+#define LITTLE_ENDIAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Writes the low bytes of a value, least significant first, whatever the byte
+ * order of the host.
+ *
+ * @param bytes where the value is written
+ * @param value the value
+ * @param size number of bytes written
+ */
+static inline void store_le(uint8_t *bytes, uint64_t value, size_t size) {
+    for (size_t i = 0; i < size; i++) bytes[i] = (uint8_t) (value >> (8 * i));
+}
+
+/**
+ * Reads a value written by store_le.
+ *
+ * @param bytes where the value is read
+ * @param size number of bytes read
+ *
+ * @return the value
+ */
+static inline uint64_t load_le(const uint8_t *bytes, size_t size) {
+    uint64_t value = 0;
+    for (size_t i = size; i-- > 0;) value = (value << 8) | bytes[i];
+    return value;
+}
+
+#endif
@@ -0,0 +1,274 @@
+#ifdef WIN32
+#include <windows.h>
+#else
+#define _GNU_SOURCE
+#endif
+
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "server_log.h"
+
+/**
+ * Time the writer sleeps when no message is waiting, in milliseconds.
+ */
+#define SERVER_LOG_IDLE 10
+
+/**
+ * Message waiting for the writer.
+ */
+struct server_log_record {
+    struct timespec time;
+    int level;
+    char text[SERVER_LOG_LINE_SIZE];
+};
+
+/**
+ * Messages of a thread : the thread adds them at the head, the writer takes
+ * them at the tail. A thread leaving releases its ring to the next one.
+ */
+struct server_log_ring {
+    _Atomic size_t head;
+    _Atomic size_t tail;
+    _Atomic size_t dropped;
+    atomic_int owned;
+    struct server_log_ring *next;
+    struct server_log_record records[SERVER_LOG_RING_SIZE];
+};
+
+/**
+ * Gets the ring of the calling thread, taking a released one or allocating it
+ * on first use.
+ *
+ * @return the ring, or NULL if memory is short
+ */
+static struct server_log_ring *server_log_ring();
+
+/**
+ * Releases the ring of a leaving thread.
+ */
+static void server_log_release(void *ring);
+
+/**
+ * Writes the waiting messages of every thread.
+ *
+ * @return the number of messages written
+ */
+static size_t server_log_drain();
+
+/**
+ * Writes a message to the stream.
+ */
+static void server_log_print(
+        const struct timespec *time,
+        int level,
+        const char *text
+);
+
+static void *server_log_writer(void *arg);
+
+int server_log_level = SERVER_LOG_INFO;
+
+static FILE *server_log_stream = NULL;
+
+static const char *server_log_names[] = {"error", "warn", "info", "debug"};
+
+/** Rings of every thread, only ever added at the head. */
+static struct server_log_ring *_Atomic server_log_rings = NULL;
+
+static _Thread_local struct server_log_ring *server_log_local = NULL;
+
+static pthread_key_t server_log_key;
+
+static pthread_t server_log_thread;
+
+static atomic_int server_log_running = 0;
+
+int server_log_open(int level, FILE *stream) {
+
+    server_log_level = level;
+    server_log_stream = stream;
+
+    if (pthread_key_create(&server_log_key, &server_log_release) != 0) {
+        return -1;
+    }
+
+    atomic_store(&server_log_running, 1);
+    if (pthread_create(
+            &server_log_thread, NULL,
+            &server_log_writer,
+            NULL
+    ) != 0) {
+        atomic_store(&server_log_running, 0);
+        return -1;
+    }
+
+    return 0;
+}
+
+void server_log_close() {
+
+    if (!atomic_exchange(&server_log_running, 0)) return;
+
+    pthread_join(server_log_thread, NULL);
+    server_log_drain();
+    fflush(server_log_stream);
+}
+
+int server_log_parse_level(const char *name) {
+
+    for (int level = 0; level <= SERVER_LOG_DEBUG; level++) {
+        if (strcmp(name, server_log_names[level]) == 0) return level;
+    }
+
+    return -1;
+}
+
+void server_log_write(int level, const char *format, ...) {
+
+    va_list args;
+    va_start(args, format);
+
+    struct server_log_ring *ring = NULL;
+    if (atomic_load_explicit(&server_log_running, memory_order_acquire)) {
+        ring = server_log_ring();
+    }
+
+    // Without writer, the message is written at once
+    if (ring == NULL) {
+        char text[SERVER_LOG_LINE_SIZE];
+        struct timespec time;
+        timespec_get(&time, TIME_UTC);
+        vsnprintf(text, sizeof text, format, args);
+        server_log_print(&time, level, text);
+        va_end(args);
+        return;
+    }
+
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail == SERVER_LOG_RING_SIZE) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        va_end(args);
+        return;
+    }
+
+    struct server_log_record *record =
+            &ring->records[head % SERVER_LOG_RING_SIZE];
+    timespec_get(&record->time, TIME_UTC);
+    record->level = level;
+    vsnprintf(record->text, sizeof record->text, format, args);
+    va_end(args);
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/* -------------------------------------------------------------------------- */
+
+struct server_log_ring *server_log_ring() {
+
+    if (server_log_local != NULL) return server_log_local;
+
+    struct server_log_ring *ring = atomic_load(&server_log_rings);
+    while (ring != NULL) {
+        int released = 0;
+        if (atomic_compare_exchange_strong(&ring->owned, &released, 1)) break;
+        ring = ring->next;
+    }
+
+    if (ring == NULL) {
+        ring = calloc(1, sizeof *ring);
+        if (ring == NULL) return NULL;
+        atomic_init(&ring->owned, 1);
+        ring->next = atomic_load(&server_log_rings);
+        while (!atomic_compare_exchange_weak(
+                &server_log_rings,
+                &ring->next, ring
+        ));
+    }
+
+    pthread_setspecific(server_log_key, ring);
+    server_log_local = ring;
+    return ring;
+}
+
+void server_log_release(void *ring) {
+    atomic_store(&((struct server_log_ring *) ring)->owned, 0);
+}
+
+size_t server_log_drain() {
+
+    size_t count = 0;
+
+    struct server_log_ring *ring = atomic_load(&server_log_rings);
+    for (; ring != NULL; ring = ring->next) {
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+        for (; tail != head; tail++) {
+            struct server_log_record *record =
+                    &ring->records[tail % SERVER_LOG_RING_SIZE];
+            server_log_print(&record->time, record->level, record->text);
+            atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+            count++;
+        }
+
+        size_t dropped = atomic_exchange_explicit(
+                &ring->dropped, 0,
+                memory_order_relaxed
+        );
+        if (dropped > 0) {
+            struct timespec time;
+            timespec_get(&time, TIME_UTC);
+            char text[64];
+            snprintf(text, sizeof text, "%zu messages dropped", dropped);
+            server_log_print(&time, SERVER_LOG_WARN, text);
+        }
+    }
+
+    if (count > 0) fflush(server_log_stream);
+
+    return count;
+}
+
+void server_log_print(
+        const struct timespec *time,
+        int level,
+        const char *text
+) {
+    FILE *stream = (server_log_stream != NULL) ? server_log_stream : stdout;
+    char clock[16];
+    struct tm local;
+
+#ifdef WIN32
+    localtime_s(&local, &time->tv_sec);
+#else
+    localtime_r(&time->tv_sec, &local);
+#endif
+    strftime(clock, sizeof clock, "%H:%M:%S", &local);
+    fprintf(
+            stream,
+            "%s.%03ld %-5s %s\n",
+            clock, time->tv_nsec / 1000000,
+            server_log_names[level], text
+    );
+}
+
+void *server_log_writer(void *arg) {
+
+    while (atomic_load(&server_log_running)) {
+        if (server_log_drain() == 0) {
+#ifdef WIN32
+            Sleep(SERVER_LOG_IDLE);
+#else
+            struct timespec idle = {.tv_nsec = SERVER_LOG_IDLE * 1000000L};
+            nanosleep(&idle, NULL);
+#endif
+        }
+    }
+
+    return NULL;
+}
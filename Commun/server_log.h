@@ -0,0 +1,79 @@
+#ifndef SERVER_LOG_H
+#define SERVER_LOG_H
+
+#include <stdio.h>
+
+/** Failures. */
+#define SERVER_LOG_ERROR 0
+
+/** Unexpected events the server recovers from. */
+#define SERVER_LOG_WARN 1
+
+/** Lifecycle of the server and its clients. */
+#define SERVER_LOG_INFO 2
+
+/** Every request and reply. */
+#define SERVER_LOG_DEBUG 3
+
+/**
+ * Number of messages a thread may have waiting for the writer. Messages logged
+ * while its buffer is full are dropped, and counted.
+ */
+#define SERVER_LOG_RING_SIZE 256
+
+/**
+ * Largest length of a message, longer ones being truncated.
+ */
+#define SERVER_LOG_LINE_SIZE 240
+
+/**
+ * Most detailed level of the messages written. Read without synchronization
+ * by the logging threads.
+ */
+extern int server_log_level;
+
+/**
+ * Tells whether the messages of a given level are written, so that the values
+ * logged are computed only when needed.
+ */
+#define SERVER_LOG_ENABLED(level) ((level) <= server_log_level)
+
+/**
+ * Logs a message, formatted as by printf. Costs a single comparison when the
+ * level is disabled, the arguments not being evaluated.
+ */
+#define SERVER_LOG(level, ...) \
+    do { \
+        if (SERVER_LOG_ENABLED(level)) server_log_write((level), __VA_ARGS__); \
+    } while (0)
+
+/**
+ * Starts the background writer. Messages are then formatted in a buffer of
+ * the logging thread, and written by the writer thread. Before, they are
+ * written synchronously to the standard output.
+ *
+ * @param level most detailed level of the messages written
+ * @param stream stream the messages are written to
+ *
+ * @return 0 on success, -1 if the writer thread could not start
+ */
+extern int server_log_open(int level, FILE *stream);
+
+/**
+ * Writes the waiting messages and stops the background writer.
+ */
+extern void server_log_close();
+
+/**
+ * Gets a level from its name : "error", "warn", "info" or "debug".
+ *
+ * @return the level, or -1 if the name is unknown
+ */
+extern int server_log_parse_level(const char *name);
+
+/**
+ * Logs a message, whatever its level. See SERVER_LOG.
+ */
+extern void server_log_write(int level, const char *format, ...);
+
+#endif
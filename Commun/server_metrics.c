@@ -0,0 +1,343 @@
+#ifdef WIN32
+#include <windows.h>
+#else
+#define _GNU_SOURCE
+#include <unistd.h>
+#endif
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "server_metrics.h"
+#include "user_database_protocol.h"
+
+/**
+ * Number of buckets per power of two of the latency histograms, as a power of
+ * two : latencies are recorded within 1 / 2^3 = 12.5%.
+ */
+#define SERVER_METRICS_SUB_BITS 3
+
+/**
+ * Largest latency recorded, as a power of two of nanoseconds : about 18
+ * minutes. Longer latencies are recorded as this one.
+ */
+#define SERVER_METRICS_MAX_BITS 40
+
+/**
+ * Number of buckets of a latency histogram.
+ */
+#define SERVER_METRICS_BUCKETS \
+    ((SERVER_METRICS_MAX_BITS - SERVER_METRICS_SUB_BITS + 1) \
+     << SERVER_METRICS_SUB_BITS)
+
+/**
+ * Metrics of a command.
+ */
+struct server_metrics_command {
+    _Atomic uint64_t requests;
+    _Atomic uint64_t statuses[SERVER_METRICS_STATUSES];
+    _Atomic uint64_t buckets[SERVER_METRICS_BUCKETS];
+};
+
+/**
+ * Gets the current time of a monotonic clock, in nanoseconds.
+ */
+static uint64_t server_metrics_now();
+
+/**
+ * Gets the bucket of a latency : values below 2^(SUB_BITS + 1) have a bucket
+ * each, larger ones share 2^SUB_BITS buckets per power of two.
+ */
+static size_t server_metrics_bucket(uint64_t latency);
+
+/**
+ * Gets the smallest latency of a bucket.
+ */
+static uint64_t server_metrics_lowest(size_t bucket);
+
+/**
+ * Gets a percentile of a command latency.
+ *
+ * @param counts the bucket counts of the command
+ * @param total the sum of the counts
+ * @param percentile the percentile, between 0 and 1
+ *
+ * @return the highest latency of the bucket holding the percentile, in
+ *         nanoseconds
+ */
+static uint64_t server_metrics_percentile(
+        const uint64_t *counts,
+        uint64_t total,
+        double percentile
+);
+
+/**
+ * Writes the report to the dump file.
+ */
+static void server_metrics_dump();
+
+static void *server_metrics_dumper(void *arg);
+
+static struct server_metrics_command
+        server_metrics_commands[SERVER_METRICS_COMMANDS];
+
+static _Atomic int64_t server_metrics_in_flight = 0;
+
+static const char *server_metrics_statuses[SERVER_METRICS_STATUSES] = {
+        [-USER_STATUS_INVALID_CREDENTIALS] = "invalid credentials",
+        [-USER_STATUS_ALREADY_EXISTS] = "already exists",
+        [-USER_STATUS_NOT_EXISTS] = "not found",
+        [-USER_STATUS_ALREADY_CONNECTED] = "already connected",
+        [-USER_STATUS_NOT_CONNECTED] = "not connected",
+        [-USER_STATUS_UNKNOWN_COMMAND] = "unknown command",
+        [-USER_STATUS_MALFORMED] = "malformed",
+        [-USER_STATUS_UNAVAILABLE] = "unavailable",
+        [-USER_STATUS_INTERNAL_ERROR] = "internal error"
+};
+
+static const char *server_metrics_path = NULL;
+
+static unsigned server_metrics_interval = SERVER_METRICS_INTERVAL;
+
+static pthread_t server_metrics_thread;
+
+static atomic_int server_metrics_dumping = 0;
+
+uint64_t server_metrics_begin() {
+
+    atomic_fetch_add_explicit(
+            &server_metrics_in_flight, 1,
+            memory_order_relaxed
+    );
+
+    return server_metrics_now();
+}
+
+void server_metrics_end(uint8_t opcode, int8_t status, uint64_t begin) {
+
+    uint64_t latency = server_metrics_now() - begin;
+
+    if (opcode >= SERVER_METRICS_COMMANDS) opcode = 0;
+    struct server_metrics_command *command = &server_metrics_commands[opcode];
+
+    // Truncated lists are successes
+    size_t index = (status > 0) ? 0 : (size_t) -status;
+    if (index >= SERVER_METRICS_STATUSES) index = -USER_STATUS_INTERNAL_ERROR;
+
+    atomic_fetch_add_explicit(&command->requests, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(
+            &command->statuses[index], 1,
+            memory_order_relaxed
+    );
+    atomic_fetch_add_explicit(
+            &command->buckets[server_metrics_bucket(latency)], 1,
+            memory_order_relaxed
+    );
+    atomic_fetch_sub_explicit(
+            &server_metrics_in_flight, 1,
+            memory_order_relaxed
+    );
+}
+
+size_t server_metrics_render(char *buffer, size_t size) {
+
+    uint64_t counts[SERVER_METRICS_BUCKETS];
+    size_t length = 0;
+
+    if (size > 0) *buffer = '\0';
+
+    server_metrics_print(
+            buffer, size, &length,
+            "Requests in flight : %lld",
+            (long long) atomic_load_explicit(
+                    &server_metrics_in_flight,
+                    memory_order_relaxed
+            )
+    );
+
+    for (size_t c = 0; c < SERVER_METRICS_COMMANDS; c++) {
+        struct server_metrics_command *command = &server_metrics_commands[c];
+
+        uint64_t requests = atomic_load_explicit(
+                &command->requests,
+                memory_order_relaxed
+        );
+        if (requests == 0) continue;
+
+        uint64_t total = 0;
+        for (size_t b = 0; b < SERVER_METRICS_BUCKETS; b++) {
+            counts[b] = atomic_load_explicit(
+                    &command->buckets[b],
+                    memory_order_relaxed
+            );
+            total += counts[b];
+        }
+
+        const char *name = user_message_name((uint8_t) c);
+        server_metrics_print(
+                buffer, size, &length,
+                "\n%s : %llu, p50 %.1f us, p99 %.1f us, p999 %.1f us",
+                (name != NULL) ? name : "other",
+                (unsigned long long) requests,
+                (double) server_metrics_percentile(counts, total, .5) / 1e3,
+                (double) server_metrics_percentile(counts, total, .99) / 1e3,
+                (double) server_metrics_percentile(counts, total, .999) / 1e3
+        );
+
+        for (size_t s = 1; s < SERVER_METRICS_STATUSES; s++) {
+            uint64_t count = atomic_load_explicit(
+                    &command->statuses[s],
+                    memory_order_relaxed
+            );
+            if (count > 0 && server_metrics_statuses[s] != NULL) {
+                server_metrics_print(
+                        buffer, size, &length,
+                        ", %s %llu",
+                        server_metrics_statuses[s],
+                        (unsigned long long) count
+                );
+            }
+        }
+    }
+
+    return length;
+}
+
+int server_metrics_dump_start(const char *path, unsigned interval) {
+
+    server_metrics_path = path;
+    server_metrics_interval = (interval > 0) ? interval : 1;
+
+    atomic_store(&server_metrics_dumping, 1);
+    if (pthread_create(
+            &server_metrics_thread, NULL,
+            &server_metrics_dumper,
+            NULL
+    ) != 0) {
+        atomic_store(&server_metrics_dumping, 0);
+        return -1;
+    }
+
+    return 0;
+}
+
+void server_metrics_dump_stop() {
+
+    if (!atomic_exchange(&server_metrics_dumping, 0)) return;
+
+    pthread_join(server_metrics_thread, NULL);
+    server_metrics_dump();
+}
+
+/* -------------------------------------------------------------------------- */
+
+void server_metrics_print(
+        char *buffer,
+        size_t size,
+        size_t *length,
+        const char *format,
+        ...
+) {
+    if (*length + 1 >= size) return;
+
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buffer + *length, size - *length, format, args);
+    va_end(args);
+
+    // A truncated report ends with the buffer
+    if (n > 0) *length += ((size_t) n < size - *length) ? (size_t) n
+                                                          : size - *length - 1;
+}
+
+uint64_t server_metrics_now() {
+    struct timespec now;
+#ifdef WIN32
+    timespec_get(&now, TIME_UTC);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &now);
+#endif
+    return (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+}
+
+size_t server_metrics_bucket(uint64_t latency) {
+
+    if (latency >> SERVER_METRICS_MAX_BITS) {
+        latency = ((uint64_t) 1 << SERVER_METRICS_MAX_BITS) - 1;
+    }
+    if (latency < (1 << SERVER_METRICS_SUB_BITS)) return (size_t) latency;
+
+    int msb = 63 - __builtin_clzll(latency);
+    int shift = msb - SERVER_METRICS_SUB_BITS;
+    return ((size_t) shift << SERVER_METRICS_SUB_BITS)
+           + (size_t) (latency >> shift);
+}
+
+uint64_t server_metrics_lowest(size_t bucket) {
+
+    if (bucket < (1 << SERVER_METRICS_SUB_BITS)) return bucket;
+
+    size_t shift = (bucket >> SERVER_METRICS_SUB_BITS) - 1;
+    uint64_t mantissa = (bucket & ((1 << SERVER_METRICS_SUB_BITS) - 1))
+                        | (1 << SERVER_METRICS_SUB_BITS);
+    return mantissa << shift;
+}
+
+uint64_t server_metrics_percentile(
+        const uint64_t *counts,
+        uint64_t total,
+        double percentile
+) {
+    if (total == 0) return 0;
+
+    uint64_t rank = (uint64_t) ((double) total * percentile);
+    if (rank >= total) rank = total - 1;
+
+    uint64_t seen = 0;
+    size_t bucket = 0;
+    while (bucket < SERVER_METRICS_BUCKETS - 1
+           && (seen += counts[bucket]) <= rank) {
+        bucket++;
+    }
+
+    return server_metrics_lowest(bucket + 1) - 1;
+}
+
+void server_metrics_dump() {
+
+    char report[SERVER_METRICS_REPORT_SIZE];
+    size_t length = server_metrics_render(report, sizeof report);
+
+    FILE *file = fopen(server_metrics_path, "w");
+    if (file == NULL) {
+        perror("Opening metrics file");
+        return;
+    }
+    fwrite(report, 1, length, file);
+    fputc('\n', file);
+    fclose(file);
+}
+
+void *server_metrics_dumper(void *arg) {
+
+    unsigned elapsed = 0;
+
+    // Wakes up every second, to stop quickly
+    while (atomic_load(&server_metrics_dumping)) {
+#ifdef WIN32
+        Sleep(1000);
+#else
+        sleep(1);
+#endif
+        if (++elapsed >= server_metrics_interval) {
+            server_metrics_dump();
+            elapsed = 0;
+        }
+    }
+
+    return NULL;
+}
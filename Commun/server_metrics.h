@@ -0,0 +1,93 @@
+#ifndef SERVER_METRICS_H
+#define SERVER_METRICS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Number of opcodes tracked, larger ones being counted with opcode 0.
+ */
+#define SERVER_METRICS_COMMANDS 16
+
+/**
+ * Number of statuses tracked, indexed by their opposite. Other statuses are
+ * counted as internal errors.
+ */
+#define SERVER_METRICS_STATUSES 16
+
+/**
+ * Default interval between dumps of the metrics to a file, in seconds.
+ */
+#define SERVER_METRICS_INTERVAL 10
+
+/**
+ * Size of a buffer holding a full report.
+ */
+#define SERVER_METRICS_REPORT_SIZE 8192
+
+/*
+ * The metrics are updated by relaxed atomic increments, and may be read while
+ * requests are served : a report may count a request in a command and not yet
+ * in its latencies.
+ */
+
+/**
+ * Counts a request as in flight.
+ *
+ * @return the time the request started, to be given to server_metrics_end
+ */
+extern uint64_t server_metrics_begin();
+
+/**
+ * Counts a request as served.
+ *
+ * @param opcode opcode of the request, 0 if it was not understood
+ * @param status status of its reply
+ * @param begin time the request started
+ */
+extern void server_metrics_end(uint8_t opcode, int8_t status, uint64_t begin);
+
+/**
+ * Reports the metrics : for each command served, the number of requests and
+ * failures, and the 50th, 99th and 99.9th percentiles of the latency.
+ *
+ * @param buffer the null-terminated report
+ * @param size size of the buffer
+ *
+ * @return the length of the report, truncated if the buffer is too small
+ */
+extern size_t server_metrics_render(char *buffer, size_t size);
+
+/**
+ * Appends to a report, formatted as by printf. Once the buffer is full, the
+ * report is truncated and nothing more is appended.
+ *
+ * @param buffer the null-terminated report
+ * @param size size of the buffer
+ * @param length length of the report, updated
+ */
+extern void server_metrics_print(
+        char *buffer,
+        size_t size,
+        size_t *length,
+        const char *format,
+        ...
+);
+
+/**
+ * Starts rewriting the report to a file at a regular interval, from a
+ * background thread.
+ *
+ * @param path path to the file
+ * @param interval interval between writes, in seconds
+ *
+ * @return 0 on success, -1 if the thread could not start
+ */
+extern int server_metrics_dump_start(const char *path, unsigned interval);
+
+/**
+ * Writes the report a last time, and stops the background thread.
+ */
+extern void server_metrics_dump_stop();
+
+#endif
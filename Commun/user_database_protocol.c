@@ -0,0 +1,434 @@
+#ifdef WIN32
+#define strtok_r strtok_s
+#define strncasecmp _strnicmp
+#else
+#include <strings.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "user_database_protocol.h"
+#include "little_endian.h"
+
+#define TOKEN_DELIMITER " "
+
+/**
+ * Number of sentence templates of a command, indexed by the opposite of the
+ * reply status.
+ */
+#define USER_TEMPLATES 8
+
+/**
+ * Renders a sentence from its template.
+ */
+typedef void (*user_formatter)(
+        const char *template,
+        const struct user_message *request,
+        const struct user_message *reply,
+        char *buffer,
+        size_t size
+);
+
+/**
+ * Sentence replying to a command.
+ */
+struct user_sentence {
+    const char *template;
+    user_formatter format;
+};
+
+/**
+ * Command of the text format.
+ */
+struct user_command {
+    const char *name;
+    size_t argc;
+    user_formatter format; // Renders the templates below
+    const char *templates[USER_TEMPLATES];
+};
+
+static void format_text(
+        const char *template,
+        const struct user_message *request,
+        const struct user_message *reply,
+        char *buffer,
+        size_t size
+);
+
+static void format_id(
+        const char *template,
+        const struct user_message *request,
+        const struct user_message *reply,
+        char *buffer,
+        size_t size
+);
+
+static void format_user(
+        const char *template,
+        const struct user_message *request,
+        const struct user_message *reply,
+        char *buffer,
+        size_t size
+);
+
+static void format_name(
+        const char *template,
+        const struct user_message *request,
+        const struct user_message *reply,
+        char *buffer,
+        size_t size
+);
+
+static void format_list(
+        const char *template,
+        const struct user_message *request,
+        const struct user_message *reply,
+        char *buffer,
+        size_t size
+);
+
+/**
+ * Commands, indexed by opcode.
+ */
+static const struct user_command user_commands[] = {
+        [USER_OP_CREATE] = {
+                "create", 2, format_user, {
+                        [-USER_STATUS_OK] = "User %.*s#%llu created.",
+                        [-USER_STATUS_ALREADY_EXISTS] =
+                        "User %.*s#%llu already exists."
+                }
+        },
+        [USER_OP_DELETE] = {
+                "delete", 2, format_id, {
+                        [-USER_STATUS_OK] = "User #%llu deleted."
+                }
+        },
+        [USER_OP_LOGIN] = {
+                "login", 2, format_id, {
+                        [-USER_STATUS_OK] = "User #%llu logged in.",
+                        // The former server ended this sentence on login only
+                        [-USER_STATUS_INVALID_CREDENTIALS] =
+                        "Invalid credentials.",
+                        [-USER_STATUS_ALREADY_CONNECTED] =
+                        "User #%llu is already connected."
+                }
+        },
+        [USER_OP_LOGOUT] = {
+                "logout", 2, format_id, {
+                        [-USER_STATUS_OK] = "User #%llu logged out.",
+                        [-USER_STATUS_NOT_CONNECTED] =
+                        "User #%llu is not connected."
+                }
+        },
+        [USER_OP_PASSWORD] = {
+                "password", 3, format_id, {
+                        [-USER_STATUS_OK] = "Password changed for user #%llu."
+                }
+        },
+        [USER_OP_LIST] = {
+                "list", 0, format_list, {
+                        [-USER_STATUS_OK] = "No user connected."
+                }
+        },
+        [USER_OP_STATS] = {
+                "stats", 0, format_list, {
+                        [-USER_STATUS_OK] = "No metrics."
+                }
+        }
+};
+
+/**
+ * Sentences shared by every command, indexed by the opposite of the status.
+ */
+static const struct user_sentence user_sentences[] = {
+        [-USER_STATUS_INVALID_CREDENTIALS] = {
+                "Invalid credentials", format_text
+        },
+        [-USER_STATUS_NOT_EXISTS] = {"User #%llu not found.", format_id},
+        [-USER_STATUS_UNKNOWN_COMMAND] = {"Unknown command: %.*s", format_name},
+        [-USER_STATUS_MALFORMED] = {"Missing arguments.", format_text},
+        [-USER_STATUS_UNAVAILABLE] = {
+                "Account service unavailable.", format_text
+        },
+        [-USER_STATUS_INTERNAL_ERROR] = {"Internal error.", format_text}
+};
+
+/**
+ * Finds a command by name, case-insensitively. Names are told apart by their
+ * length, then their first letter, so that a single comparison is made.
+ *
+ * @return the opcode of the command, or 0 if there is none
+ */
+static uint8_t user_command_find(const char *name, size_t length);
+
+int user_message_is_binary(const void *buffer, size_t length) {
+    return length > 0 && *(const uint8_t *) buffer == USER_PROTOCOL_MAGIC;
+}
+
+size_t user_message_encode(
+        const struct user_message *message,
+        void *buffer,
+        size_t size
+) {
+    size_t length = USER_PROTOCOL_HEADER_SIZE + message->length;
+    if (message->length > USER_PROTOCOL_PAYLOAD_MAX || length > size) return 0;
+
+    uint8_t *bytes = buffer;
+    memset(bytes, 0, USER_PROTOCOL_HEADER_SIZE);
+    bytes[0] = USER_PROTOCOL_MAGIC;
+    bytes[1] = USER_PROTOCOL_VERSION;
+    bytes[2] = message->opcode;
+    bytes[3] = (uint8_t) message->status;
+    store_le(bytes + 4, message->request_id, 4);
+    store_le(bytes + 8, message->user_id, 8);
+    store_le(bytes + 16, message->hash, 8);
+    store_le(bytes + 24, message->new_hash, 8);
+    store_le(bytes + 32, message->length, 2);
+    if (message->length > 0) {
+        memmove(bytes + USER_PROTOCOL_HEADER_SIZE, message->payload,
+                message->length);
+    }
+
+    return length;
+}
+
+int user_message_decode(
+        const void *buffer,
+        size_t length,
+        struct user_message *message
+) {
+    const uint8_t *bytes = buffer;
+
+    if (length < USER_PROTOCOL_HEADER_SIZE
+        || bytes[0] != USER_PROTOCOL_MAGIC
+        || bytes[1] != USER_PROTOCOL_VERSION) {
+        return -1;
+    }
+
+    message->opcode = bytes[2];
+    message->status = (int8_t) bytes[3];
+    message->request_id = (uint32_t) load_le(bytes + 4, 4);
+    message->user_id = load_le(bytes + 8, 8);
+    message->hash = load_le(bytes + 16, 8);
+    message->new_hash = load_le(bytes + 24, 8);
+    message->length = (size_t) load_le(bytes + 32, 2);
+    message->payload = (const char *) bytes + USER_PROTOCOL_HEADER_SIZE;
+
+    return (USER_PROTOCOL_HEADER_SIZE + message->length <= length) ? 0 : -1;
+}
+
+int user_message_next(
+        const void *batch,
+        size_t length,
+        size_t *offset,
+        struct user_message *message
+) {
+    if (*offset >= length
+        || user_message_decode(
+            (const uint8_t *) batch + *offset,
+            length - *offset,
+            message
+    ) < 0) {
+        return -1;
+    }
+
+    *offset += USER_PROTOCOL_HEADER_SIZE + message->length;
+    return 0;
+}
+
+int user_message_parse(char *command, struct user_message *message) {
+
+    char *state;
+    char *name = strtok_r(command, TOKEN_DELIMITER, &state);
+    char *args[3];
+    size_t argc = 0;
+
+    char *arg;
+    while (argc < 3
+           && (arg = strtok_r(NULL, TOKEN_DELIMITER, &state)) != NULL) {
+        args[argc++] = arg;
+    }
+
+    *message = (struct user_message) {
+            .status = USER_STATUS_OK,
+            .payload = (name != NULL) ? name : "",
+            .length = (name != NULL) ? strlen(name) : 0
+    };
+
+    message->opcode = user_command_find(message->payload, message->length);
+    if (message->opcode == 0) {
+        message->status = USER_STATUS_UNKNOWN_COMMAND;
+        return -1;
+    }
+
+    if (argc < user_commands[message->opcode].argc) {
+        message->status = USER_STATUS_MALFORMED;
+        return -1;
+    }
+
+    switch (message->opcode) {
+        case USER_OP_CREATE:
+            message->payload = args[0];
+            message->length = strlen(args[0]);
+            message->hash = strtoull(args[1], NULL, 10);
+            break;
+        case USER_OP_PASSWORD:
+            message->new_hash = strtoull(args[2], NULL, 10);
+            // Fall through
+        case USER_OP_DELETE:
+        case USER_OP_LOGIN:
+        case USER_OP_LOGOUT:
+            message->user_id = strtoull(args[0], NULL, 10);
+            message->hash = strtoull(args[1], NULL, 10);
+            // Fall through
+        default:
+            message->length = 0;
+            break;
+    }
+
+    return 0;
+}
+
+const char *user_message_name(uint8_t opcode) {
+    return (opcode < sizeof user_commands / sizeof *user_commands)
+           ? user_commands[opcode].name : NULL;
+}
+
+void user_message_render(
+        const struct user_message *request,
+        const struct user_message *reply,
+        char *buffer,
+        size_t size
+) {
+    // Truncated lists are rendered as complete ones
+    size_t status = (reply->status > 0) ? 0 : (size_t) -reply->status;
+
+    if (status < USER_TEMPLATES
+        && request->opcode < sizeof user_commands / sizeof *user_commands) {
+        const struct user_command *command = &user_commands[request->opcode];
+        if (command->templates[status] != NULL) {
+            command->format(
+                    command->templates[status],
+                    request, reply,
+                    buffer, size
+            );
+            return;
+        }
+    }
+
+    if (status >= sizeof user_sentences / sizeof *user_sentences
+        || user_sentences[status].template == NULL) {
+        status = -USER_STATUS_INTERNAL_ERROR;
+    }
+    user_sentences[status].format(
+            user_sentences[status].template,
+            request, reply,
+            buffer, size
+    );
+}
+
+/* -------------------------------------------------------------------------- */
+
+uint8_t user_command_find(const char *name, size_t length) {
+
+    uint8_t opcode;
+    switch (length) {
+        case 4:
+            opcode = USER_OP_LIST;
+            break;
+        case 5:
+            switch (name[0] | 0x20) {
+                case 'l':
+                    opcode = USER_OP_LOGIN;
+                    break;
+                case 's':
+                    opcode = USER_OP_STATS;
+                    break;
+                default:
+                    return 0;
+            }
+            break;
+        case 6:
+            switch (name[0] | 0x20) {
+                case 'c':
+                    opcode = USER_OP_CREATE;
+                    break;
+                case 'd':
+                    opcode = USER_OP_DELETE;
+                    break;
+                case 'l':
+                    opcode = USER_OP_LOGOUT;
+                    break;
+                default:
+                    return 0;
+            }
+            break;
+        case 8:
+            opcode = USER_OP_PASSWORD;
+            break;
+        default:
+            return 0;
+    }
+
+    return (strncasecmp(name, user_commands[opcode].name, length) == 0)
+           ? opcode : 0;
+}
+
+void format_text(
+        const char *template,
+        const struct user_message *request,
+        const struct user_message *reply,
+        char *buffer,
+        size_t size
+) {
+    snprintf(buffer, size, "%s", template);
+}
+
+void format_id(
+        const char *template,
+        const struct user_message *request,
+        const struct user_message *reply,
+        char *buffer,
+        size_t size
+) {
+    snprintf(buffer, size, template, (unsigned long long) request->user_id);
+}
+
+void format_user(
+        const char *template,
+        const struct user_message *request,
+        const struct user_message *reply,
+        char *buffer,
+        size_t size
+) {
+    snprintf(
+            buffer, size, template,
+            (int) request->length, request->payload,
+            (unsigned long long) reply->user_id
+    );
+}
+
+void format_name(
+        const char *template,
+        const struct user_message *request,
+        const struct user_message *reply,
+        char *buffer,
+        size_t size
+) {
+    snprintf(buffer, size, template, (int) request->length, request->payload);
+}
+
+void format_list(
+        const char *template,
+        const struct user_message *request,
+        const struct user_message *reply,
+        char *buffer,
+        size_t size
+) {
+    if (reply->length == 0) {
+        snprintf(buffer, size, "%s", template);
+    } else {
+        snprintf(buffer, size, "%.*s", (int) reply->length, reply->payload);
+    }
+}
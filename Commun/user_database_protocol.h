@@ -0,0 +1,203 @@
+#ifndef USER_DATABASE_PROTOCOL_H
+#define USER_DATABASE_PROTOCOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * First byte of a binary message. Text commands never start with it, so both
+ * formats are told apart on the same port.
+ */
+#define USER_PROTOCOL_MAGIC 0xA5
+
+/**
+ * Version of the binary message layout.
+ */
+#define USER_PROTOCOL_VERSION 1
+
+/**
+ * Size of the fixed part of a binary message. Every integer is little-endian :
+ *
+ * <pre>
+ *   0  magic (1)          1  version (1)       2  opcode (1)
+ *   3  status (1)         4  request id (4)    8  user id (8)
+ *  16  hash (8)          24  new hash (8)     32  payload length (2)
+ *  34  reserved (6)
+ * </pre>
+ *
+ * The payload follows : the username of a creation request, the list of a list
+ * reply.
+ */
+#define USER_PROTOCOL_HEADER_SIZE 40
+
+/**
+ * Largest payload of a binary message, so that it fits a 1024 bytes datagram
+ * with room for a terminating null byte.
+ */
+#define USER_PROTOCOL_PAYLOAD_MAX (1023 - USER_PROTOCOL_HEADER_SIZE)
+
+/** Creates an user : payload is the username, hash the password. */
+#define USER_OP_CREATE 1
+
+/** Deletes an user. */
+#define USER_OP_DELETE 2
+
+/** Logs an user in. */
+#define USER_OP_LOGIN 3
+
+/** Logs an user out. */
+#define USER_OP_LOGOUT 4
+
+/** Changes an user's password from hash to new hash. */
+#define USER_OP_PASSWORD 5
+
+/** Lists the online users : the reply payload holds their names. */
+#define USER_OP_LIST 6
+
+/**
+ * Runs several requests in one pass : the payload holds encoded messages one
+ * after the other, and so does the reply payload, in the same order.
+ */
+#define USER_OP_BATCH 7
+
+/** Gets the metrics of the service : the reply payload holds their report. */
+#define USER_OP_STATS 8
+
+
+/** Operation successful. */
+#define USER_STATUS_OK 0
+
+/** Operation partially successful : output was truncated */
+#define USER_STATUS_TRUNCATED 1
+
+/** Operation failed : invalid username or password */
+#define USER_STATUS_INVALID_CREDENTIALS (-1)
+
+/** Operation failed : user already exists */
+#define USER_STATUS_ALREADY_EXISTS (-2)
+
+/** Operation failed : user does not exist */
+#define USER_STATUS_NOT_EXISTS (-3)
+
+/** Operation failed : user already connected */
+#define USER_STATUS_ALREADY_CONNECTED (-4)
+
+/** Operation failed : user not connected */
+#define USER_STATUS_NOT_CONNECTED (-5)
+
+/** Request failed : unknown command */
+#define USER_STATUS_UNKNOWN_COMMAND (-6)
+
+/** Request failed : missing or invalid arguments */
+#define USER_STATUS_MALFORMED (-7)
+
+/** Request failed : the account service didn't answer */
+#define USER_STATUS_UNAVAILABLE (-8)
+
+/** Server error */
+#define USER_STATUS_INTERNAL_ERROR (-10)
+
+/**
+ * Request to the account service, or its reply.
+ */
+struct user_message {
+    uint8_t opcode;
+    int8_t status;
+    uint32_t request_id;
+    uint64_t user_id;
+    uint64_t hash;
+    uint64_t new_hash;
+    size_t length;
+    const char *payload; // Not null-terminated
+};
+
+/**
+ * Tells whether a datagram holds a binary message rather than a text command.
+ */
+extern int user_message_is_binary(const void *buffer, size_t length);
+
+/**
+ * Encodes a message in the binary format.
+ *
+ * @param message the message
+ * @param buffer the encoded message
+ * @param size size of the buffer
+ *
+ * @return the length of the encoded message, or 0 if it doesn't fit
+ */
+extern size_t user_message_encode(
+        const struct user_message *message,
+        void *buffer,
+        size_t size
+);
+
+/**
+ * Decodes a binary message. The payload is not copied : it points into the
+ * buffer.
+ *
+ * @param buffer the encoded message
+ * @param length length of the encoded message
+ * @param message the decoded message
+ *
+ * @return 0 on success, -1 if the message is truncated or of another version
+ */
+extern int user_message_decode(
+        const void *buffer,
+        size_t length,
+        struct user_message *message
+);
+
+/**
+ * Decodes the next message of a batch payload.
+ *
+ * @param batch the batch payload
+ * @param length length of the batch payload
+ * @param offset offset of the message in the batch, moved past it
+ * @param message the decoded message
+ *
+ * @return 0 on success, -1 at the end of the batch or if it is truncated
+ */
+extern int user_message_next(
+        const void *batch,
+        size_t length,
+        size_t *offset,
+        struct user_message *message
+);
+
+/**
+ * Parses a text command, such as "login 42 1234", into a request. The command
+ * is split in place, and the payload points into it.
+ *
+ * @param command the null-terminated command
+ * @param message the request; on failure, its status tells why, and its payload
+ *                holds the command name
+ *
+ * @return 0 on success, -1 if the command is unknown or misses arguments
+ */
+extern int user_message_parse(char *command, struct user_message *message);
+
+/**
+ * Gets the name of a text command.
+ *
+ * @param opcode opcode of the command
+ *
+ * @return the name, or NULL if there is no such command
+ */
+extern const char *user_message_name(uint8_t opcode);
+
+/**
+ * Renders the reply to a request as a sentence, such as "User #42 logged in.".
+ *
+ * @param request the request
+ * @param reply its reply, or the request itself if it failed to parse
+ * @param buffer the null-terminated sentence
+ * @param size size of the buffer
+ */
+extern void user_message_render(
+        const struct user_message *request,
+        const struct user_message *reply,
+        char *buffer,
+        size_t size
+);
+
+#endif
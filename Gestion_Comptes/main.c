@@ -3,14 +3,18 @@
 #include <winsock2.h>
 #include <windows.h>
 #include <ws2tcpip.h>
+#define strtok_r strtok_s
 
 #elif defined(linux)
 
+#define _GNU_SOURCE
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
 #define INVALID_SOCKET -1
 #define SOCKET_ERROR -1
 #define closesocket(s) close(s)
@@ -28,35 +32,296 @@ typedef struct sockaddr SOCKADDR;
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <getopt.h>
+#include <time.h>
 #include "user_database_engine.h"
+#include "user_database_journal.h"
+#include "user_database_protocol.h"
+#include "server_log.h"
+#include "server_metrics.h"
 
 #define PORT 24030
 
-SOCKET sock;
+/**
+ * Default interval between background snapshots of the database, in seconds.
+ */
+#define SNAPSHOT_INTERVAL 60
+
+/**
+ * Default number of datagrams received and answered per system call.
+ */
+#define BATCH_SIZE 32
+
+/**
+ * Largest number of datagrams received per system call.
+ */
+#define BATCH_MAX 1024
+
+/**
+ * Interval between reports of the batch fill ratio, in seconds.
+ */
+#define BATCH_REPORT_INTERVAL 10
+
+/**
+ * Size of the buffer of a datagram, request or reply.
+ */
+#define MSG_SIZE 1024
+
+/**
+ * Largest number of worker threads.
+ */
+#define WORKERS_MAX 256
+
+/**
+ * Default number of replies kept by each worker, to be sent again to the
+ * retransmitted requests.
+ */
+#define REPLAY_CACHE_SIZE 256
+
+/**
+ * Reply to a binary request, sent again instead of running the request again
+ * when the client retransmits it, so that retries are safe for every command.
+ */
+struct replay {
+    uint32_t addr;
+    uint16_t port;
+    uint32_t request_id;
+    size_t length; // 0 if the entry is unused
+    char reply[MSG_SIZE];
+};
+
+/**
+ * Thread serving requests from a socket of its own. With several workers, the
+ * sockets share the port and the kernel spreads the datagrams among them.
+ */
+struct worker {
+    size_t number;
+    SOCKET sock;
+    size_t batch;
+    int cpu; // CPU the worker is pinned to, -1 if none
+    int ticking; // Whether the worker performs the database periodic work
+    size_t replay_size;
+    // Indexed by a hash of the source and request id, the newest reply
+    // replacing the former one
+    struct replay *replays;
+#ifdef linux
+    pthread_t thread;
+#endif
+};
+
+static struct worker workers[WORKERS_MAX];
+
+static size_t worker_count = 1;
+
+static size_t replay_size = REPLAY_CACHE_SIZE;
+
+/** Cleared by the closing signals, for the workers to return. */
+static volatile sig_atomic_t running = 1;
 
 #ifdef WIN32
 
 static BOOL WINAPI stop() {
-    closesocket(sock);
+    closesocket(workers[0].sock);
     user_database_close();
+    server_metrics_dump_stop();
+    server_log_close();
     WSACleanup();
     exit(EXIT_SUCCESS);
 }
 
 #elif defined (linux)
 static void stop(int sig) {
-    closesocket(sock);
-    user_database_close();
-    exit(EXIT_SUCCESS);
+    running = 0;
 }
 #endif
 
+/**
+ * Creates a socket bound to the service port, which wakes up every second.
+ *
+ * @param shared whether other sockets may be bound to the port
+ */
+static SOCKET open_socket(int shared);
+
+/**
+ * Serves the requests of a worker one datagram at a time.
+ */
+static void *serve(void *arg);
+
+#ifdef linux
+/**
+ * Serves the requests of a worker by batches : every datagram waiting on the
+ * socket, up to the worker batch size, is received by a single system call, and
+ * their replies are sent by another one.
+ */
+static void *serve_batched(void *arg);
+#endif
+
+/**
+ * Allocates the replay cache of a worker. The worker runs without one if
+ * memory is short.
+ */
+static void replay_open(struct worker *worker);
+
+/**
+ * Finds the replay cache entry of a binary request.
+ *
+ * @param worker the worker which received the request
+ * @param from the source of the request
+ * @param request the request
+ *
+ * @return the entry, holding the reply if the request was already run, or NULL
+ *         if the request is not to be cached
+ */
+static struct replay *replay_find(
+        struct worker *worker,
+        const SOCKADDR_IN *from,
+        const struct user_message *request
+);
+
+/**
+ * Runs a request to the user database engine, given either as a binary message
+ * or as a text command. A retransmitted binary request is answered from the
+ * replay cache instead.
+ *
+ * @param worker the worker which received the request
+ * @param from the source of the request
+ * @param buffer contains the request as input, and the reply as output
+ * @param length length of the request
+ * @param size size of the buffer
+ *
+ * @return the length of the reply
+ */
+static size_t handle(
+        struct worker *worker,
+        const SOCKADDR_IN *from,
+        char *buffer,
+        size_t length,
+        size_t size
+);
+
+/**
+ * Runs a binary request to the user database engine, and encodes its reply.
+ *
+ * @param buffer contains the request as input, and the reply as output
+ * @param length length of the request
+ * @param size size of the buffer
+ *
+ * @return the length of the reply
+ */
+static size_t run_binary(char *buffer, size_t length, size_t size);
+
+/**
+ * Runs the requests of a batch in one pass, and encodes their replies in a
+ * single batch.
+ *
+ * @param batch the decoded batch, whose payload may point into the buffer
+ * @param buffer the reply
+ * @param size size of the buffer, at least MSG_SIZE
+ *
+ * @return the length of the reply
+ */
+static size_t run_batch(
+        const struct user_message *batch,
+        char *buffer,
+        size_t size
+);
+
 /**
  * Runs a given command to the user database engine.
  *
  * @param buffer contains the command to run as input, and the result as output
+ * @param size size of the buffer
  */
-static void run(char *buffer);
+static void run(char *buffer, size_t size);
+
+/**
+ * Runs a decoded request to the user database engine.
+ *
+ * @param request the request
+ * @param reply its reply, whose payload is written to the buffer
+ * @param payload buffer of the reply payload
+ * @param size size of the payload buffer
+ */
+static void execute(
+        const struct user_message *request,
+        struct user_message *reply,
+        char *payload,
+        size_t size
+);
+
+/**
+ * Runs a request of a given command to the user database engine.
+ *
+ * @return the status of the operation
+ */
+typedef int8_t (*command_handler)(
+        const struct user_message *request,
+        struct user_message *reply,
+        char *payload,
+        size_t size
+);
+
+static int8_t run_create(
+        const struct user_message *request,
+        struct user_message *reply,
+        char *payload,
+        size_t size
+);
+
+static int8_t run_delete(
+        const struct user_message *request,
+        struct user_message *reply,
+        char *payload,
+        size_t size
+);
+
+static int8_t run_login(
+        const struct user_message *request,
+        struct user_message *reply,
+        char *payload,
+        size_t size
+);
+
+static int8_t run_logout(
+        const struct user_message *request,
+        struct user_message *reply,
+        char *payload,
+        size_t size
+);
+
+static int8_t run_password(
+        const struct user_message *request,
+        struct user_message *reply,
+        char *payload,
+        size_t size
+);
+
+static int8_t run_list(
+        const struct user_message *request,
+        struct user_message *reply,
+        char *payload,
+        size_t size
+);
+
+static int8_t run_stats(
+        const struct user_message *request,
+        struct user_message *reply,
+        char *payload,
+        size_t size
+);
+
+/**
+ * Handlers of the commands, indexed by opcode.
+ */
+static const command_handler handlers[] = {
+        [USER_OP_CREATE] = run_create,
+        [USER_OP_DELETE] = run_delete,
+        [USER_OP_LOGIN] = run_login,
+        [USER_OP_LOGOUT] = run_logout,
+        [USER_OP_PASSWORD] = run_password,
+        [USER_OP_LIST] = run_list,
+        [USER_OP_STATS] = run_stats
+};
 
 /**
  * Displays a message corresponding to the last error, depending on the
@@ -66,10 +331,83 @@ static void run(char *buffer);
  */
 static void sock_err(char *action);
 
+/**
+ * Displays the command line options.
+ *
+ * @param program name of the executable
+ */
+static void usage(const char *program);
+
 /**
  * Main program.
  */
-int main(void) {
+int main(int argc, char *argv[]) {
+
+    size_t commit_batch = USER_JOURNAL_DEFAULT_BATCH;
+    uint32_t commit_delay = USER_JOURNAL_DEFAULT_DELAY;
+    uint8_t verify = 0;
+    uint32_t snapshot_interval = SNAPSHOT_INTERVAL;
+    size_t batch = BATCH_SIZE;
+    int pin = 0;
+    int log_level = SERVER_LOG_INFO;
+    const char *metrics_path = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:t:s:b:w:r:l:m:cVh")) != -1) {
+        switch (opt) {
+            case 'n':
+                commit_batch = strtoull(optarg, NULL, 10);
+                break;
+            case 't':
+                commit_delay = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                snapshot_interval = strtoul(optarg, NULL, 10);
+                break;
+            case 'b':
+                batch = strtoull(optarg, NULL, 10);
+                if (batch > BATCH_MAX) batch = BATCH_MAX;
+                break;
+            case 'w':
+                worker_count = strtoull(optarg, NULL, 10);
+                if (worker_count < 1) worker_count = 1;
+                if (worker_count > WORKERS_MAX) worker_count = WORKERS_MAX;
+                break;
+            case 'r':
+                replay_size = strtoull(optarg, NULL, 10);
+                break;
+            case 'l':
+                log_level = server_log_parse_level(optarg);
+                if (log_level < 0) {
+                    usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'm':
+                metrics_path = optarg;
+                break;
+            case 'c':
+                pin = 1;
+                break;
+            case 'V':
+                verify = 1;
+                break;
+            default:
+                usage(argv[0]);
+                exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+
+    if (server_log_open(log_level, stdout) < 0) {
+        fprintf(stderr, "Failed to start the log writer\n");
+    }
+
+    if (metrics_path != NULL && server_metrics_dump_start(
+            metrics_path,
+            SERVER_METRICS_INTERVAL
+    ) < 0) {
+        fprintf(stderr, "Failed to start the metrics writer\n");
+    }
 
 #ifdef WIN32
     // If on Windows system, loads Winsock DLL
@@ -82,28 +420,100 @@ int main(void) {
 #endif
 
     // Initializes user database
+    user_database_set_commit_policy(commit_batch, commit_delay);
+    user_database_set_verify(verify);
+    user_database_set_snapshot_interval(snapshot_interval);
+    // The database is left untouched, as it would be overwritten on close
     if (user_database_init() < 0) {
         fprintf(stderr, "Failed to initialize user database\n");
+        exit(EXIT_FAILURE);
     }
 
-    puts("Initialization done.");
+    SERVER_LOG(SERVER_LOG_INFO, "Initialization done.");
 
     // Catch closing signals
 #ifdef WIN32
     if (SetConsoleCtrlHandler(stop, TRUE) == 0) {
         sock_err("Windows CtrlHandler");
     }
+
+    // A single worker, in the main thread
+    workers[0].sock = open_socket(0);
+    workers[0].batch = 1;
+    workers[0].cpu = -1;
+    workers[0].ticking = 1;
+    workers[0].replay_size = replay_size;
+    serve(&workers[0]);
 #elif defined (linux)
-    signal(SIGTERM, &stop);
-    signal(SIGINT, &stop);
+    // Blocking calls are interrupted rather than restarted
+    struct sigaction action = {0};
+    action.sa_handler = &stop;
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    for (size_t w = 0; w < worker_count; w++) {
+        struct worker *worker = &workers[w];
+        worker->number = w;
+        worker->sock = open_socket(worker_count > 1);
+        worker->batch = batch;
+        worker->cpu = pin ? (int) (w % (size_t) cpus) : -1;
+        worker->ticking = 0;
+        worker->replay_size = replay_size;
+    }
+
+    for (size_t w = 0; w < worker_count; w++) {
+        if (pthread_create(
+                &workers[w].thread, NULL,
+                (batch > 1) ? &serve_batched : &serve,
+                &workers[w]
+        ) != 0) {
+            perror("Creating worker thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    SERVER_LOG(SERVER_LOG_INFO, "%zu workers started.", worker_count);
+
+    // The main thread performs the database periodic work
+    while (running) {
+        user_database_tick();
+        sleep(1);
+    }
+
+    for (size_t w = 0; w < worker_count; w++) {
+        pthread_join(workers[w].thread, NULL);
+        closesocket(workers[w].sock);
+    }
+
+    SERVER_LOG(SERVER_LOG_INFO, "Closing database...");
+    user_database_close();
+    server_metrics_dump_stop();
+    server_log_close();
 #endif
 
+    return EXIT_SUCCESS;
+}
+
+SOCKET open_socket(int shared) {
+
     // Create socket structure
-    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    SOCKET sock = socket(AF_INET, SOCK_DGRAM, 0);
     if (sock == INVALID_SOCKET) {
         sock_err("Creating socket");
     }
 
+#ifdef linux
+    int enable = 1;
+    if (shared && setsockopt(
+            sock, SOL_SOCKET, SO_REUSEPORT,
+            &enable, sizeof enable
+    ) == SOCKET_ERROR) {
+        sock_err("Sharing socket port");
+    }
+#endif
+
     // Create socket address (any)
     SOCKADDR_IN sin = {0};
     sin.sin_addr.s_addr = htonl(INADDR_ANY);
@@ -115,272 +525,520 @@ int main(void) {
         sock_err("Binding socket");
     }
 
-    size_t bytes_read, bytes_write;
-    char msg_buffer[1024];
+    // Wake up regularly, for the database to take its snapshots
+#ifdef WIN32
+    DWORD timeout = 1000;
+#elif defined (linux)
+    struct timeval timeout = {.tv_sec = 1};
+#endif
+    if (setsockopt(
+            sock, SOL_SOCKET, SO_RCVTIMEO,
+            (const char *) &timeout, sizeof timeout
+    ) == SOCKET_ERROR) {
+        sock_err("Setting socket timeout");
+    }
+
+    return sock;
+}
+
+#ifdef linux
+/**
+ * Pins the calling worker to its CPU, if it has one.
+ */
+static void pin_worker(struct worker *worker) {
+
+    if (worker->cpu < 0) return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(worker->cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof set, &set) != 0) {
+        SERVER_LOG(
+                SERVER_LOG_WARN,
+                "Failed to pin worker %zu to CPU %d",
+                worker->number, worker->cpu
+        );
+    }
+}
+#endif
+
+void *serve(void *arg) {
+    struct worker *worker = arg;
+    ssize_t bytes_read, bytes_write;
+    char msg_buffer[MSG_SIZE];
 
-    char addr_buffer[INET_ADDRSTRLEN];
+    char addr_buffer[INET_ADDRSTRLEN] = "";
 
     SOCKADDR_IN from = {0};
     socklen_t from_size = sizeof from;
 
-#pragma ide diagnostic ignored "EndlessLoop"
-    while (1) {
-        puts("Waiting for datagram...");
+#ifdef linux
+    pin_worker(worker);
+#endif
+    replay_open(worker);
+
+    while (running) {
+        if (worker->ticking) user_database_tick();
+
+        SERVER_LOG(SERVER_LOG_DEBUG, "Waiting for datagram...");
         bytes_read = recvfrom(
-                sock,
+                worker->sock,
                 msg_buffer, sizeof msg_buffer - 1,
                 0,
                 (SOCKADDR *) &from, &from_size
         );
         if (bytes_read < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                continue;
+            }
             sock_err("Receiving data");
         }
-        msg_buffer[bytes_read] = '\0';
-
-        inet_ntop(
-                from.sin_family, &from.sin_addr,
-                addr_buffer, sizeof addr_buffer
+        if (SERVER_LOG_ENABLED(SERVER_LOG_DEBUG)) {
+            inet_ntop(
+                    from.sin_family, &from.sin_addr,
+                    addr_buffer, sizeof addr_buffer
+            );
+        }
+        SERVER_LOG(SERVER_LOG_DEBUG, "Data received from [%s]", addr_buffer);
+        size_t reply = handle(
+                worker, &from,
+                msg_buffer, (size_t) bytes_read,
+                sizeof msg_buffer
+        );
+        SERVER_LOG(
+                SERVER_LOG_DEBUG,
+                "Done treating command from [%s]",
+                addr_buffer
         );
-        printf("Data received from [%s]\n", addr_buffer);
-        run(msg_buffer);
-        printf("Done treating command from [%s]\n", addr_buffer);
 
         bytes_write = sendto(
-                sock,
-                msg_buffer, (signed) strlen(msg_buffer),
+                worker->sock,
+                msg_buffer, (signed) reply,
                 0,
                 (SOCKADDR *) &from, from_size
         );
         if (bytes_write < 0) {
             sock_err("Sending data");
         }
-        printf("Data sent to [%s]\n", addr_buffer);
+        SERVER_LOG(SERVER_LOG_DEBUG, "Data sent to [%s]", addr_buffer);
     }
+
+    free(worker->replays);
+
+    return NULL;
 }
 
-void run(char *buffer) {
-    char *command = strtok(buffer, " ");
-
-    // >> create username password
-    if (strcasecmp(command, "create") == 0) {
-        const char *username = strtok(NULL, " ");
-        const char *password = strtok(NULL, " ");
-        size_t id;
-        int8_t res = user_database_create(
-                username,
-                strtoull(password, NULL, 10),
-                &id
-        );
-        *buffer = '\0';
-        switch (res) {
-            case USER_DATABASE_OPERATION_OK:
-                sprintf(
-                        buffer,
-                        "User %s#%ld created.",
-                        username, id
-                );
-                break;
-            case USER_DATABASE_ALREADY_EXISTS:
-                sprintf(
-                        buffer,
-                        "User %s#%ld already exists.",
-                        username, id
-                );
-                break;
-            case USER_DATABASE_INSERT_FAILED:
-            case USER_DATABASE_TOO_MANY_USERS:
-            default:
-                sprintf(
-                        buffer,
-                        "Internal error."
-                );
-                break;
-        }
+#ifdef linux
+void *serve_batched(void *arg) {
+
+    struct worker *worker = arg;
+    size_t batch = worker->batch;
+
+    struct mmsghdr *msgs = calloc(batch, sizeof *msgs);
+    struct iovec *iovecs = calloc(batch, sizeof *iovecs);
+    SOCKADDR_IN *addrs = calloc(batch, sizeof *addrs);
+    char (*buffers)[MSG_SIZE] = calloc(batch, sizeof *buffers);
+    if (msgs == NULL || iovecs == NULL || addrs == NULL || buffers == NULL) {
+        fprintf(stderr, "Failed to allocate %zu datagram buffers\n", batch);
+        exit(EXIT_FAILURE);
     }
 
-        // >> delete id password
-    else if (strcasecmp(command, "delete") == 0) {
-        const char *id = strtok(NULL, " ");
-        const char *password = strtok(NULL, " ");
-        int8_t res = user_database_delete(
-                strtoull(id, NULL, 10),
-                strtoull(password, NULL, 10)
+    size_t batches = 0, datagrams = 0;
+    time_t report = time(NULL);
+
+    pin_worker(worker);
+    replay_open(worker);
+
+    SERVER_LOG(
+            SERVER_LOG_INFO,
+            "Worker %zu waiting for datagrams, up to %zu per batch...",
+            worker->number, batch
+    );
+
+    while (running) {
+        if (worker->ticking) user_database_tick();
+
+        if (batches > 0 && time(NULL) - report >= BATCH_REPORT_INTERVAL) {
+            SERVER_LOG(
+                    SERVER_LOG_INFO,
+                    "Worker %zu : %zu datagrams in %zu batches,"
+                    " %.1f%% batch fill.",
+                    worker->number, datagrams, batches,
+                    100.0 * (double) datagrams / (double) (batches * batch)
+            );
+            batches = datagrams = 0;
+            report = time(NULL);
+        }
+
+        for (size_t i = 0; i < batch; i++) {
+            iovecs[i].iov_base = buffers[i];
+            iovecs[i].iov_len = MSG_SIZE - 1;
+            msgs[i].msg_hdr = (struct msghdr) {
+                    .msg_name = &addrs[i],
+                    .msg_namelen = sizeof addrs[i],
+                    .msg_iov = &iovecs[i],
+                    .msg_iovlen = 1
+            };
+        }
+
+        // Blocks until a datagram arrives, then takes those already waiting
+        int count = recvmmsg(
+                worker->sock,
+                msgs, (unsigned) batch,
+                MSG_WAITFORONE,
+                NULL
         );
-        *buffer = '\0';
-        switch (res) {
-            case USER_DATABASE_OPERATION_OK:
-                sprintf(
-                        buffer,
-                        "User #%s deleted.",
-                        id
-                );
-                break;
-            case USER_DATABASE_INVALID_CREDENTIALS:
-                sprintf(
-                        buffer,
-                        "Invalid credentials"
-                );
-                break;
-            case USER_DATABASE_NOT_EXISTS:
-                sprintf(
-                        buffer,
-                        "User #%s not found.",
-                        id
-                );
-                break;
-            default:
-                sprintf(
-                        buffer,
-                        "Internal error."
+        if (count < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                continue;
+            }
+            sock_err("Receiving data");
+        }
+        batches++;
+        datagrams += (size_t) count;
+
+        for (int i = 0; i < count; i++) {
+            iovecs[i].iov_len = handle(
+                    worker, &addrs[i],
+                    buffers[i], msgs[i].msg_len,
+                    MSG_SIZE
+            );
+        }
+
+        // Replies go back to the address each request came from
+        for (int sent = 0; sent < count;) {
+            int res = sendmmsg(
+                    worker->sock,
+                    msgs + sent, (unsigned) (count - sent),
+                    0
+            );
+            if (res < 0) {
+                if (errno == EINTR) continue;
+                SERVER_LOG(
+                        SERVER_LOG_ERROR,
+                        "Sending data: %s",
+                        strerror(errno)
                 );
                 break;
+            }
+            sent += res;
         }
     }
 
-        // >> login id password
-    else if (strcasecmp(command, "login") == 0) {
-        const char *id = strtok(NULL, " ");
-        const char *password = strtok(NULL, " ");
-        int8_t res = user_database_login(
-                strtoull(id, NULL, 10),
-                strtoull(password, NULL, 10)
+    free(worker->replays);
+    free(buffers);
+    free(addrs);
+    free(iovecs);
+    free(msgs);
+
+    return NULL;
+}
+#endif
+
+void replay_open(struct worker *worker) {
+
+    worker->replays = NULL;
+    if (worker->replay_size == 0) return;
+
+    worker->replays = calloc(worker->replay_size, sizeof *worker->replays);
+    if (worker->replays == NULL) {
+        SERVER_LOG(
+                SERVER_LOG_WARN,
+                "Worker %zu : failed to allocate %zu replay entries",
+                worker->number, worker->replay_size
         );
-        *buffer = '\0';
-        switch (res) {
-            case USER_DATABASE_OPERATION_OK:
-                sprintf(
-                        buffer,
-                        "User #%s logged in.",
-                        id
-                );
-                break;
-            case USER_DATABASE_INVALID_CREDENTIALS:
-                sprintf(
-                        buffer,
-                        "Invalid credentials."
-                );
-                break;
-            case USER_DATABASE_ALREADY_CONNECTED:
-                sprintf(
-                        buffer,
-                        "User #%s is already connected.",
-                        id
-                );
-                break;
-            case USER_DATABASE_NOT_EXISTS:
-                sprintf(
-                        buffer,
-                        "User #%s not found.",
-                        id
-                );
-                break;
-            default:
-                sprintf(
-                        buffer,
-                        "Internal error."
-                );
-                break;
+    }
+}
+
+struct replay *replay_find(
+        struct worker *worker,
+        const SOCKADDR_IN *from,
+        const struct user_message *request
+) {
+    // Requests without an id can't be told apart from one another
+    if (worker->replays == NULL || request->request_id == 0) return NULL;
+
+    uint32_t addr = from->sin_addr.s_addr;
+    uint16_t port = from->sin_port;
+
+    uint64_t hash = (uint64_t) addr << 16 | port;
+    hash = (hash ^ request->request_id) * 0x9E3779B97F4A7C15ULL;
+    struct replay *entry = &worker->replays[
+            (hash >> 32) % worker->replay_size
+    ];
+
+    if (entry->addr != addr
+        || entry->port != port
+        || entry->request_id != request->request_id) {
+        *entry = (struct replay) {
+                .addr = addr,
+                .port = port,
+                .request_id = request->request_id
+        };
+    }
+
+    return entry;
+}
+
+size_t handle(
+        struct worker *worker,
+        const SOCKADDR_IN *from,
+        char *buffer,
+        size_t length,
+        size_t size
+) {
+    if (user_message_is_binary(buffer, length)) {
+        struct user_message request;
+        struct replay *replay = NULL;
+
+        // The kernel hands the datagrams of a source to the same worker
+        if (user_message_decode(buffer, length, &request) == 0) {
+            replay = replay_find(worker, from, &request);
         }
+
+        if (replay != NULL && replay->length > 0) {
+            memcpy(buffer, replay->reply, replay->length);
+            return replay->length;
+        }
+
+        size_t reply = run_binary(buffer, length, size);
+
+        if (replay != NULL && reply <= sizeof replay->reply) {
+            memcpy(replay->reply, buffer, reply);
+            replay->length = reply;
+        }
+
+        return reply;
+    }
+
+    buffer[length] = '\0';
+    run(buffer, size);
+    return strlen(buffer);
+}
+
+size_t run_binary(char *buffer, size_t length, size_t size) {
+
+    struct user_message request;
+    struct user_message reply = {0};
+    char payload[USER_PROTOCOL_PAYLOAD_MAX + 1];
+
+    if (user_message_decode(buffer, length, &request) < 0) {
+        reply.status = USER_STATUS_MALFORMED;
+        return user_message_encode(&reply, buffer, size);
+    }
+
+    if (request.opcode == USER_OP_BATCH) {
+        return run_batch(&request, buffer, size);
     }
 
-        // >> logout id password
-    else if (strcasecmp(command, "logout") == 0) {
-        const char *id = strtok(NULL, " ");
-        const char *password = strtok(NULL, " ");
-        int8_t res = user_database_logout(
-                strtoull(id, NULL, 10),
-                strtoull(password, NULL, 10)
+    execute(&request, &reply, payload, sizeof payload);
+
+    return user_message_encode(&reply, buffer, size);
+}
+
+size_t run_batch(
+        const struct user_message *batch,
+        char *buffer,
+        size_t size
+) {
+    struct user_message request;
+    struct user_message reply = {
+            .opcode = USER_OP_BATCH,
+            .request_id = batch->request_id
+    };
+    char requests[MSG_SIZE];
+    char payload[USER_PROTOCOL_PAYLOAD_MAX + 1];
+    char *replies = buffer + USER_PROTOCOL_HEADER_SIZE;
+    size_t count = 0, offset = 0;
+
+    // The replies overwrite the requests
+    memcpy(requests, batch->payload, batch->length);
+
+    while (user_message_next(requests, batch->length, &offset, &request) == 0) {
+        count++;
+    }
+
+    offset = 0;
+    while (user_message_next(requests, batch->length, &offset, &request) == 0) {
+        struct user_message result = {0};
+
+        // Keeps room for the replies to come, a list filling the rest
+        size_t reserved = reply.length + USER_PROTOCOL_HEADER_SIZE * count--;
+        size_t left = (reserved < USER_PROTOCOL_PAYLOAD_MAX)
+                      ? USER_PROTOCOL_PAYLOAD_MAX - reserved : 0;
+        execute(&request, &result, payload, left + 1);
+
+        size_t length = user_message_encode(
+                &result,
+                replies + reply.length,
+                USER_PROTOCOL_PAYLOAD_MAX - reply.length
         );
-        *buffer = '\0';
-        switch (res) {
-            case USER_DATABASE_OPERATION_OK:
-                sprintf(
-                        buffer,
-                        "User #%s logged out.",
-                        id
-                );
-                break;
-            case USER_DATABASE_INVALID_CREDENTIALS:
-                sprintf(
-                        buffer,
-                        "Invalid credentials"
-                );
-                break;
-            case USER_DATABASE_NOT_CONNECTED:
-                sprintf(
-                        buffer,
-                        "User #%s is not connected.",
-                        id
-                );
-                break;
-            case USER_DATABASE_NOT_EXISTS:
-                sprintf(
-                        buffer,
-                        "User #%s not found.",
-                        id
-                );
-                break;
-            default:
-                sprintf(
-                        buffer,
-                        "Internal error."
-                );
-                break;
-        }
+        if (length == 0) break;
+        reply.length += length;
     }
 
-        // >> password id old_password new_password
-    else if (strcasecmp(command, "password") == 0) {
-        const char *id = strtok(NULL, " ");
-        const char *old_pwd = strtok(NULL, " ");
-        const char *new_pwd = strtok(NULL, " ");
-        int8_t res = user_database_password(
-                strtoull(id, NULL, 10),
-                strtoull(old_pwd, NULL, 10),
-                strtoull(new_pwd, NULL, 10)
+    reply.payload = replies;
+    return user_message_encode(&reply, buffer, size);
+}
+
+void run(char *buffer, size_t size) {
+
+    struct user_message request;
+    struct user_message reply = {0};
+    char command[MSG_SIZE];
+    char payload[MSG_SIZE];
+
+    // The request points into the command, the reply overwrites the buffer
+    strncpy(command, buffer, sizeof command - 1);
+    command[sizeof command - 1] = '\0';
+
+    if (user_message_parse(command, &request) < 0) {
+        reply.status = request.status;
+        server_metrics_end(
+                request.opcode,
+                reply.status,
+                server_metrics_begin()
         );
-        *buffer = '\0';
-        switch (res) {
-            case USER_DATABASE_OPERATION_OK:
-                sprintf(
-                        buffer,
-                        "Password changed for user #%s.",
-                        id
-                );
-                break;
-            case USER_DATABASE_INVALID_CREDENTIALS:
-                sprintf(
-                        buffer,
-                        "Invalid credentials"
-                );
-                break;
-            case USER_DATABASE_NOT_EXISTS:
-                sprintf(
-                        buffer,
-                        "User #%s not found.",
-                        id
-                );
-                break;
-            default:
-                sprintf(
-                        buffer,
-                        "Internal error."
-                );
-                break;
-        }
+    } else {
+        execute(&request, &reply, payload, sizeof payload);
     }
 
-        // >> list
-    else if (strcasecmp(command, "list") == 0) {
-        *buffer = '\0';
-        user_database_list(buffer);
-        if (strlen(buffer) == 0) strcpy(buffer, "No user connected.");
+    user_message_render(&request, &reply, buffer, size);
+}
+
+void execute(
+        const struct user_message *request,
+        struct user_message *reply,
+        char *payload,
+        size_t size
+) {
+    int8_t res = USER_STATUS_UNKNOWN_COMMAND;
+    uint64_t begin = server_metrics_begin();
+
+    reply->opcode = request->opcode;
+    reply->request_id = request->request_id;
+    reply->user_id = request->user_id;
+
+    if (request->opcode < sizeof handlers / sizeof *handlers
+        && handlers[request->opcode] != NULL) {
+        res = handlers[request->opcode](request, reply, payload, size);
     }
 
-        // >> Unknown command
-    else {
-        sprintf(buffer, "Unknown command: %s", command);
+    // The engine statuses match the protocol ones, except for server errors
+    reply->status = (res <= USER_DATABASE_INIT_FAILED)
+                    ? USER_STATUS_INTERNAL_ERROR : res;
+
+    server_metrics_end(request->opcode, reply->status, begin);
+}
+
+int8_t run_create(
+        const struct user_message *request,
+        struct user_message *reply,
+        char *payload,
+        size_t size
+) {
+    size_t length = (request->length < size) ? request->length : size - 1;
+    memcpy(payload, request->payload, length);
+    payload[length] = '\0';
+
+    size_t id;
+    int8_t res = user_database_create(payload, request->hash, &id);
+    reply->user_id = id;
+
+    // Other failures share their codes with unrelated statuses
+    if (res != USER_DATABASE_OPERATION_OK
+        && res != USER_DATABASE_ALREADY_EXISTS) {
+        res = USER_STATUS_INTERNAL_ERROR;
     }
+    return res;
+}
+
+int8_t run_delete(
+        const struct user_message *request,
+        struct user_message *reply,
+        char *payload,
+        size_t size
+) {
+    return user_database_delete(request->user_id, request->hash);
+}
+
+int8_t run_login(
+        const struct user_message *request,
+        struct user_message *reply,
+        char *payload,
+        size_t size
+) {
+    return user_database_login(request->user_id, request->hash);
+}
+
+int8_t run_logout(
+        const struct user_message *request,
+        struct user_message *reply,
+        char *payload,
+        size_t size
+) {
+    return user_database_logout(request->user_id, request->hash);
+}
+
+int8_t run_password(
+        const struct user_message *request,
+        struct user_message *reply,
+        char *payload,
+        size_t size
+) {
+    return user_database_password(
+            request->user_id,
+            request->hash,
+            request->new_hash
+    );
+}
+
+int8_t run_list(
+        const struct user_message *request,
+        struct user_message *reply,
+        char *payload,
+        size_t size
+) {
+    int8_t res = user_database_list(payload, size);
+    reply->payload = payload;
+    reply->length = strlen(payload);
+    return res;
+}
+
+int8_t run_stats(
+        const struct user_message *request,
+        struct user_message *reply,
+        char *payload,
+        size_t size
+) {
+    reply->length = server_metrics_render(payload, size);
+    reply->payload = payload;
+    return USER_DATABASE_OPERATION_OK;
+}
+
+void usage(const char *program) {
+    printf(
+            "Usage: %s [-n records] [-t microseconds] [-s seconds] [-b size]"
+            " [-w workers] [-r entries] [-l level] [-m file] [-c] [-V]\n"
+            "  -n  journal records per synchronization (default %d)\n"
+            "  -t  microseconds before synchronizing the journal (default %d)\n"
+            "  -s  interval between snapshots, 0 to disable (default %d)\n"
+            "  -b  datagrams received per system call (default %d)\n"
+            "  -w  worker threads sharing the port (default 1)\n"
+            "  -r  replies kept per worker for retransmissions, 0 to disable"
+            " (default %d)\n"
+            "  -l  log level : error, warn, info or debug (default info)\n"
+            "  -m  file the metrics are written to every %d seconds\n"
+            "  -c  pin each worker to a CPU\n"
+            "  -V  verify the database checksum at startup\n",
+            program,
+            USER_JOURNAL_DEFAULT_BATCH,
+            USER_JOURNAL_DEFAULT_DELAY,
+            SNAPSHOT_INTERVAL,
+            BATCH_SIZE,
+            REPLAY_CACHE_SIZE,
+            SERVER_METRICS_INTERVAL
+    );
 }
 
 void sock_err(char *action) {
@@ -404,4 +1062,4 @@ void sock_err(char *action) {
 #else
 #error platform unsupported
 #endif
-}
\ No newline at end of file
+}
@@ -0,0 +1,671 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "user_id_allocator.h"
+#include "user_database_engine.h"
+
+/**
+ * Table sizes the id benchmark runs against.
+ */
+static const size_t BENCH_SIZES[] = {10000, 1000000, 10000000};
+
+/**
+ * Number of bytes the legacy scan is allowed to walk per table size, so that
+ * large tables don't run for hours.
+ */
+#define BENCH_SCAN_BUDGET 4000000000UL
+
+/**
+ * Number of release/acquire cycles timed for the bitmap allocator.
+ */
+#define BENCH_BITMAP_OPS 1000000UL
+
+/**
+ * Number of users each stress thread plays with.
+ */
+#define STRESS_USERS 512
+
+/**
+ * Number of operations run by each stress thread.
+ */
+#define STRESS_OPS 200000
+
+/**
+ * Number of names every stress thread tries to register, only one of them
+ * succeeding for each.
+ */
+#define STRESS_SHARED 2048
+
+/**
+ * Number of users registered before the scaling benchmark.
+ */
+#define SCALE_USERS 100000
+
+/**
+ * Duration of each scaling run, in milliseconds.
+ */
+#define SCALE_DURATION 1000
+
+/**
+ * User of a stress thread, as the thread expects to find it in the database.
+ */
+struct stress_user {
+    size_t id;
+    uint64_t hash;
+    uint8_t exists;
+    uint8_t online;
+};
+
+struct stress_thread {
+    pthread_t thread;
+    unsigned number;
+    uint64_t seed;
+    struct stress_user users[STRESS_USERS];
+};
+
+struct scale_thread {
+    pthread_t thread;
+    uint64_t seed;
+    int write;
+    size_t ops;
+};
+
+/**
+ * Thread, plus one, owning each user id during the stress test, so that an id
+ * given to two users at once is noticed.
+ */
+static _Atomic unsigned *stress_owner = NULL;
+
+static size_t stress_owner_size = 0;
+
+/** Whether each shared name was registered. */
+static atomic_uchar stress_shared[STRESS_SHARED];
+
+static atomic_size_t stress_violations = 0;
+
+static atomic_uint stress_running = 0;
+
+static atomic_int scale_stop = 0;
+
+static int bench_ids();
+
+static int bench_stress(unsigned threads);
+
+static int bench_scale(unsigned threads);
+
+static void *stress_run(void *arg);
+
+static int stress_verify(struct stress_thread *threads, unsigned count);
+
+static void *scale_run(void *arg);
+
+/**
+ * Gets a monotonic timestamp, in nanoseconds.
+ */
+static double now_ns();
+
+/**
+ * Moves to an empty temporary directory, in which the database files are
+ * created.
+ */
+static int bench_enter_directory(char *path);
+
+/**
+ * Removes the database files and the temporary directory.
+ */
+static void bench_leave_directory(const char *path);
+
+/**
+ * Simulates the former user_database_next_id : the lowest free slot of a
+ * pointer table is found by walking it from slot 1.
+ */
+static size_t legacy_next_id(void **table, size_t size);
+
+/**
+ * Runs one of the benchmarks :
+ * <ul>
+ *   <li>ids : compares the id allocation of the legacy scan and of the bitmap
+ *   <li>stress [threads] : runs concurrent operations and checks the database
+ *       stays consistent
+ *   <li>scale [threads] : measures the throughput of the engine from 1 thread
+ *       up to the given number
+ * </ul>
+ */
+int main(int argc, char *argv[]) {
+
+    const char *mode = (argc > 1) ? argv[1] : "ids";
+    long threads = (argc > 2) ? strtol(argv[2], NULL, 10)
+                              : sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1) threads = 1;
+    if (threads > 256) threads = 256;
+
+    if (strcmp(mode, "ids") == 0) return bench_ids();
+    if (strcmp(mode, "stress") == 0) return bench_stress((unsigned) threads);
+    if (strcmp(mode, "scale") == 0) return bench_scale((unsigned) threads);
+
+    fprintf(stderr, "Usage: %s [ids | stress [threads] | scale [threads]]\n",
+            argv[0]);
+    return EXIT_FAILURE;
+}
+
+/**
+ * Compares the id allocation cost of the legacy linear scan with the
+ * hierarchical bitmap, on a full table in which one random id is released and
+ * allocated again at each step.
+ */
+static int bench_ids() {
+
+    srand(24030);
+
+    printf("%12s %16s %16s %16s\n",
+           "accounts", "scan (ns/op)", "bitmap (ns/op)", "fill (ns/id)");
+
+    for (size_t s = 0; s < sizeof BENCH_SIZES / sizeof *BENCH_SIZES; s++) {
+
+        size_t size = BENCH_SIZES[s];
+
+        // Legacy pointer table, every slot but 0 in use
+        void **table = calloc(size, sizeof *table);
+        if (table == NULL) {
+            perror("Allocating legacy table");
+            return EXIT_FAILURE;
+        }
+        for (size_t i = 1; i < size; i++) table[i] = table;
+
+        size_t scan_ops = BENCH_SCAN_BUDGET / (size * sizeof *table);
+        if (scan_ops < 20) scan_ops = 20;
+
+        double start = now_ns();
+        for (size_t op = 0; op < scan_ops; op++) {
+            size_t id = 1 + (size_t) rand() % (size - 1);
+            table[id] = NULL;
+            table[legacy_next_id(table, size)] = table;
+        }
+        double scan = (now_ns() - start) / (double) scan_ops;
+        free(table);
+
+        // Bitmap allocator, filled the same way
+        struct user_id_allocator allocator;
+        user_id_allocator_init(&allocator);
+        if (user_id_allocator_grow(&allocator, (size + 63) & ~63UL) < 0) {
+            perror("Allocating bitmap");
+            return EXIT_FAILURE;
+        }
+
+        start = now_ns();
+        for (size_t i = 0; i < size; i++) user_id_allocator_acquire(&allocator);
+        double fill = (now_ns() - start) / (double) size;
+
+        start = now_ns();
+        for (size_t op = 0; op < BENCH_BITMAP_OPS; op++) {
+            size_t id = 1 + (size_t) rand() % (size - 1);
+            user_id_allocator_release(&allocator, id);
+            if (user_id_allocator_acquire(&allocator) != id) {
+                fprintf(stderr, "Bitmap returned a wrong id\n");
+                return EXIT_FAILURE;
+            }
+        }
+        double bitmap = (now_ns() - start) / (double) BENCH_BITMAP_OPS;
+        user_id_allocator_free(&allocator);
+
+        printf("%12zu %16.1f %16.1f %16.1f\n", size, scan, bitmap, fill);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Runs threads creating, deleting, logging in and out their own users, and
+ * racing for shared names, while the main thread takes snapshots. Each thread
+ * checks every result against the state it expects; the whole database is
+ * checked once they are done, then again once closed and loaded back.
+ */
+static int bench_stress(unsigned count) {
+
+    char directory[] = "/tmp/users_stress.XXXXXX";
+    if (bench_enter_directory(directory) < 0) return EXIT_FAILURE;
+
+    // Ids never exceed the number of users alive at once, plus some slack
+    stress_owner_size = (size_t) count * (STRESS_USERS + 1)
+                        + STRESS_SHARED + 8192;
+    stress_owner = calloc(stress_owner_size, sizeof *stress_owner);
+    struct stress_thread *threads = calloc(count, sizeof *threads);
+
+    if (stress_owner == NULL || threads == NULL
+        || user_database_init() < 0) {
+        fprintf(stderr, "Failed to set the stress test up\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("Stress test : %u threads, %d operations each.\n",
+           count, STRESS_OPS);
+
+    double start = now_ns();
+    atomic_store(&stress_running, count);
+
+    for (unsigned t = 0; t < count; t++) {
+        threads[t].number = t;
+        threads[t].seed = 0x9e3779b97f4a7c15ULL * (t + 1);
+        if (pthread_create(&threads[t].thread, NULL,
+                           &stress_run, &threads[t]) != 0) {
+            perror("Creating stress thread");
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Snapshots fork while the threads hold locks
+    size_t snapshots = 0;
+    while (atomic_load(&stress_running) > 0) {
+        user_database_tick();
+        if (user_database_snapshot() == USER_DATABASE_OPERATION_OK) {
+            snapshots++;
+        }
+        struct timespec delay = {0, 50 * 1000 * 1000};
+        nanosleep(&delay, NULL);
+    }
+
+    for (unsigned t = 0; t < count; t++) {
+        pthread_join(threads[t].thread, NULL);
+    }
+
+    double elapsed = (now_ns() - start) / 1e9;
+    printf("%u operations in %.2f s, %zu snapshots taken.\n",
+           count * STRESS_OPS, elapsed, snapshots);
+
+    int res = stress_verify(threads, count);
+
+    free(threads);
+    free(stress_owner);
+    bench_leave_directory(directory);
+
+    size_t violations = atomic_load(&stress_violations);
+    if (violations > 0 || res < 0) {
+        printf("Stress test failed : %zu violations.\n", violations);
+        return EXIT_FAILURE;
+    }
+
+    printf("Stress test passed.\n");
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Measures the operations per second the engine sustains with 1 thread up to
+ * the given number, with a read-mostly mix (password checks, lookups, logins
+ * and lists) and a write mix (registrations, deletions and password changes,
+ * all journaled).
+ */
+static int bench_scale(unsigned count) {
+
+    char directory[] = "/tmp/users_scale.XXXXXX";
+    if (bench_enter_directory(directory) < 0) return EXIT_FAILURE;
+
+    struct scale_thread *threads = calloc(count, sizeof *threads);
+
+    if (threads == NULL || user_database_init() < 0) {
+        fprintf(stderr, "Failed to set the scaling benchmark up\n");
+        return EXIT_FAILURE;
+    }
+
+    char name[32];
+    for (unsigned i = 1; i <= SCALE_USERS; i++) {
+        size_t id;
+        snprintf(name, sizeof name, "u%u", i);
+        user_database_create(name, i, &id);
+    }
+
+    printf("%8s %16s %10s %16s %10s\n",
+           "threads", "read (op/s)", "speedup", "write (op/s)", "speedup");
+
+    double base[2] = {0, 0};
+
+    for (unsigned n = 1; n <= count; n = (n == count) ? n + 1
+                                       : (2 * n > count) ? count : 2 * n) {
+
+        double rate[2];
+
+        for (int write = 0; write < 2; write++) {
+
+            atomic_store(&scale_stop, 0);
+
+            for (unsigned t = 0; t < n; t++) {
+                threads[t].seed = 0x9e3779b97f4a7c15ULL * (t + 1);
+                threads[t].write = write;
+                threads[t].ops = 0;
+                pthread_create(&threads[t].thread, NULL,
+                               &scale_run, &threads[t]);
+            }
+
+            double start = now_ns();
+            struct timespec duration = {
+                    SCALE_DURATION / 1000,
+                    (SCALE_DURATION % 1000) * 1000000L
+            };
+            nanosleep(&duration, NULL);
+            atomic_store(&scale_stop, 1);
+
+            size_t ops = 0;
+            for (unsigned t = 0; t < n; t++) {
+                pthread_join(threads[t].thread, NULL);
+                ops += threads[t].ops;
+            }
+            rate[write] = (double) ops / ((now_ns() - start) / 1e9);
+            if (n == 1) base[write] = rate[write];
+        }
+
+        printf("%8u %16.0f %10.2f %16.0f %10.2f\n", n,
+               rate[0], rate[0] / base[0], rate[1], rate[1] / base[1]);
+    }
+
+    user_database_close();
+    free(threads);
+    bench_leave_directory(directory);
+
+    return EXIT_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * Gets the next number of a xorshift generator.
+ */
+static uint64_t next_random(uint64_t *seed) {
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 7;
+    *seed ^= *seed << 17;
+    return *seed;
+}
+
+#define STRESS_EXPECT(condition, ...) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, __VA_ARGS__); \
+            atomic_fetch_add(&stress_violations, 1); \
+        } \
+    } while (0)
+
+/**
+ * Records that a thread was given an id, which no other user may hold.
+ */
+static void stress_own(unsigned number, size_t id) {
+    unsigned expected = 0;
+    STRESS_EXPECT(
+            id < stress_owner_size
+            && atomic_compare_exchange_strong(
+                    &stress_owner[id], &expected, number + 1),
+            "Id %zu given while owned by thread %u\n", id, expected - 1
+    );
+}
+
+static void *stress_run(void *arg) {
+
+    struct stress_thread *self = arg;
+    char name[32];
+    char list[1 << 16];
+    size_t id;
+
+    for (size_t op = 0; op < STRESS_OPS; op++) {
+
+        size_t u = next_random(&self->seed) % STRESS_USERS;
+        struct stress_user *user = &self->users[u];
+        unsigned choice = (unsigned) (next_random(&self->seed) % 100);
+        int8_t res;
+
+        snprintf(name, sizeof name, "t%u.%zu", self->number, u);
+
+        if (choice < 15) {
+            uint64_t hash = next_random(&self->seed);
+            res = user_database_create(name, hash, &id);
+            if (user->exists) {
+                STRESS_EXPECT(res == USER_DATABASE_ALREADY_EXISTS
+                              && id == user->id,
+                              "Created %s twice\n", name);
+            } else {
+                STRESS_EXPECT(res == USER_DATABASE_OPERATION_OK,
+                              "Failed to create %s : %d\n", name, res);
+                if (res == USER_DATABASE_OPERATION_OK) {
+                    stress_own(self->number, id);
+                    *user = (struct stress_user) {id, hash, 1, 0};
+                }
+            }
+        } else if (choice < 25) {
+            if (user->exists) {
+                // Released first, the id may be given again at once
+                atomic_store(&stress_owner[user->id], 0);
+                res = user_database_delete(user->id, user->hash);
+                STRESS_EXPECT(res == USER_DATABASE_OPERATION_OK,
+                              "Failed to delete %s : %d\n", name, res);
+                user->exists = 0;
+                user->online = 0;
+            } else {
+                res = user_database_find(name, &id);
+                STRESS_EXPECT(res == USER_DATABASE_NOT_EXISTS,
+                              "Deleted %s found as #%zu\n", name, id);
+            }
+        } else if (choice < 50) {
+            if (user->exists) {
+                res = user_database_login_by_name(name, user->hash, &id);
+                STRESS_EXPECT(id == user->id && res == (user->online
+                              ? USER_DATABASE_ALREADY_CONNECTED
+                              : USER_DATABASE_OPERATION_OK),
+                              "Unexpected login of %s : %d\n", name, res);
+                user->online = 1;
+                res = user_database_login(user->id, user->hash + 1);
+                STRESS_EXPECT(res == USER_DATABASE_INVALID_CREDENTIALS,
+                              "Wrong password of %s accepted\n", name);
+            } else {
+                res = user_database_login_by_name(name, 0, &id);
+                STRESS_EXPECT(res == USER_DATABASE_NOT_EXISTS,
+                              "Deleted %s logged in\n", name);
+            }
+        } else if (choice < 65) {
+            if (user->exists) {
+                res = user_database_logout(user->id, user->hash);
+                STRESS_EXPECT(res == (user->online
+                              ? USER_DATABASE_OPERATION_OK
+                              : USER_DATABASE_NOT_CONNECTED),
+                              "Unexpected logout of %s : %d\n", name, res);
+                user->online = 0;
+            }
+        } else if (choice < 70) {
+            if (user->exists) {
+                uint64_t hash = next_random(&self->seed);
+                res = user_database_password_by_name(name, user->hash, hash);
+                STRESS_EXPECT(res == USER_DATABASE_OPERATION_OK,
+                              "Failed to change password of %s\n", name);
+                user->hash = hash;
+            }
+        } else if (choice < 90) {
+            if (user->exists) {
+                res = user_database_check_hash(user->id, user->hash);
+                STRESS_EXPECT(res == USER_DATABASE_OPERATION_OK,
+                              "Password of %s refused\n", name);
+                res = user_database_find(name, &id);
+                STRESS_EXPECT(res == USER_DATABASE_OPERATION_OK
+                              && id == user->id,
+                              "%s not found as #%zu\n", name, user->id);
+            }
+        } else if (choice < 95) {
+            size_t s = next_random(&self->seed) % STRESS_SHARED;
+            snprintf(name, sizeof name, "s%zu", s);
+            res = user_database_create(name, 0, &id);
+            if (res == USER_DATABASE_OPERATION_OK) {
+                stress_own(self->number, id);
+                STRESS_EXPECT(atomic_exchange(&stress_shared[s], 1) == 0,
+                              "Shared name %s registered twice\n", name);
+            } else {
+                STRESS_EXPECT(res == USER_DATABASE_ALREADY_EXISTS,
+                              "Failed to race for %s : %d\n", name, res);
+            }
+        } else {
+            char *state;
+            user_database_list(list, sizeof list);
+            for (char *token = strtok_r(list, ";", &state); token != NULL;
+                 token = strtok_r(NULL, ";", &state)) {
+                STRESS_EXPECT(token[0] == 't' && strlen(token) < 16,
+                              "Listed a malformed name %s\n", token);
+            }
+        }
+    }
+
+    atomic_fetch_sub(&stress_running, 1);
+
+    return NULL;
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/**
+ * Checks the database holds exactly the users the threads expect, online or
+ * not, then closes it and checks the users were saved.
+ */
+static int stress_verify(struct stress_thread *threads, unsigned count) {
+
+    size_t size = (size_t) count * STRESS_USERS * 16 + 1;
+    char *list = malloc(size);
+    char **names = malloc((size_t) count * STRESS_USERS * sizeof *names);
+    if (list == NULL || names == NULL) return -1;
+
+    STRESS_EXPECT(user_database_list(list, size)
+                  == USER_DATABASE_OPERATION_OK, "List truncated\n");
+
+    size_t listed = 0;
+    for (char *token = strtok(list, ";"); token != NULL;
+         token = strtok(NULL, ";")) {
+        names[listed++] = token;
+    }
+    qsort(names, listed, sizeof *names, &compare_names);
+
+    char name[32];
+    char *key = name;
+    size_t online = 0;
+    size_t id;
+
+    for (int reloaded = 0; reloaded < 2; reloaded++) {
+
+        for (unsigned t = 0; t < count; t++) {
+            for (size_t u = 0; u < STRESS_USERS; u++) {
+
+                struct stress_user *user = &threads[t].users[u];
+                snprintf(name, sizeof name, "t%u.%zu", t, u);
+                int8_t res = user_database_find(name, &id);
+
+                if (!user->exists) {
+                    STRESS_EXPECT(res == USER_DATABASE_NOT_EXISTS,
+                                  "Deleted %s still exists\n", name);
+                    continue;
+                }
+
+                STRESS_EXPECT(res == USER_DATABASE_OPERATION_OK
+                              && id == user->id
+                              && user_database_check_hash(id, user->hash)
+                                 == USER_DATABASE_OPERATION_OK,
+                              "%s lost (reloaded : %d)\n", name, reloaded);
+
+                if (!reloaded && user->online) {
+                    online++;
+                    STRESS_EXPECT(bsearch(&key, names, listed, sizeof *names,
+                                          &compare_names) != NULL,
+                                  "Online %s not listed\n", name);
+                }
+            }
+        }
+
+        for (size_t s = 0; s < STRESS_SHARED; s++) {
+            snprintf(name, sizeof name, "s%zu", s);
+            STRESS_EXPECT((user_database_find(name, &id)
+                           == USER_DATABASE_OPERATION_OK)
+                          == atomic_load(&stress_shared[s]),
+                          "Shared name %s lost\n", name);
+        }
+
+        if (!reloaded) {
+            STRESS_EXPECT(online == listed,
+                          "%zu users listed, %zu online\n", listed, online);
+        }
+
+        if (user_database_close() < 0) return -1;
+        if (!reloaded && user_database_init() < 0) return -1;
+    }
+
+    free(names);
+    free(list);
+
+    return 0;
+}
+
+static void *scale_run(void *arg) {
+
+    struct scale_thread *self = arg;
+    char name[32];
+    char list[4096];
+    size_t id;
+
+    while (!atomic_load_explicit(&scale_stop, memory_order_relaxed)) {
+
+        size_t u = 1 + next_random(&self->seed) % SCALE_USERS;
+        unsigned choice = (unsigned) (next_random(&self->seed) % 100);
+
+        if (self->write) {
+            if (choice < 50) {
+                user_database_password(u, u, u);
+            } else {
+                snprintf(name, sizeof name, "w%zu", u);
+                if (user_database_create(name, u, &id) < 0) {
+                    user_database_delete(id, u);
+                }
+            }
+        } else if (choice < 70) {
+            user_database_check_hash(u, u);
+        } else if (choice < 85) {
+            snprintf(name, sizeof name, "u%zu", u);
+            user_database_find(name, &id);
+        } else if (choice < 95) {
+            if (user_database_login(u, u) == USER_DATABASE_OPERATION_OK) {
+                user_database_logout(u, u);
+            }
+        } else {
+            user_database_list(list, sizeof list);
+        }
+
+        self->ops++;
+    }
+
+    return NULL;
+}
+
+double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+static int bench_enter_directory(char *path) {
+    if (mkdtemp(path) == NULL || chdir(path) < 0) {
+        perror("Creating temporary directory");
+        return -1;
+    }
+    return 0;
+}
+
+static void bench_leave_directory(const char *path) {
+    unlink(USER_DATABASE_PATH);
+    unlink(USER_DATABASE_BACKUP_PATH);
+    unlink(USER_DATABASE_JOURNAL_PATH);
+    unlink(USER_DATABASE_JOURNAL_OLD_PATH);
+    unlink(USER_DATABASE_TEMP_PATH);
+    if (chdir("/") == 0) rmdir(path);
+}
+
+size_t legacy_next_id(void **table, size_t size) {
+    for (size_t i = 1; i < size; i++) {
+        if (table[i] == NULL) return i;
+    }
+    return 0;
+}
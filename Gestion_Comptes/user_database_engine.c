@@ -1,12 +1,46 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include "user_database_engine.h"
-
-const size_t DEFAULT_SIZE = 10000;
-
+#include "user_id_allocator.h"
+#include "user_database_journal.h"
+#include "user_database_file.h"
+
+/**
+ * Number of user slots held by each chunk of the slab. The table grows by
+ * whole chunks, so this is also the growth step.
+ */
+#define USER_CHUNK_SIZE 4096
+
+/**
+ * Size of the username field, including the terminating null byte.
+ */
+#define USERINFO_USERNAME_SIZE USER_DATABASE_FILE_USERNAME_SIZE
+
+/**
+ * Record of an user, as inserted in the slab.
+ */
 struct userinfo {
+    char username[USERINFO_USERNAME_SIZE];
+    uint64_t hash;
+    size_t id;
+    uint8_t flags;
+};
+
+/**
+ * Record of an user in the former database file format, a raw dump of the
+ * records. Such files are still loaded, and saved in the current format.
+ */
+struct userinfo_v0 {
     char username[10];
     uint64_t hash;
     size_t id;
@@ -15,21 +49,244 @@ struct userinfo {
 
 #define USERINFO_FLAG_ONLINE (1UL << 0)
 
-int8_t user_database_insert(struct userinfo *user);
+/** The slot holds a registered user. */
+#define USERINFO_FLAG_USED (1UL << 1)
+
+/**
+ * A chunk of the slab, holding USER_CHUNK_SIZE consecutive user ids.
+ *
+ * Fields are stored as parallel arrays : the hot fields (hash, flags and online
+ * set position, the id being the slot index) are kept apart from the cold ones
+ * (username), so that scans only touch the bytes they need. The hash, flags and
+ * username arrays are laid out as in the database file, and point into its
+ * mapping for the chunks loaded from it.
+ */
+struct user_chunk {
+    uint64_t *hash;
+    uint32_t *online; // Position in the online set plus one, 0 when offline
+    uint8_t *flags;
+    char (*username)[USERINFO_USERNAME_SIZE];
+    void *allocation; // Memory to free along with the chunk
+};
+
+/**
+ * Number of reader/writer locks guarding the user records. The record of an
+ * user is guarded by the lock of its id modulo this number, so that consecutive
+ * ids never share a lock.
+ */
+#define USER_DATABASE_STRIPES 64
 
-int8_t user_database_check_hash(size_t id, uint64_t hash);
+int8_t user_database_insert(struct userinfo *user);
 
 size_t user_database_next_id();
 
-size_t user_database_size = DEFAULT_SIZE;
+static int8_t user_database_check(size_t id, uint64_t hash, const char *key);
+
+static int8_t user_delete(size_t id, uint64_t hash, const char *key);
+
+static int8_t user_login(size_t id, uint64_t hash, const char *key);
+
+static int8_t user_password(
+        size_t id,
+        uint64_t old_hash,
+        uint64_t new_hash,
+        const char *key
+);
+
+static int8_t user_database_grow();
+
+static int8_t user_database_attach(struct user_chunk chunk);
+
+static int8_t user_database_load();
+
+static int8_t user_database_load_v0(const char *path);
+
+static int user_database_write(const char *path);
+
+static void user_database_snapshot_wait(int block);
+
+static double user_database_snapshot_elapsed();
+
+static void user_database_lock_init();
+
+static void user_database_lock_destroy();
+
+static void user_database_clear(size_t id);
+
+static void user_database_apply(const struct user_journal_record *record);
+
+static void user_database_journal(
+        uint8_t op,
+        size_t id,
+        uint64_t hash,
+        const char *username
+);
+
+/**
+ * Entry of the username index. The index is a Robin Hood hash table with
+ * linear probing : an entry never sits further from its home bucket than the
+ * entries it passed, which keeps probe sequences short even when the table is
+ * nearly full.
+ */
+struct user_name_entry {
+    uint32_t hash;
+    uint32_t distance; // Probe distance plus one, 0 for an empty bucket
+    size_t id;
+};
+
+/**
+ * Shard of the username index, holding the names whose hash starts with its
+ * number. Each shard is a table of its own with its own lock, so that lookups
+ * and registrations of unrelated names don't contend.
+ */
+struct user_name_shard {
+    pthread_rwlock_t lock;
+    struct user_name_entry *buckets; // A power of two of them
+    size_t size;
+    size_t count;
+};
+
+/** Number of shards of the username index, a power of two. */
+#define USER_NAME_SHARDS 16
+
+/** Smallest number of buckets of an username index shard. */
+#define USER_NAME_INDEX_MIN_SIZE 1024
+
+static void user_name_key(const char *username, char *key);
+
+static uint64_t user_name_hash(const char *key);
+
+static struct user_name_shard *user_name_shard(uint64_t hash);
+
+static size_t user_name_index_find(
+        struct user_name_shard *shard,
+        const char *key,
+        uint64_t hash
+);
+
+static int8_t user_name_index_add(
+        struct user_name_shard *shard,
+        uint64_t hash,
+        size_t id
+);
+
+static void user_name_index_remove(
+        struct user_name_shard *shard,
+        uint64_t hash,
+        size_t id
+);
+
+static int8_t user_name_index_rebuild();
+
+static int8_t user_online_add(size_t id);
+
+static void user_online_remove(size_t id);
+
+static int8_t user_online_serialize();
+
+/**
+ * Number of user slots currently allocated. It is only increased once the new
+ * chunk is reachable from the directory.
+ */
+static _Atomic size_t user_database_size = 0;
+
+/** Number of chunks the directory can reference before being reallocated. */
+static size_t user_database_capacity = 0;
+
+/**
+ * Directory of the slab chunks. A full directory is copied into a larger one,
+ * which is then published : readers never lock it.
+ */
+static struct user_chunk *_Atomic user_database = NULL;
+
+/**
+ * Directories replaced by a larger one. Readers may still be walking them, so
+ * they are only freed when the database is closed. Directories double in size,
+ * so they are at most as large as the current one altogether.
+ */
+static struct user_chunk *user_database_retired[64];
+
+static size_t user_database_retired_count = 0;
+
+/** Locks of the user records, see USER_DATABASE_STRIPES. */
+static pthread_rwlock_t user_database_stripes[USER_DATABASE_STRIPES];
+
+/** Guards the id allocator and the growth of the slab. */
+static pthread_mutex_t user_database_ids_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Group commit policy of the journal. */
+static struct user_journal_policy user_database_commit_policy = {
+        .batch = USER_JOURNAL_DEFAULT_BATCH,
+        .delay = USER_JOURNAL_DEFAULT_DELAY
+};
+
+/** Whether the data checksum of the database file is checked when loaded. */
+static uint8_t user_database_verify = 0;
+
+/** Private mapping of the database file, holding the chunks loaded from it. */
+static void *user_database_mapping = NULL;
+
+static size_t user_database_mapping_length = 0;
+
+/** Interval between background snapshots, in seconds, 0 to disable them. */
+static uint32_t user_database_snapshot_interval = 0;
+
+/** Process writing the running background snapshot, 0 if none. */
+static pid_t user_database_snapshot_pid = 0;
+
+/** Time at which the last background snapshot started. */
+static struct timespec user_database_snapshot_start;
 
-struct userinfo **user_database = NULL;
+/** Free ids of the slab. */
+static struct user_id_allocator user_database_ids;
+
+/** Shards of the username index. */
+static struct user_name_shard user_name_index[USER_NAME_SHARDS];
+
+/**
+ * Guards the online set and its serialized list. Listing only takes it for
+ * reading, unless the list has to be serialized again.
+ */
+static pthread_rwlock_t user_online_lock;
+
+/**
+ * Ids of the online users, in no particular order. Each user's chunk holds its
+ * position in this array, so that it is added and removed in constant time.
+ */
+static size_t *user_online = NULL;
+
+static size_t user_online_count = 0;
+
+static size_t user_online_capacity = 0;
+
+/** Incremented each time the online set changes. */
+static uint64_t user_online_generation = 1;
+
+/**
+ * Serialized list of online usernames, as returned by user_database_list,
+ * valid while user_online_cache_generation matches user_online_generation.
+ */
+static char *user_online_cache = NULL;
+
+static size_t user_online_cache_length = 0;
+
+static size_t user_online_cache_capacity = 0;
+
+static uint64_t user_online_cache_generation = 0;
+
+#define USER_CHUNK(id) (&atomic_load(&user_database)[(id) / USER_CHUNK_SIZE])
+#define USER_SLOT(id) ((id) % USER_CHUNK_SIZE)
+#define USER_STRIPE(id) (&user_database_stripes[(id) % USER_DATABASE_STRIPES])
 
 int8_t user_database_init() {
 
-    user_database = calloc(user_database_size, sizeof(void *));
+    user_database_lock_init();
+    user_id_allocator_init(&user_database_ids);
+
+    int8_t res = user_database_load();
+    if (res < 0) return res;
 
-    if (user_database == NULL) {
+    if (user_database_size == 0 && user_database_grow() < 0) {
         fprintf(
                 USER_DATABASE_ERR_STREAM,
                 "Failed to initialize database.\n"
@@ -37,217 +294,1312 @@ int8_t user_database_init() {
         return USER_DATABASE_INIT_FAILED;
     }
 
-    FILE *database_read = NULL, *database_write = NULL;
+    // Id 0 is never given to an user
+    user_id_allocator_claim(&user_database_ids, 0);
+
+    // Records of the old journal are older than those of the current one
+    long replayed = user_journal_replay(
+            USER_DATABASE_JOURNAL_OLD_PATH,
+            &user_database_apply
+    );
+    long current = user_journal_replay(
+            USER_DATABASE_JOURNAL_PATH,
+            &user_database_apply
+    );
+    replayed = (replayed < 0 || current < 0) ? -1 : replayed + current;
+    if (replayed < 0) {
+        fprintf(
+                USER_DATABASE_ERR_STREAM,
+                "Failed to replay database journal.\n"
+        );
+        return USER_DATABASE_INIT_FAILED;
+    }
+    if (replayed > 0) {
+        fprintf(
+                USER_DATABASE_OUT_STREAM,
+                "Replayed %ld journal records.\n",
+                replayed
+        );
+    }
+
+    if (user_name_index_rebuild() < 0) {
+        fprintf(
+                USER_DATABASE_ERR_STREAM,
+                "Failed to index database usernames.\n"
+        );
+        return USER_DATABASE_INIT_FAILED;
+    }
+
+    if (user_journal_open(
+            USER_DATABASE_JOURNAL_PATH,
+            user_database_commit_policy
+    ) < 0) {
+        fprintf(
+                USER_DATABASE_ERR_STREAM,
+                "Failed to open database journal.\n"
+        );
+        return USER_DATABASE_INIT_FAILED;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &user_database_snapshot_start);
+
+    return USER_DATABASE_OPERATION_OK;
+}
+
+void user_database_set_commit_policy(size_t batch, uint32_t delay) {
+    user_database_commit_policy.batch = batch;
+    user_database_commit_policy.delay = delay;
+}
+
+void user_database_set_verify(uint8_t verify) {
+    user_database_verify = verify;
+}
+
+void user_database_set_snapshot_interval(uint32_t interval) {
+    user_database_snapshot_interval = interval;
+}
+
+int8_t user_database_snapshot() {
+
+    if (user_database_snapshot_pid != 0) return USER_DATABASE_SNAPSHOT_RUNNING;
+
+    fflush(USER_DATABASE_OUT_STREAM);
+    fflush(USER_DATABASE_ERR_STREAM);
+
+    // Every record is modified and journaled under its stripe lock
+    for (size_t s = 0; s < USER_DATABASE_STRIPES; s++) {
+        pthread_rwlock_wrlock(&user_database_stripes[s]);
+    }
+
+    // The old journal holds every record up to the state being forked
+    int rotated = user_journal_rotate(USER_DATABASE_JOURNAL_OLD_PATH);
+
+    clock_gettime(CLOCK_MONOTONIC, &user_database_snapshot_start);
 
     /*
-     * If the persistent database file doesn't exist, read from the backup and
-     * write to data. Otherwise, read from data and write to the backup.
+     * The child process gets a copy-on-write image of the table as it is now,
+     * and writes it while this process goes on serving requests.
      */
-    if (access(USER_DATABASE_PATH, F_OK) < 0) {
+    pid_t pid = (rotated == 0) ? fork() : -1;
+
+    if (pid == 0) {
+        int res = user_database_write(USER_DATABASE_PATH);
+
+        /*
+         * Another thread may have held the output stream lock when forking,
+         * so the report bypasses it.
+         */
+        struct stat st;
+        if (res == 0 && stat(USER_DATABASE_PATH, &st) == 0) {
+            char report[128];
+            int len = snprintf(
+                    report, sizeof report,
+                    "Database snapshot written in %.1f ms (%lld bytes).\n",
+                    user_database_snapshot_elapsed(),
+                    (long long) st.st_size
+            );
+            write(fileno(USER_DATABASE_OUT_STREAM), report, (size_t) len);
+        }
 
-        database_read = fopen(USER_DATABASE_BACKUP_PATH, "rb");
+        _exit(res == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
 
-        if (database_read == NULL) {
-            return USER_DATABASE_OPERATION_OK; // No persistent data
+    for (size_t s = 0; s < USER_DATABASE_STRIPES; s++) {
+        pthread_rwlock_unlock(&user_database_stripes[s]);
+    }
+
+    if (rotated < 0) {
+        fprintf(
+                USER_DATABASE_ERR_STREAM,
+                "Failed to rotate database journal.\n"
+        );
+        return USER_DATABASE_SNAPSHOT_FAILED;
+    }
+
+    if (pid < 0) {
+        fprintf(
+                USER_DATABASE_ERR_STREAM,
+                "Failed to start database snapshot.\n"
+        );
+        return USER_DATABASE_SNAPSHOT_FAILED;
+    }
+
+    user_database_snapshot_pid = pid;
+
+    return USER_DATABASE_OPERATION_OK;
+}
+
+void user_database_tick() {
+
+    if (user_database_snapshot_pid != 0) {
+        user_database_snapshot_wait(0);
+    } else if (user_database_snapshot_interval > 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec - user_database_snapshot_start.tv_sec
+            >= user_database_snapshot_interval) {
+            user_database_snapshot();
         }
+    }
+}
 
-        database_write = fopen(USER_DATABASE_PATH, "wb");
+int8_t user_database_close() {
 
-        if (database_write == NULL) {
-            fprintf(
-                    USER_DATABASE_ERR_STREAM,
-                    "Failed to create database persistent file.\n"
-            );
-            return USER_DATABASE_INIT_FAILED;
+    if (user_database_snapshot_pid != 0) user_database_snapshot_wait(1);
+
+    // The journals are only emptied once the snapshot is safely on disk
+    int saved = user_database_write(USER_DATABASE_PATH) == 0;
+
+    if (saved) {
+        user_journal_reset();
+        unlink(USER_DATABASE_JOURNAL_OLD_PATH);
+    } else {
+        fprintf(
+                USER_DATABASE_ERR_STREAM,
+                "Failed to save database persistent file.\n"
+        );
+    }
+    user_journal_close();
+
+    struct user_chunk *directory = atomic_load(&user_database);
+    for (size_t c = 0; c < user_database_size / USER_CHUNK_SIZE; c++) {
+        free(directory[c].allocation);
+    }
+    user_database_file_unmap(
+            user_database_mapping,
+            user_database_mapping_length
+    );
+    user_database_mapping = NULL;
+    user_database_mapping_length = 0;
+
+    free(directory);
+    while (user_database_retired_count > 0) {
+        free(user_database_retired[--user_database_retired_count]);
+    }
+    atomic_store(&user_database, NULL);
+    atomic_store(&user_database_size, 0);
+    user_database_capacity = 0;
+    user_id_allocator_free(&user_database_ids);
+
+    for (size_t s = 0; s < USER_NAME_SHARDS; s++) {
+        free(user_name_index[s].buckets);
+        user_name_index[s].buckets = NULL;
+        user_name_index[s].size = 0;
+        user_name_index[s].count = 0;
+    }
+
+    free(user_online);
+    user_online = NULL;
+    user_online_count = 0;
+    user_online_capacity = 0;
+
+    free(user_online_cache);
+    user_online_cache = NULL;
+    user_online_cache_length = 0;
+    user_online_cache_capacity = 0;
+    user_online_generation++;
+
+    user_database_lock_destroy();
+
+    return saved ? USER_DATABASE_OPERATION_OK : USER_DATABASE_CLOSE_FAILED;
+}
+
+int8_t user_database_create(const char *username, uint64_t hash, size_t *id) {
+
+    struct userinfo user = {
+            .username = "",
+            .hash = hash,
+            .id = 0,
+            .flags = 0
+    };
+    user_name_key(username, user.username);
+
+    uint64_t name_hash = user_name_hash(user.username);
+    struct user_name_shard *shard = user_name_shard(name_hash);
+
+    // Turn taken names down without reserving an id
+    pthread_rwlock_rdlock(&shard->lock);
+    *id = user_name_index_find(shard, user.username, name_hash);
+    pthread_rwlock_unlock(&shard->lock);
+
+    if (*id != 0) return USER_DATABASE_ALREADY_EXISTS;
+
+    user.id = user_database_next_id();
+
+    if (user.id == 0) return USER_DATABASE_TOO_MANY_USERS;
+
+    pthread_rwlock_wrlock(USER_STRIPE(user.id));
+    pthread_rwlock_wrlock(&shard->lock);
+
+    // The name may have been registered since it was looked up
+    *id = user_name_index_find(shard, user.username, name_hash);
+
+    int8_t res = (*id != 0) ? USER_DATABASE_ALREADY_EXISTS
+                            : user_database_insert(&user);
+    if (res == USER_DATABASE_OPERATION_OK
+        && user_name_index_add(shard, name_hash, user.id) < 0) {
+        USER_CHUNK(user.id)->flags[USER_SLOT(user.id)] = 0;
+        res = USER_DATABASE_INSERT_FAILED;
+    }
+
+    pthread_rwlock_unlock(&shard->lock);
+
+    if (res == USER_DATABASE_OPERATION_OK) {
+        *id = user.id;
+        user_database_journal(USER_JOURNAL_CREATE, *id, hash, user.username);
+    } else {
+        pthread_mutex_lock(&user_database_ids_lock);
+        user_id_allocator_release(&user_database_ids, user.id);
+        pthread_mutex_unlock(&user_database_ids_lock);
+    }
+
+    pthread_rwlock_unlock(USER_STRIPE(user.id));
+
+    return res;
+}
+
+int8_t user_database_delete(size_t id, uint64_t hash) {
+    return user_delete(id, hash, NULL);
+}
+
+int8_t user_database_login(size_t id, uint64_t hash) {
+    return user_login(id, hash, NULL);
+}
+
+int8_t user_database_logout(size_t id, uint64_t hash) {
+
+    pthread_rwlock_wrlock(USER_STRIPE(id));
+
+    int8_t res = user_database_check(id, hash, NULL);
+
+    if (res == USER_DATABASE_OPERATION_OK) {
+        uint8_t *flags = &USER_CHUNK(id)->flags[USER_SLOT(id)];
+
+        if (!(*flags & USERINFO_FLAG_ONLINE)) {
+            res = USER_DATABASE_NOT_CONNECTED;
+        } else {
+            user_online_remove(id);
+            *flags &= ~(USERINFO_FLAG_ONLINE);
+        }
+    }
+
+    pthread_rwlock_unlock(USER_STRIPE(id));
+
+    return res;
+}
+
+int8_t user_database_password(size_t id, uint64_t old_hash, uint64_t new_hash) {
+    return user_password(id, old_hash, new_hash, NULL);
+}
+
+int8_t user_database_list(char *buffer, size_t size) {
+
+    pthread_rwlock_rdlock(&user_online_lock);
+
+    if (user_online_cache_generation != user_online_generation) {
+        // Only the first caller to find the list outdated serializes it
+        pthread_rwlock_unlock(&user_online_lock);
+        pthread_rwlock_wrlock(&user_online_lock);
+
+        if (user_online_cache_generation != user_online_generation
+            && user_online_serialize() < 0) {
+            pthread_rwlock_unlock(&user_online_lock);
+            return USER_DATABASE_INSERT_FAILED;
         }
+    }
+
+    int8_t res = USER_DATABASE_OPERATION_OK;
+
+    if (size == 0) {
+        res = USER_DATABASE_TRUNCATED;
+    } else if (user_online_cache_length < size) {
+        memcpy(buffer, user_online_cache, user_online_cache_length + 1);
     } else {
+        // Only keep the usernames which fit entirely
+        size_t length = size - 1;
+        while (length > 0 && user_online_cache[length] != ';') length--;
+        memcpy(buffer, user_online_cache, length);
+        buffer[length] = '\0';
+        res = USER_DATABASE_TRUNCATED;
+    }
+
+    pthread_rwlock_unlock(&user_online_lock);
+
+    return res;
+}
+
+int8_t user_database_find(const char *username, size_t *id) {
+
+    char key[USERINFO_USERNAME_SIZE];
+    user_name_key(username, key);
+
+    uint64_t hash = user_name_hash(key);
+    struct user_name_shard *shard = user_name_shard(hash);
+
+    pthread_rwlock_rdlock(&shard->lock);
+    *id = user_name_index_find(shard, key, hash);
+    pthread_rwlock_unlock(&shard->lock);
+
+    return (*id != 0) ? USER_DATABASE_OPERATION_OK : USER_DATABASE_NOT_EXISTS;
+}
+
+/*
+ * The id found may be deleted and given to another user before the operation
+ * locks it : the operations by name check that it still holds the same name.
+ */
+
+int8_t user_database_delete_by_name(const char *username, uint64_t hash) {
+    char key[USERINFO_USERNAME_SIZE];
+    user_name_key(username, key);
+    size_t id;
+    int8_t res = user_database_find(key, &id);
+    return (res < 0) ? res : user_delete(id, hash, key);
+}
+
+int8_t user_database_login_by_name(
+        const char *username,
+        uint64_t hash,
+        size_t *id
+) {
+    char key[USERINFO_USERNAME_SIZE];
+    user_name_key(username, key);
+    int8_t res = user_database_find(key, id);
+    return (res < 0) ? res : user_login(*id, hash, key);
+}
+
+int8_t user_database_password_by_name(
+        const char *username,
+        uint64_t old_hash,
+        uint64_t new_hash
+) {
+    char key[USERINFO_USERNAME_SIZE];
+    user_name_key(username, key);
+    size_t id;
+    int8_t res = user_database_find(key, &id);
+    return (res < 0) ? res : user_password(id, old_hash, new_hash, key);
+}
+
+int8_t user_database_check_hash(size_t id, uint64_t hash) {
+    pthread_rwlock_rdlock(USER_STRIPE(id));
+    int8_t res = user_database_check(id, hash, NULL);
+    pthread_rwlock_unlock(USER_STRIPE(id));
+    return res;
+}
+
+int8_t user_database_insert(struct userinfo *user) {
+
+    if (user == NULL || user->id == 0) {
+        return USER_DATABASE_INSERT_FAILED;
+    }
+
+    int8_t res = USER_DATABASE_OPERATION_OK;
+
+    pthread_mutex_lock(&user_database_ids_lock);
+    while (res == USER_DATABASE_OPERATION_OK
+           && user->id >= user_database_size) {
+        res = user_database_grow();
+    }
+    pthread_mutex_unlock(&user_database_ids_lock);
+
+    if (res < 0) return USER_DATABASE_TOO_MANY_USERS;
+
+    struct user_chunk *chunk = USER_CHUNK(user->id);
+    size_t slot = USER_SLOT(user->id);
+
+    if (chunk->flags[slot] & USERINFO_FLAG_USED) {
+        return USER_DATABASE_ALREADY_EXISTS;
+    }
+
+    // Set user offline
+    user->flags &= ~USERINFO_FLAG_ONLINE;
+
+    chunk->hash[slot] = user->hash;
+    chunk->flags[slot] = user->flags | USERINFO_FLAG_USED;
+    user_name_key(user->username, chunk->username[slot]);
+
+    pthread_mutex_lock(&user_database_ids_lock);
+    user_id_allocator_claim(&user_database_ids, user->id);
+    pthread_mutex_unlock(&user_database_ids_lock);
+
+    return USER_DATABASE_OPERATION_OK;
+}
+
+size_t user_database_next_id() {
+
+    pthread_mutex_lock(&user_database_ids_lock);
+
+    size_t id = user_id_allocator_acquire(&user_database_ids);
+    if (id == USER_ID_ALLOCATOR_FULL && user_database_grow() == 0) {
+        id = user_id_allocator_acquire(&user_database_ids);
+    }
+
+    pthread_mutex_unlock(&user_database_ids_lock);
+
+    return (id == USER_ID_ALLOCATOR_FULL) ? 0 : id;
+}
+
+/**
+ * Checks the password of an user. The stripe lock of the user must be held.
+ *
+ * @param key if not NULL, the name the user must be registered under
+ */
+static int8_t user_database_check(size_t id, uint64_t hash, const char *key) {
+
+    if (id >= user_database_size) {
+        return USER_DATABASE_NOT_EXISTS;
+    }
+
+    struct user_chunk *chunk = USER_CHUNK(id);
+    size_t slot = USER_SLOT(id);
+
+    if (!(chunk->flags[slot] & USERINFO_FLAG_USED)
+        || (key != NULL && strncmp(
+            chunk->username[slot], key, USERINFO_USERNAME_SIZE
+    ) != 0)) {
+        return USER_DATABASE_NOT_EXISTS;
+    }
+
+    return (chunk->hash[slot] == hash)
+           ? USER_DATABASE_OPERATION_OK
+           : USER_DATABASE_INVALID_CREDENTIALS;
+}
+
+static int8_t user_delete(size_t id, uint64_t hash, const char *key) {
+
+    pthread_rwlock_wrlock(USER_STRIPE(id));
+
+    int8_t res = user_database_check(id, hash, key);
+
+    if (res == USER_DATABASE_OPERATION_OK) {
+        struct user_chunk *chunk = USER_CHUNK(id);
+        size_t slot = USER_SLOT(id);
+
+        uint64_t name_hash = user_name_hash(chunk->username[slot]);
+        struct user_name_shard *shard = user_name_shard(name_hash);
+        pthread_rwlock_wrlock(&shard->lock);
+        user_name_index_remove(shard, name_hash, id);
+        pthread_rwlock_unlock(&shard->lock);
+
+        if (chunk->flags[slot] & USERINFO_FLAG_ONLINE) user_online_remove(id);
+        user_database_clear(id);
+
+        user_database_journal(USER_JOURNAL_DELETE, id, 0, "");
+    }
+
+    pthread_rwlock_unlock(USER_STRIPE(id));
+
+    return res;
+}
+
+static int8_t user_login(size_t id, uint64_t hash, const char *key) {
+
+    pthread_rwlock_wrlock(USER_STRIPE(id));
+
+    int8_t res = user_database_check(id, hash, key);
+
+    if (res == USER_DATABASE_OPERATION_OK) {
+        uint8_t *flags = &USER_CHUNK(id)->flags[USER_SLOT(id)];
+
+        if (*flags & USERINFO_FLAG_ONLINE) {
+            res = USER_DATABASE_ALREADY_CONNECTED;
+        } else if (user_online_add(id) < 0) {
+            res = USER_DATABASE_INSERT_FAILED;
+        } else {
+            *flags |= USERINFO_FLAG_ONLINE;
+        }
+    }
+
+    pthread_rwlock_unlock(USER_STRIPE(id));
+
+    return res;
+}
 
-        database_read = fopen(USER_DATABASE_PATH, "rb");
+static int8_t user_password(
+        size_t id,
+        uint64_t old_hash,
+        uint64_t new_hash,
+        const char *key
+) {
+    pthread_rwlock_wrlock(USER_STRIPE(id));
 
-        if (database_read == NULL) {
+    int8_t res = user_database_check(id, old_hash, key);
+
+    if (res == USER_DATABASE_OPERATION_OK) {
+        USER_CHUNK(id)->hash[USER_SLOT(id)] = new_hash;
+        user_database_journal(USER_JOURNAL_PASSWORD, id, new_hash, "");
+    }
+
+    pthread_rwlock_unlock(USER_STRIPE(id));
+
+    return res;
+}
+
+/**
+ * Appends a new empty chunk to the slab. The ids lock must be held.
+ */
+static int8_t user_database_grow() {
+
+    struct user_chunk chunk;
+    uint8_t *block = calloc(
+            USER_CHUNK_SIZE,
+            sizeof *chunk.hash + sizeof *chunk.online
+            + sizeof *chunk.flags + sizeof *chunk.username
+    );
+    if (block == NULL) return USER_DATABASE_TOO_MANY_USERS;
+
+    chunk.hash = (uint64_t *) block;
+    chunk.online = (uint32_t *) (chunk.hash + USER_CHUNK_SIZE);
+    chunk.flags = (uint8_t *) (chunk.online + USER_CHUNK_SIZE);
+    chunk.username = (void *) (chunk.flags + USER_CHUNK_SIZE);
+    chunk.allocation = block;
+
+    int8_t res = user_database_attach(chunk);
+    if (res < 0) free(block);
+
+    return res;
+}
+
+/**
+ * Appends a chunk to the slab, replacing the chunk directory by a larger copy
+ * when it is full. The ids of the chunk are free. The ids lock must be held.
+ */
+static int8_t user_database_attach(struct user_chunk chunk) {
+
+    struct user_chunk *directory = atomic_load(&user_database);
+    size_t size = atomic_load(&user_database_size);
+    size_t count = size / USER_CHUNK_SIZE;
+    size_t capacity = user_database_capacity;
+    struct user_chunk *larger = NULL;
+
+    if (count == capacity) {
+        capacity = capacity ? 2 * capacity : 16;
+        larger = malloc(capacity * sizeof *larger);
+        if (larger == NULL) return USER_DATABASE_TOO_MANY_USERS;
+        if (count > 0) memcpy(larger, directory, count * sizeof *larger);
+    }
+
+    if (user_id_allocator_grow(
+            &user_database_ids,
+            size + USER_CHUNK_SIZE
+    ) < 0) {
+        free(larger);
+        return USER_DATABASE_TOO_MANY_USERS;
+    }
+
+    if (larger != NULL) {
+        if (directory != NULL) {
+            user_database_retired[user_database_retired_count++] = directory;
+        }
+        directory = larger;
+        user_database_capacity = capacity;
+    }
+
+    // Readers checking an id against the size then find its chunk
+    directory[count] = chunk;
+    atomic_store(&user_database, directory);
+    atomic_store(&user_database_size, size + USER_CHUNK_SIZE);
+
+    return USER_DATABASE_OPERATION_OK;
+}
+
+/**
+ * Loads the persistent database file into the slab, and copies it to the
+ * backup file. If the persistent file is missing, it is restored from the
+ * backup first.
+ *
+ * The file is mapped rather than read : its chunks are used in place, and only
+ * the pages touched are read from the disk.
+ */
+static int8_t user_database_load() {
+
+    if (access(USER_DATABASE_PATH, F_OK) < 0) {
+
+        if (access(USER_DATABASE_BACKUP_PATH, F_OK) < 0) {
+            return USER_DATABASE_OPERATION_OK; // No persistent data
+        }
+
+        if (user_database_file_copy(
+                USER_DATABASE_BACKUP_PATH,
+                USER_DATABASE_PATH
+        ) < 0) {
             fprintf(
                     USER_DATABASE_ERR_STREAM,
-                    "Failed to open database persistent file.\n"
+                    "Failed to create database persistent file.\n"
             );
             return USER_DATABASE_INIT_FAILED;
         }
+    } else if (user_database_file_copy(
+            USER_DATABASE_PATH,
+            USER_DATABASE_BACKUP_PATH
+    ) < 0) {
+        fprintf(
+                USER_DATABASE_ERR_STREAM,
+                "Failed to create database backup file.\n"
+        );
+        return USER_DATABASE_INIT_FAILED;
+    }
+
+    struct user_database_header header;
+    void *chunks;
+    size_t length;
+
+    if (user_database_file_map(
+            USER_DATABASE_PATH,
+            &header, &chunks, &length
+    ) < 0) {
+        // Only files written before the header are read as bare records
+        if (errno == ENOMSG) return user_database_load_v0(USER_DATABASE_PATH);
+        fprintf(
+                USER_DATABASE_ERR_STREAM,
+                (errno == EINVAL)
+                ? "Database persistent file is corrupted or of an unknown "
+                  "version.\n"
+                : "Failed to open database persistent file.\n"
+        );
+        return USER_DATABASE_INIT_FAILED;
+    }
+
+    if (header.chunk_records != USER_CHUNK_SIZE) {
+        fprintf(
+                USER_DATABASE_ERR_STREAM,
+                "Database persistent file has %u users per chunk, not %d.\n",
+                header.chunk_records, USER_CHUNK_SIZE
+        );
+        user_database_file_unmap(chunks, length);
+        return USER_DATABASE_INIT_FAILED;
+    }
+
+    if (user_database_verify
+        && user_database_file_checksum(
+            USER_DATABASE_FILE_CHECKSUM_INIT, chunks, length
+    ) != header.checksum) {
+        fprintf(
+                USER_DATABASE_ERR_STREAM,
+                "Database persistent file is corrupted.\n"
+        );
+        user_database_file_unmap(chunks, length);
+        return USER_DATABASE_INIT_FAILED;
+    }
+
+    user_database_mapping = chunks;
+    user_database_mapping_length = length;
+
+    uint8_t *data = chunks;
+    size_t count = 0;
+
+    for (size_t c = 0; c < header.chunk_count; c++) {
 
-        database_write = fopen(USER_DATABASE_BACKUP_PATH, "wb");
+        struct user_chunk chunk = {
+                .hash = (uint64_t *) data,
+                .flags = data + USER_CHUNK_SIZE * sizeof *chunk.hash,
+                .online = calloc(USER_CHUNK_SIZE, sizeof *chunk.online)
+        };
+        chunk.username = (void *) (chunk.flags + USER_CHUNK_SIZE);
+        chunk.allocation = chunk.online;
+        data += USER_DATABASE_FILE_CHUNK_SIZE(USER_CHUNK_SIZE);
 
-        if (database_write == NULL) {
+        if (chunk.online == NULL || user_database_attach(chunk) < 0) {
+            free(chunk.online);
             fprintf(
                     USER_DATABASE_ERR_STREAM,
-                    "Failed to create database backup file.\n"
+                    "Failed to load database persistent file.\n"
             );
             return USER_DATABASE_INIT_FAILED;
         }
-    }
 
-    struct userinfo *user = NULL;
-    while (fread(user, sizeof *user, 1, database_read) > 0) {
-        user_database_insert(user);
-        fwrite(user, sizeof *user, 1, database_write);
-    };
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        for (size_t slot = 0; slot < USER_CHUNK_SIZE; slot++) {
+            chunk.hash[slot] = __builtin_bswap64(chunk.hash[slot]);
+        }
+#endif
+
+        size_t first = user_database_size - USER_CHUNK_SIZE;
+        for (size_t slot = 0; slot < USER_CHUNK_SIZE; slot++) {
+            if (chunk.flags[slot] & USERINFO_FLAG_USED) {
+                user_id_allocator_claim(&user_database_ids, first + slot);
+                count++;
+            }
+        }
+    }
 
-    fclose(database_read);
-    fclose(database_write);
+    if (count != header.record_count) {
+        fprintf(
+                USER_DATABASE_ERR_STREAM,
+                "Database persistent file holds %zu users, expected %llu.\n",
+                count, (unsigned long long) header.record_count
+        );
+    }
 
     return USER_DATABASE_OPERATION_OK;
 }
 
-int8_t user_database_close() {
+/**
+ * Loads a database file of the former format, by reading every record.
+ */
+static int8_t user_database_load_v0(const char *path) {
 
-    FILE *database_persistent = fopen(USER_DATABASE_PATH, "wb");
+    FILE *database_read = fopen(path, "rb");
 
-    if (database_persistent == NULL) {
+    if (database_read == NULL) {
         fprintf(
                 USER_DATABASE_ERR_STREAM,
-                "Failed to create database persistent file.\n"
+                "Failed to open database persistent file.\n"
         );
-        return USER_DATABASE_CLOSE_FAILED;
+        return USER_DATABASE_INIT_FAILED;
     }
 
-    for (size_t i = 0; i < user_database_size; i++) {
+    struct userinfo_v0 legacy;
+    while (fread(&legacy, sizeof legacy, 1, database_read) > 0) {
+        struct userinfo user = {
+                .username = "",
+                .hash = legacy.hash,
+                .id = legacy.id,
+                .flags = 0
+        };
+        memcpy(user.username, legacy.username, sizeof legacy.username);
+        user_database_insert(&user);
+    }
 
-        struct userinfo *user = user_database[i];
+    fclose(database_read);
 
-        if (user == NULL) continue;
+    return USER_DATABASE_OPERATION_OK;
+}
+
+/**
+ * Writes a snapshot of the slab in the database file format. The snapshot is
+ * written aside, synchronized, then renamed over the given path, so that the
+ * file is either the former or the new snapshot, never a part of it.
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int user_database_write(const char *path) {
+
+    FILE *file = fopen(USER_DATABASE_TEMP_PATH, "wb");
+    if (file == NULL) return -1;
+
+    struct user_database_header header = {
+            .version = USER_DATABASE_FILE_VERSION,
+            .chunk_records = USER_CHUNK_SIZE,
+            .record_count = 0,
+            .chunk_count = user_database_size / USER_CHUNK_SIZE,
+            .checksum = USER_DATABASE_FILE_CHECKSUM_INIT
+    };
 
-        // Set user offline
-        user->flags &= ~USERINFO_FLAG_ONLINE;
+    // Reserve the header, written once the chunks are known
+    int ok = user_database_file_write_header(file, &header) == 0;
 
-        fwrite(user_database[i], sizeof(*user), 1, database_persistent);
+    uint64_t hash[USER_CHUNK_SIZE];
+    uint8_t flags[USER_CHUNK_SIZE];
 
-        free(user);
-        user_database[i] = NULL;
+    for (size_t c = 0; ok && c < header.chunk_count; c++) {
+
+        struct user_chunk *chunk = &user_database[c];
+
+        for (size_t slot = 0; slot < USER_CHUNK_SIZE; slot++) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            hash[slot] = __builtin_bswap64(chunk->hash[slot]);
+#else
+            hash[slot] = chunk->hash[slot];
+#endif
+            // Users are saved offline
+            flags[slot] = chunk->flags[slot] & ~USERINFO_FLAG_ONLINE;
+            if (flags[slot] & USERINFO_FLAG_USED) header.record_count++;
+        }
+
+        header.checksum = user_database_file_checksum(
+                header.checksum, hash, sizeof hash
+        );
+        header.checksum = user_database_file_checksum(
+                header.checksum, flags, sizeof flags
+        );
+        header.checksum = user_database_file_checksum(
+                header.checksum, chunk->username,
+                USER_CHUNK_SIZE * sizeof *chunk->username
+        );
+
+        ok = fwrite(hash, sizeof hash, 1, file) == 1
+             && fwrite(flags, sizeof flags, 1, file) == 1
+             && fwrite(chunk->username, sizeof *chunk->username,
+                       USER_CHUNK_SIZE, file) == USER_CHUNK_SIZE;
     }
 
-    free(user_database);
-    user_database = NULL;
+    ok = ok && user_database_file_write_header(file, &header) == 0
+         && fflush(file) == 0
+         && fsync(fileno(file)) == 0;
+    ok = (fclose(file) == 0) && ok
+         && rename(USER_DATABASE_TEMP_PATH, path) == 0;
 
-    return USER_DATABASE_OPERATION_OK;
+    return ok ? 0 : -1;
 }
 
-int8_t user_database_create(const char *username, uint64_t hash, size_t *id) {
+/**
+ * Reaps the process writing a background snapshot, which reports its duration
+ * and size itself. Once the snapshot is persisted, the old journal is not
+ * needed anymore.
+ *
+ * @param block whether to wait for the snapshot to end
+ */
+static void user_database_snapshot_wait(int block) {
+
+    int status;
+    pid_t pid = waitpid(
+            user_database_snapshot_pid,
+            &status,
+            block ? 0 : WNOHANG
+    );
+
+    if (pid == 0) return; // Still running
+    user_database_snapshot_pid = 0;
+
+    if (pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        fprintf(
+                USER_DATABASE_ERR_STREAM,
+                "Database snapshot failed.\n"
+        );
+        return;
+    }
 
-    *id = user_database_next_id();
+    unlink(USER_DATABASE_JOURNAL_OLD_PATH);
+}
 
-    if (*id == 0) return USER_DATABASE_TOO_MANY_USERS;
+/**
+ * Gets the time elapsed since the last snapshot started, in milliseconds.
+ */
+static double user_database_snapshot_elapsed() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) (now.tv_sec - user_database_snapshot_start.tv_sec) * 1e3
+           + (double) (now.tv_nsec - user_database_snapshot_start.tv_nsec)
+             / 1e6;
+}
 
-    struct userinfo user = {
-            .username = "",
-            .hash = hash,
-            .id = *id,
-            .flags = 0
-    };
-    strcpy(user.username, username);
+/**
+ * Initializes the stripe, username index and online set locks. The stripe locks
+ * prefer writers, so that readers can't hold a snapshot off forever.
+ */
+static void user_database_lock_init() {
+
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(
+            &attr,
+            PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP
+    );
+    for (size_t s = 0; s < USER_DATABASE_STRIPES; s++) {
+        pthread_rwlock_init(&user_database_stripes[s], &attr);
+    }
+    pthread_rwlockattr_destroy(&attr);
 
-    return user_database_insert(&user);
+    for (size_t s = 0; s < USER_NAME_SHARDS; s++) {
+        pthread_rwlock_init(&user_name_index[s].lock, NULL);
+    }
+    pthread_rwlock_init(&user_online_lock, NULL);
 }
 
-int8_t user_database_delete(size_t id, uint64_t hash) {
+static void user_database_lock_destroy() {
+    for (size_t s = 0; s < USER_DATABASE_STRIPES; s++) {
+        pthread_rwlock_destroy(&user_database_stripes[s]);
+    }
+    for (size_t s = 0; s < USER_NAME_SHARDS; s++) {
+        pthread_rwlock_destroy(&user_name_index[s].lock);
+    }
+    pthread_rwlock_destroy(&user_online_lock);
+}
 
-    int8_t check = user_database_check_hash(id, hash);
-    if (check < 0) return check;
+/**
+ * Frees the slot of an user, in the slab and in the id allocator only.
+ */
+static void user_database_clear(size_t id) {
 
-    free(user_database[id]);
-    user_database[id] = NULL;
+    if (id >= user_database_size) return;
 
-    return USER_DATABASE_OPERATION_OK;
+    struct user_chunk *chunk = USER_CHUNK(id);
+    size_t slot = USER_SLOT(id);
+    chunk->flags[slot] = 0;
+    chunk->hash[slot] = 0;
+
+    pthread_mutex_lock(&user_database_ids_lock);
+    user_id_allocator_release(&user_database_ids, id);
+    pthread_mutex_unlock(&user_database_ids_lock);
 }
 
-int8_t user_database_login(size_t id, uint64_t hash) {
+/**
+ * Applies a journal record to the slab. Replay happens before the username
+ * index is built, and records may be applied again on top of a snapshot which
+ * already includes them, so each record sets the final state of its user.
+ */
+static void user_database_apply(const struct user_journal_record *record) {
+
+    size_t id = (size_t) record->id;
+    if (id == 0) return;
+
+    switch (record->op) {
+        case USER_JOURNAL_CREATE: {
+            struct userinfo user = {
+                    .hash = record->hash,
+                    .id = id,
+                    .flags = 0
+            };
+            user_name_key(record->username, user.username);
+            user_database_clear(id);
+            user_database_insert(&user);
+            break;
+        }
+        case USER_JOURNAL_DELETE:
+            user_database_clear(id);
+            break;
+        case USER_JOURNAL_PASSWORD:
+            if (id < user_database_size
+                && USER_CHUNK(id)->flags[USER_SLOT(id)] & USERINFO_FLAG_USED) {
+                USER_CHUNK(id)->hash[USER_SLOT(id)] = record->hash;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * Appends a mutation to the journal.
+ */
+static void user_database_journal(
+        uint8_t op,
+        size_t id,
+        uint64_t hash,
+        const char *username
+) {
+    struct user_journal_record record = {
+            .op = op,
+            .id = id,
+            .hash = hash
+    };
+    strncpy(record.username, username, sizeof record.username - 1);
+
+    if (user_journal_append(&record) < 0) {
+        fprintf(
+                USER_DATABASE_ERR_STREAM,
+                "Failed to journal operation on user #%zu.\n",
+                id
+        );
+    }
+}
+
+/* -------------------------------------------------------------------------- */
 
-    int8_t check = user_database_check_hash(id, hash);
-    if (check < 0) return check;
+/**
+ * Adds an user to the online set. The stripe lock of the user must be held.
+ */
+static int8_t user_online_add(size_t id) {
 
-    struct userinfo *user = user_database[id];
+    pthread_rwlock_wrlock(&user_online_lock);
 
-    if (user->flags & USERINFO_FLAG_ONLINE) {
-        return USER_DATABASE_ALREADY_CONNECTED;
+    if (user_online_count == user_online_capacity) {
+        size_t capacity = user_online_capacity ? 2 * user_online_capacity
+                                               : USER_CHUNK_SIZE;
+        size_t *online = realloc(user_online, capacity * sizeof *online);
+        if (online == NULL) {
+            pthread_rwlock_unlock(&user_online_lock);
+            return USER_DATABASE_INSERT_FAILED;
+        }
+        user_online = online;
+        user_online_capacity = capacity;
     }
 
-    user->flags |= USERINFO_FLAG_ONLINE;
+    user_online[user_online_count++] = id;
+    USER_CHUNK(id)->online[USER_SLOT(id)] = (uint32_t) user_online_count;
+    user_online_generation++;
+
+    pthread_rwlock_unlock(&user_online_lock);
 
     return USER_DATABASE_OPERATION_OK;
 }
 
-int8_t user_database_logout(size_t id, uint64_t hash) {
+/**
+ * Removes an user from the online set, moving the last online user in its
+ * place. The stripe lock of the user must be held.
+ */
+static void user_online_remove(size_t id) {
 
-    int8_t check = user_database_check_hash(id, hash);
-    if (check < 0) return check;
+    pthread_rwlock_wrlock(&user_online_lock);
 
-    struct userinfo *user = user_database[id];
+    uint32_t *position = &USER_CHUNK(id)->online[USER_SLOT(id)];
+    if (*position != 0) {
+        size_t last = user_online[--user_online_count];
+        user_online[*position - 1] = last;
+        USER_CHUNK(last)->online[USER_SLOT(last)] = *position;
+        *position = 0;
 
-    if (!(user->flags & USERINFO_FLAG_ONLINE)) {
-        return USER_DATABASE_NOT_CONNECTED;
+        user_online_generation++;
     }
 
-    user->flags &= ~(USERINFO_FLAG_ONLINE);
-
-    return USER_DATABASE_OPERATION_OK;
+    pthread_rwlock_unlock(&user_online_lock);
 }
 
-int8_t user_database_password(size_t id, uint64_t old_hash, uint64_t new_hash) {
+/**
+ * Rebuilds the serialized list of online usernames. The online set lock must be
+ * held for writing. The name of an online user doesn't change while the lock is
+ * held, since deleting the user takes it first.
+ */
+static int8_t user_online_serialize() {
+
+    // Each username is followed by a separator or the terminating null byte
+    size_t capacity = 1 + user_online_count * USERINFO_USERNAME_SIZE;
+
+    if (capacity > user_online_cache_capacity) {
+        char *cache = realloc(user_online_cache, capacity);
+        if (cache == NULL) return USER_DATABASE_INSERT_FAILED;
+        user_online_cache = cache;
+        user_online_cache_capacity = capacity;
+    }
 
-    int8_t check = user_database_check_hash(id, old_hash);
-    if (check < 0) return check;
+    char *end = user_online_cache;
+    for (size_t i = 0; i < user_online_count; i++) {
+        size_t id = user_online[i];
+        const char *username = USER_CHUNK(id)->username[USER_SLOT(id)];
+        size_t len = strnlen(username, USERINFO_USERNAME_SIZE);
+        if (i > 0) *end++ = ';';
+        memcpy(end, username, len);
+        end += len;
+    }
+    *end = '\0';
 
-    user_database[id]->hash = new_hash;
+    user_online_cache_length = (size_t) (end - user_online_cache);
+    user_online_cache_generation = user_online_generation;
 
     return USER_DATABASE_OPERATION_OK;
 }
 
-int8_t user_database_list(char *buffer) {
-    strcpy(buffer, "");
-    for (size_t i = 0; i < user_database_size; i++) {
-        struct userinfo *user = user_database[i];
-        if (user == NULL) continue;
-        if (user->flags & USERINFO_FLAG_ONLINE) {
-            if (strlen(buffer) > 0) strcat(buffer, ";");
-            strcat(buffer, user->username);
-        }
+/**
+ * Copies an username into a zero-padded index key, truncating it the same way
+ * it is truncated when stored.
+ */
+static void user_name_key(const char *username, char *key) {
+    size_t len = strnlen(username, USERINFO_USERNAME_SIZE - 1);
+    memset(key, 0, USERINFO_USERNAME_SIZE);
+    memcpy(key, username, len);
+}
+
+/**
+ * Hashes an username key (64-bit FNV-1a).
+ */
+static uint64_t user_name_hash(const char *key) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < USERINFO_USERNAME_SIZE && key[i] != '\0'; i++) {
+        hash ^= (uint8_t) key[i];
+        hash *= 0x100000001b3ULL;
     }
-    return USER_DATABASE_OPERATION_OK;
+    return hash;
 }
 
-int8_t user_database_insert(struct userinfo *user) {
+/**
+ * Gets the index shard holding the names of a given hash.
+ */
+static struct user_name_shard *user_name_shard(uint64_t hash) {
+    return &user_name_index[hash >> 60 & (USER_NAME_SHARDS - 1)];
+}
 
-    if (user == NULL) {
-        return USER_DATABASE_INSERT_FAILED;
+/**
+ * Gets the id of the user registered under a given key. The shard lock must be
+ * held.
+ *
+ * @return the id, or 0 if no user has this name
+ */
+static size_t user_name_index_find(
+        struct user_name_shard *shard,
+        const char *key,
+        uint64_t hash
+) {
+    if (shard->size == 0) return 0;
+
+    size_t mask = shard->size - 1;
+
+    for (size_t pos = (uint32_t) hash & mask, distance = 1;;
+         pos = (pos + 1) & mask, distance++) {
+
+        struct user_name_entry *entry = &shard->buckets[pos];
+
+        // Every entry after this one is closer to its home bucket
+        if (entry->distance < distance) return 0;
+
+        if (entry->hash == (uint32_t) hash
+            && strncmp(
+                USER_CHUNK(entry->id)->username[USER_SLOT(entry->id)],
+                key,
+                USERINFO_USERNAME_SIZE
+        ) == 0) {
+            return entry->id;
+        }
     }
+}
 
-    if (user->id >= user_database_size) {
-        return USER_DATABASE_TOO_MANY_USERS;
+/**
+ * Places an entry in the shard buckets, displacing the entries which are
+ * closer to their home bucket than it is.
+ */
+static void user_name_index_place(
+        struct user_name_shard *shard,
+        struct user_name_entry entry
+) {
+    size_t mask = shard->size - 1;
+    size_t pos = entry.hash & mask;
+    entry.distance = 1;
+
+    while (shard->buckets[pos].distance != 0) {
+        if (shard->buckets[pos].distance < entry.distance) {
+            struct user_name_entry displaced = shard->buckets[pos];
+            shard->buckets[pos] = entry;
+            entry = displaced;
+        }
+        pos = (pos + 1) & mask;
+        entry.distance++;
     }
 
-    if (user_database[user->id] != NULL) {
-        return USER_DATABASE_ALREADY_EXISTS;
+    shard->buckets[pos] = entry;
+}
+
+/**
+ * Reallocates a shard with a given number of buckets and places every entry
+ * again.
+ */
+static int8_t user_name_index_resize(
+        struct user_name_shard *shard,
+        size_t size
+) {
+    struct user_name_entry *old = shard->buckets;
+    size_t old_size = shard->size;
+
+    struct user_name_entry *buckets = calloc(size, sizeof *buckets);
+    if (buckets == NULL) return USER_DATABASE_INSERT_FAILED;
+
+    shard->buckets = buckets;
+    shard->size = size;
+
+    for (size_t pos = 0; pos < old_size; pos++) {
+        if (old[pos].distance != 0) user_name_index_place(shard, old[pos]);
     }
+    free(old);
 
-    // Set user offline
-    user->flags &= ~(1UL << USERINFO_FLAG_ONLINE);
+    return USER_DATABASE_OPERATION_OK;
+}
 
-    user_database[user->id] = malloc(sizeof(struct userinfo));
-    memcpy(user_database[user->id], user, sizeof(struct userinfo));
+/**
+ * Adds an user to the shard of its name hash, which must not already hold the
+ * name. The shard doubles when it would become more than 7/8 full. The shard
+ * lock must be held for writing.
+ */
+static int8_t user_name_index_add(
+        struct user_name_shard *shard,
+        uint64_t hash,
+        size_t id
+) {
+    if (8 * (shard->count + 1) > 7 * shard->size) {
+        size_t size = shard->size ? 2 * shard->size : USER_NAME_INDEX_MIN_SIZE;
+        if (user_name_index_resize(shard, size) < 0) {
+            return USER_DATABASE_INSERT_FAILED;
+        }
+    }
+
+    struct user_name_entry entry = {
+            .hash = (uint32_t) hash,
+            .id = id
+    };
+    user_name_index_place(shard, entry);
+    shard->count++;
 
     return USER_DATABASE_OPERATION_OK;
 }
 
-int8_t user_database_check_hash(size_t id, uint64_t hash) {
+/**
+ * Removes an user from the shard of its name hash. The entries following it
+ * are shifted back, so no tombstone is left behind. The shard lock must be held
+ * for writing.
+ */
+static void user_name_index_remove(
+        struct user_name_shard *shard,
+        uint64_t hash,
+        size_t id
+) {
+    if (shard->size == 0) return;
+
+    struct user_name_entry *buckets = shard->buckets;
+    size_t mask = shard->size - 1;
+    size_t pos = (uint32_t) hash & mask;
+
+    for (size_t distance = 1; buckets[pos].id != id;
+         pos = (pos + 1) & mask, distance++) {
+        if (buckets[pos].distance < distance) return; // Not indexed
+    }
 
-    if (id >= user_database_size || user_database[id] == NULL) {
-        return USER_DATABASE_NOT_EXISTS;
+    size_t next = (pos + 1) & mask;
+    while (buckets[next].distance > 1) {
+        buckets[pos] = buckets[next];
+        buckets[pos].distance--;
+        pos = next;
+        next = (next + 1) & mask;
     }
 
-    return (user_database[id]->hash == hash)
-           ? USER_DATABASE_OPERATION_OK
-           : USER_DATABASE_INVALID_CREDENTIALS;
+    buckets[pos] = (struct user_name_entry) {0};
+    shard->count--;
 }
 
-size_t user_database_next_id() {
-    for (size_t i = 1; i < user_database_size; i++) {
-        if (user_database[i] == NULL) return i;
+/**
+ * Builds the index from scratch out of the slab, each shard being sized for its
+ * users at once. Users whose name is already taken by a lower id are left out
+ * of the index. Called before the database is shared, so no lock is taken.
+ */
+static int8_t user_name_index_rebuild() {
+
+    size_t size = atomic_load(&user_database_size);
+    size_t count[USER_NAME_SHARDS] = {0};
+
+    for (size_t id = 1; id < size; id++) {
+        struct user_chunk *chunk = USER_CHUNK(id);
+        size_t slot = USER_SLOT(id);
+        if (chunk->flags[slot] & USERINFO_FLAG_USED) {
+            uint64_t hash = user_name_hash(chunk->username[slot]);
+            count[user_name_shard(hash) - user_name_index]++;
+        }
+    }
+
+    for (size_t s = 0; s < USER_NAME_SHARDS; s++) {
+
+        struct user_name_shard *shard = &user_name_index[s];
+        size_t buckets = USER_NAME_INDEX_MIN_SIZE;
+        while (8 * count[s] > 7 * buckets) buckets *= 2;
+
+        free(shard->buckets);
+        shard->buckets = NULL;
+        shard->size = 0;
+        shard->count = 0;
+
+        if (user_name_index_resize(shard, buckets) < 0) {
+            return USER_DATABASE_INIT_FAILED;
+        }
     }
-    return 0;
-}
\ No newline at end of file
+
+    for (size_t id = 1; id < size; id++) {
+
+        struct user_chunk *chunk = USER_CHUNK(id);
+        size_t slot = USER_SLOT(id);
+
+        if (!(chunk->flags[slot] & USERINFO_FLAG_USED)) continue;
+
+        char key[USERINFO_USERNAME_SIZE];
+        user_name_key(chunk->username[slot], key);
+        uint64_t hash = user_name_hash(key);
+        struct user_name_shard *shard = user_name_shard(hash);
+
+        if (user_name_index_find(shard, key, hash) != 0) {
+            fprintf(
+                    USER_DATABASE_ERR_STREAM,
+                    "Username %s of user #%zu is already taken.\n",
+                    key, id
+            );
+            continue;
+        }
+
+        user_name_index_add(shard, hash, id);
+    }
+
+    return USER_DATABASE_OPERATION_OK;
+}
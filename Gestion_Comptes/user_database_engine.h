@@ -2,6 +2,7 @@
 #define USER_DATABASE_ENGINE_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 /**
  * Path to the persistent database.
@@ -13,6 +14,21 @@
  */
 #define USER_DATABASE_BACKUP_PATH "./users.dat.bak"
 
+/**
+ * Path to the journal of the operations applied since the last snapshot.
+ */
+#define USER_DATABASE_JOURNAL_PATH "./users.dat.journal"
+
+/**
+ * Path to the journal of the operations included in the running snapshot.
+ */
+#define USER_DATABASE_JOURNAL_OLD_PATH "./users.dat.journal.old"
+
+/**
+ * Path to which a snapshot is written before replacing the persistent database.
+ */
+#define USER_DATABASE_TEMP_PATH "./users.dat.tmp"
+
 /**
  * Application standard output stream.
  */
@@ -27,6 +43,9 @@
 /** Operation successful. */
 #define USER_DATABASE_OPERATION_OK 0
 
+/** Operation partially successful : output was truncated */
+#define USER_DATABASE_TRUNCATED 1
+
 /** Operation failed : invalid username or password */
 #define USER_DATABASE_INVALID_CREDENTIALS (-1)
 
@@ -42,7 +61,7 @@
 /** Operation failed : user not connected */
 #define USER_DATABASE_NOT_CONNECTED (-5)
 
-/** Operation failed : database is full */
+/** Operation failed : database could not grow */
 #define USER_DATABASE_TOO_MANY_USERS (-5)
 
 /** Server error : failed to initialize database */
@@ -54,11 +73,70 @@
 /** Server error : failed to insert user */
 #define USER_DATABASE_INSERT_FAILED (-13)
 
+/** Server error : failed to start a snapshot */
+#define USER_DATABASE_SNAPSHOT_FAILED (-14)
+
+/** Server error : a snapshot is already running */
+#define USER_DATABASE_SNAPSHOT_RUNNING (-15)
+
+/*
+ * The operations on users may be called by several threads at once. The
+ * functions setting the database up, user_database_init, user_database_close
+ * and the user_database_set_* ones, may not run concurrently with any other
+ * call, and user_database_snapshot and user_database_tick are to be called
+ * from a single thread.
+ */
+
 /**
  * Initializes the database and loads the persistent data.
  */
 extern int8_t user_database_init();
 
+/**
+ * Sets the group commit policy of the journal. To be called before
+ * user_database_init.
+ *
+ * @param batch number of pending records which triggers a synchronization
+ * @param delay maximum time, in microseconds, a record stays unsynchronized
+ */
+extern void user_database_set_commit_policy(size_t batch, uint32_t delay);
+
+/**
+ * Sets whether the data checksum of the persistent database is verified when
+ * loaded. Verifying reads the whole file, instead of the pages used only. To be
+ * called before user_database_init.
+ *
+ * @param verify non-zero to verify the checksum
+ */
+extern void user_database_set_verify(uint8_t verify);
+
+/**
+ * Sets the interval between background snapshots. To be called before
+ * user_database_init.
+ *
+ * @param interval interval in seconds, 0 to only save the database when closed
+ */
+extern void user_database_set_snapshot_interval(uint32_t interval);
+
+/**
+ * Starts writing a snapshot of the database in the background, in a child
+ * process holding a copy-on-write image of the table. The snapshot replaces the
+ * persistent data once complete.
+ *
+ * @return USER_DATABASE_OPERATION_OK
+ *         <hr>
+ *         USER_DATABASE_SNAPSHOT_RUNNING<br>
+ *         USER_DATABASE_SNAPSHOT_FAILED
+ */
+extern int8_t user_database_snapshot();
+
+/**
+ * Performs the periodic work of the database : starts a snapshot when the
+ * interval elapsed, and reports the snapshot once it is complete. To be called
+ * regularly, between operations.
+ */
+extern void user_database_tick();
+
 /**
  * Closes the database and saves to the persistent data.
  */
@@ -69,7 +147,8 @@ extern int8_t user_database_close();
  *
  * @param username name of the user
  * @param hash produced by the user's password
- * @param id the id of the newly created user
+ * @param id the id of the newly created user, or of the user already
+ *           registered under this name
  *
  * @return USER_DATABASE_OPERATION_OK
  *         <hr>
@@ -150,12 +229,102 @@ extern int8_t user_database_password(
 );
 
 /**
- * Gets the list of online users.
+ * Checks an user's password, without modifying the user : concurrent checks
+ * don't exclude each other.
+ *
+ * @param id id of the user
+ * @param hash produced by the user's password
+ *
+ * @return USER_DATABASE_OPERATION_OK
+ *         <hr>
+ *         USER_DATABASE_INVALID_CREDENTIALS<br>
+ *         USER_DATABASE_NOT_EXISTS
+ */
+extern int8_t user_database_check_hash(
+        size_t id,
+        uint64_t hash
+);
+
+/**
+ * Gets the id of the user registered under a given name.
+ *
+ * @param username name of the user
+ * @param id the id of the user
+ *
+ * @return USER_DATABASE_OPERATION_OK
+ *         <hr>
+ *         USER_DATABASE_NOT_EXISTS
+ */
+extern int8_t user_database_find(
+        const char *username,
+        size_t *id
+);
+
+/**
+ * Attempts to delete an user, given by name.
+ *
+ * @param username name of the user
+ * @param hash produced by the user's password
+ *
+ * @return USER_DATABASE_OPERATION_OK
+ *         <hr>
+ *         USER_DATABASE_INVALID_CREDENTIALS<br>
+ *         USER_DATABASE_NOT_EXISTS
+ */
+extern int8_t user_database_delete_by_name(
+        const char *username,
+        uint64_t hash
+);
+
+/**
+ * Attempts to log in an user, given by name.
+ *
+ * @param username name of the user
+ * @param hash produced by the user's password
+ * @param id the id of the user
+ *
+ * @return USER_DATABASE_OPERATION_OK
+ *         <hr>
+ *         USER_DATABASE_INVALID_CREDENTIALS<br>
+ *         USER_DATABASE_ALREADY_CONNECTED<br>
+ *         USER_DATABASE_NOT_EXISTS
+ */
+extern int8_t user_database_login_by_name(
+        const char *username,
+        uint64_t hash,
+        size_t *id
+);
+
+/**
+ * Attempts to change an user's password, given by name.
+ *
+ * @param username name of the user
+ * @param old_hash produced by the user's old password
+ * @param new_hash produced by the user's new password
+ *
+ * @return USER_DATABASE_OPERATION_OK
+ *         <hr>
+ *         USER_DATABASE_INVALID_CREDENTIALS<br>
+ *         USER_DATABASE_NOT_EXISTS
+ */
+extern int8_t user_database_password_by_name(
+        const char *username,
+        uint64_t old_hash,
+        uint64_t new_hash
+);
+
+/**
+ * Gets the list of online users. The list is serialized again only when users
+ * logged in or out since the previous call, concurrent calls otherwise
+ * share it without excluding each other.
  *
  * @param buffer The usernames of online users, CSV-style
+ * @param size size of the buffer
  *
  * @return USER_DATABASE_OPERATION_OK
+ *         <hr>
+ *         USER_DATABASE_TRUNCATED
  */
-extern int8_t user_database_list(char *buffer);
+extern int8_t user_database_list(char *buffer, size_t size);
 
 #endif
@@ -0,0 +1,164 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include "user_database_file.h"
+#include "little_endian.h"
+
+/** Number of meaningful bytes of the header, covered by its checksum. */
+#define HEADER_BYTES 48
+
+int user_database_file_map(
+        const char *path,
+        struct user_database_header *header,
+        void **chunks,
+        size_t *length
+) {
+    *chunks = NULL;
+    *length = 0;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+
+    uint8_t bytes[HEADER_BYTES];
+    struct stat st;
+
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    ssize_t read = pread(fd, bytes, sizeof bytes, 0);
+
+    // Files without the magic are told apart from damaged ones
+    if (read < 8 || memcmp(bytes, USER_DATABASE_FILE_MAGIC, 8) != 0) {
+        close(fd);
+        errno = (read < 0) ? errno : ENOMSG;
+        return -1;
+    }
+
+    if (read != sizeof bytes
+        || load_le(bytes + 40, 8) != user_database_file_checksum(
+            USER_DATABASE_FILE_CHECKSUM_INIT, bytes, 40
+    )) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    header->version = (uint32_t) load_le(bytes + 8, 4);
+    header->chunk_records = (uint32_t) load_le(bytes + 12, 4);
+    header->record_count = load_le(bytes + 16, 8);
+    header->chunk_count = load_le(bytes + 24, 8);
+    header->checksum = load_le(bytes + 32, 8);
+
+    size_t chunk_size = USER_DATABASE_FILE_CHUNK_SIZE(header->chunk_records);
+    size_t size = header->chunk_count * chunk_size;
+
+    if (header->version != USER_DATABASE_FILE_VERSION
+        || chunk_size % (size_t) sysconf(_SC_PAGESIZE) != 0
+        || (off_t) (USER_DATABASE_FILE_HEADER_SIZE + size) > st.st_size) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    void *mapping = mmap(
+            NULL, size,
+            PROT_READ | PROT_WRITE, MAP_PRIVATE,
+            fd, USER_DATABASE_FILE_HEADER_SIZE
+    );
+    close(fd);
+
+    if (mapping == MAP_FAILED) return -1;
+
+    *chunks = mapping;
+    *length = size;
+
+    return 0;
+}
+
+void user_database_file_unmap(void *chunks, size_t length) {
+    if (chunks != NULL) munmap(chunks, length);
+}
+
+int user_database_file_write_header(
+        FILE *file,
+        const struct user_database_header *header
+) {
+    uint8_t bytes[USER_DATABASE_FILE_HEADER_SIZE] = {0};
+
+    memcpy(bytes, USER_DATABASE_FILE_MAGIC, 8);
+    store_le(bytes + 8, header->version, 4);
+    store_le(bytes + 12, header->chunk_records, 4);
+    store_le(bytes + 16, header->record_count, 8);
+    store_le(bytes + 24, header->chunk_count, 8);
+    store_le(bytes + 32, header->checksum, 8);
+    store_le(bytes + 40, user_database_file_checksum(
+            USER_DATABASE_FILE_CHECKSUM_INIT, bytes, 40
+    ), 8);
+
+    if (fseek(file, 0, SEEK_SET) != 0) return -1;
+
+    return (fwrite(bytes, sizeof bytes, 1, file) == 1) ? 0 : -1;
+}
+
+uint64_t user_database_file_checksum(
+        uint64_t checksum,
+        const void *data,
+        size_t length
+) {
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < length; i++) {
+        checksum ^= bytes[i];
+        checksum *= 0x100000001b3ULL;
+    }
+    return checksum;
+}
+
+int user_database_file_copy(const char *from, const char *to) {
+
+    int in = open(from, O_RDONLY);
+    if (in < 0) return -1;
+
+    int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        close(in);
+        return -1;
+    }
+
+    int res = 0;
+
+    // Share the blocks of the file, or copy them without leaving the kernel
+    if (ioctl(out, FICLONE, in) < 0) {
+        ssize_t n;
+        while ((n = copy_file_range(in, NULL, out, NULL, 1 << 30, 0)) > 0);
+
+        if (n < 0) {
+            // Fall back to a plain copy, e.g. across file systems
+            char buffer[1 << 16];
+            res = (lseek(in, 0, SEEK_SET) < 0 || lseek(out, 0, SEEK_SET) < 0
+                   || ftruncate(out, 0) < 0) ? -1 : 0;
+            while (res == 0 && (n = read(in, buffer, sizeof buffer)) > 0) {
+                if (write(out, buffer, (size_t) n) != n) res = -1;
+            }
+            if (n < 0) res = -1;
+        }
+    }
+
+    close(in);
+    if (close(out) < 0) res = -1;
+
+    return res;
+}
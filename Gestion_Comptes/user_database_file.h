@@ -0,0 +1,115 @@
+#ifndef USER_DATABASE_FILE_H
+#define USER_DATABASE_FILE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Magic bytes opening a database file.
+ */
+#define USER_DATABASE_FILE_MAGIC "USERSDB"
+
+/**
+ * Version of the database file layout.
+ */
+#define USER_DATABASE_FILE_VERSION 1
+
+/**
+ * Size of the file header. Chunks start on the following page, so that they
+ * can be mapped and used in place.
+ */
+#define USER_DATABASE_FILE_HEADER_SIZE 4096
+
+/**
+ * Header of a database file. On disk, every integer is little-endian :
+ *
+ * <pre>
+ *   0  magic (8)            8  version (4)       12  chunk records (4)
+ *  16  record count (8)    24  chunk count (8)   32  data checksum (8)
+ *  40  header checksum (8)
+ * </pre>
+ *
+ * The header is followed by `chunk count` chunks of `chunk records` users, each
+ * laid out as the array of password hashes (8 bytes each), the array of flags
+ * (1 byte each) and the array of usernames (USER_DATABASE_FILE_USERNAME_SIZE
+ * bytes each).
+ */
+struct user_database_header {
+    uint32_t version;
+    uint32_t chunk_records;
+    uint64_t record_count;
+    uint64_t chunk_count;
+    uint64_t checksum;
+};
+
+/**
+ * Size of the username field of a file record.
+ */
+#define USER_DATABASE_FILE_USERNAME_SIZE 16
+
+/**
+ * Size of a chunk of a given number of records in the file.
+ */
+#define USER_DATABASE_FILE_CHUNK_SIZE(records) \
+    ((records) * (sizeof(uint64_t) + 1 + USER_DATABASE_FILE_USERNAME_SIZE))
+
+/**
+ * Maps a database file in memory. The mapping is private : pages modified
+ * through it are copied and never written back to the file.
+ *
+ * @param path path to the database file
+ * @param header the decoded file header
+ * @param chunks the address of the first chunk, NULL if the file has none
+ * @param length length of the mapping
+ *
+ * @return 0 on success, -1 if the file can't be mapped, lacks the magic
+ *         (errno is then set to ENOMSG), or has an invalid header, an
+ *         unknown version or a truncated data region (errno is then set
+ *         to EINVAL)
+ */
+extern int user_database_file_map(
+        const char *path,
+        struct user_database_header *header,
+        void **chunks,
+        size_t *length
+);
+
+/**
+ * Unmaps a database file mapped by user_database_file_map.
+ */
+extern void user_database_file_unmap(void *chunks, size_t length);
+
+/**
+ * Writes the header of a database file, at the start of the file.
+ *
+ * @return 0 on success, -1 on failure
+ */
+extern int user_database_file_write_header(
+        FILE *file,
+        const struct user_database_header *header
+);
+
+/**
+ * Updates a running data checksum (64-bit FNV-1a) with some bytes.
+ */
+extern uint64_t user_database_file_checksum(
+        uint64_t checksum,
+        const void *data,
+        size_t length
+);
+
+/**
+ * Initial value of a running data checksum.
+ */
+#define USER_DATABASE_FILE_CHECKSUM_INIT 0xcbf29ce484222325ULL
+
+/**
+ * Copies a file, sharing its blocks (reflink) when the file system allows it,
+ * and copying in the kernel otherwise.
+ *
+ * @return 0 on success, -1 on failure
+ */
+extern int user_database_file_copy(const char *from, const char *to);
+
+#endif
@@ -0,0 +1,334 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include "user_database_journal.h"
+#include "little_endian.h"
+
+/**
+ * Size of an encoded record : checksum (4), op (1), padding (3), id (8),
+ * hash (8), username. Integers are little-endian.
+ */
+#define RECORD_SIZE (24 + USER_JOURNAL_USERNAME_SIZE)
+
+static void *user_journal_sync(void *arg);
+
+static void user_journal_encode(
+        const struct user_journal_record *record,
+        uint8_t *bytes
+);
+
+static int user_journal_decode(
+        const uint8_t *bytes,
+        struct user_journal_record *record
+);
+
+static int journal_fd = -1;
+
+static const char *journal_path = NULL;
+
+static struct user_journal_policy journal_policy;
+
+static pthread_t journal_thread;
+
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Broadcast when the batch is full, when the journal is closing, and when a
+ * synchronization ends.
+ */
+static pthread_cond_t journal_cond;
+
+static int journal_running = 0;
+
+/** Whether the synchronization thread is using journal_fd outside the lock. */
+static int journal_syncing = 0;
+
+/** Number of appended records not yet synchronized. */
+static size_t journal_pending = 0;
+
+/** Time at which the oldest pending record was appended. */
+static struct timespec journal_pending_since;
+
+long user_journal_replay(
+        const char *path,
+        void (*apply)(const struct user_journal_record *record)
+) {
+    int fd = open(path, O_RDWR);
+    if (fd < 0) return (errno == ENOENT) ? 0 : -1;
+
+    FILE *journal = fdopen(fd, "rb");
+    if (journal == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    uint8_t bytes[RECORD_SIZE];
+    struct user_journal_record record;
+    long count = 0;
+
+    while (fread(bytes, RECORD_SIZE, 1, journal) == 1
+           && user_journal_decode(bytes, &record) == 0) {
+        apply(&record);
+        count++;
+    }
+
+    // Drop a record torn by a crash, so that appends follow the valid ones
+    if (ftruncate(fd, (off_t) count * RECORD_SIZE) < 0) count = -1;
+
+    fclose(journal);
+
+    return count;
+}
+
+int user_journal_open(const char *path, struct user_journal_policy policy) {
+
+    journal_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (journal_fd < 0) return -1;
+    journal_path = path;
+
+    journal_policy = policy;
+    if (journal_policy.batch == 0) journal_policy.batch = 1;
+    journal_pending = 0;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&journal_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    journal_running = 1;
+    if (pthread_create(&journal_thread, NULL, &user_journal_sync, NULL) != 0) {
+        journal_running = 0;
+        close(journal_fd);
+        journal_fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+int user_journal_append(const struct user_journal_record *record) {
+
+    uint8_t bytes[RECORD_SIZE];
+    user_journal_encode(record, bytes);
+
+    pthread_mutex_lock(&journal_lock);
+
+    if (journal_fd < 0
+        || write(journal_fd, bytes, RECORD_SIZE) != RECORD_SIZE) {
+        pthread_mutex_unlock(&journal_lock);
+        return -1;
+    }
+
+    if (journal_pending++ == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &journal_pending_since);
+    }
+    if (journal_pending >= journal_policy.batch) {
+        pthread_cond_broadcast(&journal_cond);
+    }
+
+    pthread_mutex_unlock(&journal_lock);
+
+    return 0;
+}
+
+/**
+ * Waits until the synchronization thread doesn't use the journal file, so that
+ * it can be replaced. The journal lock must be held.
+ */
+static void user_journal_wait_sync() {
+    while (journal_syncing) pthread_cond_wait(&journal_cond, &journal_lock);
+}
+
+/**
+ * Appends the content of a file to another one.
+ */
+static int user_journal_concat(int from, const char *to) {
+
+    int out = open(to, O_WRONLY | O_APPEND);
+    if (out < 0) return -1;
+
+    char buffer[1 << 16];
+    ssize_t n;
+    int res = 0;
+
+    while (res == 0 && (n = read(from, buffer, sizeof buffer)) != 0) {
+        if (n < 0 || write(out, buffer, (size_t) n) != n) res = -1;
+    }
+
+    if (fdatasync(out) < 0) res = -1;
+    close(out);
+
+    return res;
+}
+
+int user_journal_rotate(const char *old_path) {
+
+    pthread_mutex_lock(&journal_lock);
+    user_journal_wait_sync();
+
+    int res = -1;
+
+    if (journal_fd < 0 || fdatasync(journal_fd) < 0) {
+        // Nothing to rotate
+    } else if (access(old_path, F_OK) == 0) {
+        // A former snapshot failed, the old journal is still needed
+        int fd = open(journal_path, O_RDONLY);
+        if (fd >= 0 && user_journal_concat(fd, old_path) == 0
+            && ftruncate(journal_fd, 0) == 0) {
+            res = 0;
+        }
+        if (fd >= 0) close(fd);
+    } else if (rename(journal_path, old_path) == 0) {
+        int fd = open(journal_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd >= 0) {
+            close(journal_fd);
+            journal_fd = fd;
+            res = 0;
+        } else {
+            rename(old_path, journal_path);
+        }
+    }
+
+    if (res == 0) journal_pending = 0;
+
+    pthread_mutex_unlock(&journal_lock);
+
+    return res;
+}
+
+int user_journal_reset() {
+
+    pthread_mutex_lock(&journal_lock);
+    user_journal_wait_sync();
+
+    int res = 0;
+    if (journal_fd >= 0
+        && (ftruncate(journal_fd, 0) < 0 || fdatasync(journal_fd) < 0)) {
+        res = -1;
+    }
+    journal_pending = 0;
+
+    pthread_mutex_unlock(&journal_lock);
+
+    return res;
+}
+
+void user_journal_close() {
+
+    pthread_mutex_lock(&journal_lock);
+    int running = journal_running;
+    journal_running = 0;
+    pthread_cond_broadcast(&journal_cond);
+    pthread_mutex_unlock(&journal_lock);
+
+    if (running) {
+        pthread_join(journal_thread, NULL);
+        pthread_cond_destroy(&journal_cond);
+    }
+
+    if (journal_fd >= 0) {
+        fdatasync(journal_fd);
+        close(journal_fd);
+        journal_fd = -1;
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * Synchronization thread : waits for a full batch or for the oldest pending
+ * record to expire, then synchronizes the journal outside of the lock, so that
+ * appends carry on meanwhile.
+ */
+static void *user_journal_sync(void *arg) {
+
+    pthread_mutex_lock(&journal_lock);
+
+    while (journal_running) {
+
+        if (journal_pending == 0) {
+            pthread_cond_wait(&journal_cond, &journal_lock);
+            continue;
+        }
+
+        if (journal_pending < journal_policy.batch) {
+            struct timespec deadline = journal_pending_since;
+            deadline.tv_nsec += (long) journal_policy.delay * 1000;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000;
+            deadline.tv_nsec %= 1000000000;
+
+            if (pthread_cond_timedwait(
+                    &journal_cond, &journal_lock, &deadline
+            ) != ETIMEDOUT) {
+                continue;
+            }
+        }
+
+        size_t synced = journal_pending;
+        int fd = journal_fd;
+        journal_syncing = 1;
+
+        pthread_mutex_unlock(&journal_lock);
+        if (fdatasync(fd) < 0) perror("Synchronizing journal");
+        pthread_mutex_lock(&journal_lock);
+
+        journal_syncing = 0;
+        pthread_cond_broadcast(&journal_cond);
+
+        // Records appended during the synchronization stay pending
+        journal_pending = (journal_pending > synced)
+                          ? journal_pending - synced : 0;
+        if (journal_pending > 0) {
+            clock_gettime(CLOCK_MONOTONIC, &journal_pending_since);
+        }
+    }
+
+    pthread_mutex_unlock(&journal_lock);
+
+    return NULL;
+}
+
+/**
+ * Computes the checksum of an encoded record (32-bit FNV-1a of every byte
+ * following the checksum).
+ */
+static uint32_t user_journal_checksum(const uint8_t *bytes) {
+    uint32_t checksum = 0x811c9dc5U;
+    for (size_t i = 4; i < RECORD_SIZE; i++) {
+        checksum ^= bytes[i];
+        checksum *= 0x01000193U;
+    }
+    return checksum;
+}
+
+static void user_journal_encode(
+        const struct user_journal_record *record,
+        uint8_t *bytes
+) {
+    memset(bytes, 0, RECORD_SIZE);
+    bytes[4] = record->op;
+    store_le(bytes + 8, record->id, 8);
+    store_le(bytes + 16, record->hash, 8);
+    memcpy(bytes + 24, record->username, USER_JOURNAL_USERNAME_SIZE);
+    store_le(bytes, user_journal_checksum(bytes), 4);
+}
+
+static int user_journal_decode(
+        const uint8_t *bytes,
+        struct user_journal_record *record
+) {
+    if (load_le(bytes, 4) != user_journal_checksum(bytes)) return -1;
+
+    record->op = bytes[4];
+    record->id = load_le(bytes + 8, 8);
+    record->hash = load_le(bytes + 16, 8);
+    memcpy(record->username, bytes + 24, USER_JOURNAL_USERNAME_SIZE);
+
+    return 0;
+}
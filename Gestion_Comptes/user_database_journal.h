@@ -0,0 +1,109 @@
+#ifndef USER_DATABASE_JOURNAL_H
+#define USER_DATABASE_JOURNAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/** Journal record : an user was created. */
+#define USER_JOURNAL_CREATE 1
+
+/** Journal record : an user was deleted. */
+#define USER_JOURNAL_DELETE 2
+
+/** Journal record : an user's password was changed. */
+#define USER_JOURNAL_PASSWORD 3
+
+/**
+ * Size of the username field of a journal record.
+ */
+#define USER_JOURNAL_USERNAME_SIZE 16
+
+/**
+ * Default number of records after which the journal is synchronized.
+ */
+#define USER_JOURNAL_DEFAULT_BATCH 64
+
+/**
+ * Default delay, in microseconds, after which a pending record is synchronized.
+ */
+#define USER_JOURNAL_DEFAULT_DELAY 1000
+
+/**
+ * Mutation of the user database, as appended to the journal.
+ */
+struct user_journal_record {
+    uint8_t op;
+    uint64_t id;
+    uint64_t hash;
+    char username[USER_JOURNAL_USERNAME_SIZE];
+};
+
+/**
+ * Group commit policy of the journal. Appended records reach the kernel
+ * immediately, so they survive the process being killed; they are synchronized
+ * to the disk once `batch` records are pending or the oldest pending record has
+ * waited `delay` microseconds, whichever comes first.
+ */
+struct user_journal_policy {
+    size_t batch;
+    uint32_t delay;
+};
+
+/**
+ * Applies the records of a journal file, in order. A torn or corrupted record
+ * ends the replay, and the file is truncated before it.
+ *
+ * @param path path to the journal file
+ * @param apply function called for each valid record
+ *
+ * @return the number of records applied, or -1 if the file could not be read
+ */
+extern long user_journal_replay(
+        const char *path,
+        void (*apply)(const struct user_journal_record *record)
+);
+
+/**
+ * Opens a journal file for appending, and starts its synchronization thread.
+ *
+ * @return 0 on success, -1 on failure
+ */
+extern int user_journal_open(
+        const char *path,
+        struct user_journal_policy policy
+);
+
+/**
+ * Appends a record to the opened journal.
+ *
+ * @return 0 on success, -1 on failure
+ */
+extern int user_journal_append(const struct user_journal_record *record);
+
+/**
+ * Synchronizes the pending records and moves them to an old journal, so that
+ * appends start over in an empty journal. If the old journal still exists, the
+ * records are appended to it instead. To be called when taking a snapshot : the
+ * old journal can be removed once the snapshot is persisted.
+ *
+ * @param old_path path to the old journal
+ *
+ * @return 0 on success, -1 on failure
+ */
+extern int user_journal_rotate(const char *old_path);
+
+/**
+ * Synchronizes the pending records, then empties the journal. To be called once
+ * its records are all part of a persisted snapshot.
+ *
+ * @return 0 on success, -1 on failure
+ */
+extern int user_journal_reset();
+
+/**
+ * Synchronizes the pending records, stops the synchronization thread and
+ * closes the journal.
+ */
+extern void user_journal_close();
+
+#endif
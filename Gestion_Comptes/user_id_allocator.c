@@ -0,0 +1,113 @@
+#include <stdlib.h>
+#include <string.h>
+#include "user_id_allocator.h"
+
+#define WORD_BITS 64
+
+/** Number of words needed to hold a given number of bits. */
+#define WORDS(bits) (((bits) + WORD_BITS - 1) / WORD_BITS)
+
+void user_id_allocator_init(struct user_id_allocator *allocator) {
+    memset(allocator, 0, sizeof *allocator);
+}
+
+void user_id_allocator_free(struct user_id_allocator *allocator) {
+    for (size_t l = 0; l < USER_ID_ALLOCATOR_LEVELS; l++) {
+        free(allocator->levels[l]);
+    }
+    user_id_allocator_init(allocator);
+}
+
+int user_id_allocator_grow(
+        struct user_id_allocator *allocator,
+        size_t capacity
+) {
+    if (capacity <= allocator->capacity) return 0;
+
+    // Reallocate every level which needs more words, up to a single word
+    size_t bits = capacity, old_bits = allocator->capacity, depth = 0;
+    do {
+        size_t words = WORDS(bits);
+        size_t old_words = (depth < allocator->depth) ? WORDS(old_bits) : 0;
+
+        if (words > old_words) {
+            uint64_t *level = realloc(
+                    allocator->levels[depth],
+                    words * sizeof *level
+            );
+            if (level == NULL) return -1;
+            memset(level + old_words, 0, (words - old_words) * sizeof *level);
+            allocator->levels[depth] = level;
+        }
+
+        // A new summary level starts from the state of the level below
+        if (depth >= allocator->depth && depth > 0) {
+            uint64_t *below = allocator->levels[depth - 1];
+            for (size_t i = 0; i < bits; i++) {
+                if (below[i] != 0) {
+                    allocator->levels[depth][i / WORD_BITS] |=
+                            1ULL << (i % WORD_BITS);
+                }
+            }
+        }
+
+        bits = words;
+        old_bits = old_words;
+        depth++;
+    } while (bits > 1 && depth < USER_ID_ALLOCATOR_LEVELS);
+
+    if (bits > 1) return -1;
+
+    size_t first = allocator->capacity;
+    allocator->capacity = capacity;
+    allocator->depth = depth;
+
+    for (size_t id = first; id < capacity; id++) {
+        user_id_allocator_release(allocator, id);
+    }
+
+    return 0;
+}
+
+size_t user_id_allocator_acquire(struct user_id_allocator *allocator) {
+
+    if (allocator->depth == 0) return USER_ID_ALLOCATOR_FULL;
+
+    size_t index = 0;
+    for (size_t l = allocator->depth; l-- > 0;) {
+        uint64_t word = allocator->levels[l][index];
+        if (word == 0) return USER_ID_ALLOCATOR_FULL;
+        index = index * WORD_BITS + (size_t) __builtin_ctzll(word);
+    }
+
+    user_id_allocator_claim(allocator, index);
+
+    return index;
+}
+
+void user_id_allocator_claim(struct user_id_allocator *allocator, size_t id) {
+
+    if (id >= allocator->capacity) return;
+
+    // Clear the bit, and its summary bits while the words become empty
+    for (size_t l = 0; l < allocator->depth; l++) {
+        uint64_t *word = &allocator->levels[l][id / WORD_BITS];
+        *word &= ~(1ULL << (id % WORD_BITS));
+        if (*word != 0) break;
+        id /= WORD_BITS;
+    }
+}
+
+void user_id_allocator_release(struct user_id_allocator *allocator, size_t id) {
+
+    if (id >= allocator->capacity) return;
+
+    // Set the bit, and its summary bits while the words were empty
+    for (size_t l = 0; l < allocator->depth; l++) {
+        uint64_t *word = &allocator->levels[l][id / WORD_BITS];
+        uint64_t was_empty = (*word == 0);
+        *word |= 1ULL << (id % WORD_BITS);
+        if (!was_empty) break;
+        id /= WORD_BITS;
+    }
+}
@@ -0,0 +1,76 @@
+#ifndef USER_ID_ALLOCATOR_H
+#define USER_ID_ALLOCATOR_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Maximum depth of the bitmap hierarchy. Each level covers 64 times as many
+ * ids as the one above it, so 6 levels address 2^36 ids.
+ */
+#define USER_ID_ALLOCATOR_LEVELS 6
+
+/**
+ * Returned by user_id_allocator_acquire when every id is in use.
+ */
+#define USER_ID_ALLOCATOR_FULL SIZE_MAX
+
+/**
+ * Hierarchical bitmap of free ids.
+ *
+ * A set bit in level 0 marks a free id. A set bit in level n marks a word of
+ * level n-1 holding at least one free id. The top level is a single word, so
+ * finding the lowest free id costs one count-trailing-zeros per level.
+ */
+struct user_id_allocator {
+    uint64_t *levels[USER_ID_ALLOCATOR_LEVELS];
+    size_t depth;
+    size_t capacity;
+};
+
+/**
+ * Initializes an empty allocator, with no id available.
+ */
+extern void user_id_allocator_init(struct user_id_allocator *allocator);
+
+/**
+ * Releases the memory held by an allocator.
+ */
+extern void user_id_allocator_free(struct user_id_allocator *allocator);
+
+/**
+ * Extends the range of ids managed by an allocator. The new ids are free.
+ *
+ * @param capacity new number of ids, a multiple of 64
+ *
+ * @return 0 on success, -1 if memory could not be allocated
+ */
+extern int user_id_allocator_grow(
+        struct user_id_allocator *allocator,
+        size_t capacity
+);
+
+/**
+ * Takes the lowest free id.
+ *
+ * @return the id, or USER_ID_ALLOCATOR_FULL if none is free
+ */
+extern size_t user_id_allocator_acquire(struct user_id_allocator *allocator);
+
+/**
+ * Marks a given id as in use, whether it was free or not.
+ */
+extern void user_id_allocator_claim(
+        struct user_id_allocator *allocator,
+        size_t id
+);
+
+/**
+ * Marks a given id as free.
+ */
+extern void user_id_allocator_release(
+        struct user_id_allocator *allocator,
+        size_t id
+);
+
+#endif
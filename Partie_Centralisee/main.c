@@ -9,11 +9,126 @@
 #endif
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <pthread.h>
+#include <getopt.h>
 #include "user_database_handler.h"
 #include "server_handler.h"
+#include "server_log.h"
+#include "server_metrics.h"
+#include "message_channel.h"
 
-int main() {
+int main(int argc, char *argv[]) {
+
+    int log_level = SERVER_LOG_INFO;
+    const char *metrics_path = NULL;
+    struct server_options options = {
+            .backlog = SERVER_BACKLOG,
+            .reactors = SERVER_REACTORS,
+            .workers = 0,
+            .high_watermark = SERVER_HIGH_WATERMARK,
+            .low_watermark = SERVER_LOW_WATERMARK,
+            .policy = SERVER_POLICY_DROP,
+            .memory_limit = SERVER_MEMORY_LIMIT,
+            .channel = 0,
+            .history = NULL
+    };
+
+    int opt;
+    char *end;
+    while ((opt = getopt(argc, argv, "q:r:w:s:p:c:x:d:l:m:h")) != -1) {
+        switch (opt) {
+            case 'q':
+                options.backlog = atoi(optarg);
+                break;
+            case 'r':
+                options.reactors = strtoul(optarg, NULL, 10);
+                break;
+            case 'w':
+                options.workers = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                options.high_watermark = strtoul(optarg, &end, 10) * 1024;
+                options.low_watermark = options.high_watermark / 4;
+                if (*end == ':') {
+                    options.low_watermark = strtoul(end + 1, &end, 10) * 1024;
+                }
+                if (*end != '\0'
+                    || options.low_watermark >= options.high_watermark) {
+                    goto usage;
+                }
+                break;
+            case 'p':
+                options.policy = server_policy_parse(optarg);
+                if (options.policy < 0) goto usage;
+                break;
+            case 'c':
+                options.memory_limit = strtoul(optarg, NULL, 10) * 1024 * 1024;
+                break;
+            case 'x':
+                options.channel = message_channel_parse(optarg);
+                if (options.channel < 0) goto usage;
+                break;
+            case 'd':
+                options.history = optarg;
+                break;
+            case 'm':
+                metrics_path = optarg;
+                break;
+            case 'l':
+                log_level = server_log_parse_level(optarg);
+                if (log_level >= 0) break;
+                // Fall through
+            default:
+            usage:
+                printf(
+                        "Usage: %s [-q backlog] [-r reactors] [-w workers]"
+                        " [-s high[:low]] [-p policy] [-c limit]"
+                        " [-x channel] [-d directory] [-l level] [-m file]\n"
+                        "  -q  length of the queue of connections waiting"
+                        " to be accepted (default %d)\n"
+                        "  -r  number of threads serving the connections"
+                        " (default %d)\n"
+                        "  -w  number of threads running the commands"
+                        " (default one per core)\n"
+                        "  -s  kilobytes waiting to be sent to a client past"
+                        " which the policy applies, and below which it is"
+                        " read again (default %d:%d)\n"
+                        "  -p  policy for clients reading too slowly : drop"
+                        " their oldest messages, disconnect them, or pause"
+                        " reading them (default drop)\n"
+                        "  -c  megabytes the messages waiting to be sent may"
+                        " use (default %d)\n"
+                        "  -x  publishes the messages sent to the display"
+                        " process : ring or mq (default none)\n"
+                        "  -d  directory the messages sent are kept in, to"
+                        " be replayed (default none)\n"
+                        "  -l  log level : error, warn, info or debug"
+                        " (default info)\n"
+                        "  -m  file the metrics are written to every %d"
+                        " seconds\n",
+                        argv[0],
+                        SERVER_BACKLOG,
+                        SERVER_REACTORS,
+                        SERVER_HIGH_WATERMARK / 1024,
+                        SERVER_LOW_WATERMARK / 1024,
+                        SERVER_MEMORY_LIMIT / 1024 / 1024,
+                        SERVER_METRICS_INTERVAL
+                );
+                exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+
+    if (server_log_open(log_level, stdout) < 0) {
+        fprintf(stderr, "Failed to start the log writer\n");
+    }
+
+    if (metrics_path != NULL && server_metrics_dump_start(
+            metrics_path,
+            SERVER_METRICS_INTERVAL
+    ) < 0) {
+        fprintf(stderr, "Failed to start the metrics writer\n");
+    }
 
 #ifdef WIN32
     WSADATA wsa;
@@ -33,14 +148,14 @@ int main() {
             &server_thread,
             NULL,
             &server_handler,
-            NULL
+            &options
     );
 
-
-    // TODO Create thread or fork for sending messages process
-
+    // The messages sent by clients are pushed by the server reactors
     pthread_join(server_thread, NULL);
     user_database_close();
+    server_metrics_dump_stop();
+    server_log_close();
 
 #ifdef WIN32
     if (WSACleanup() != 0) {
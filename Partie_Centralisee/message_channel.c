@@ -0,0 +1,506 @@
+#ifdef WIN32
+
+#elif defined(linux)
+
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <mqueue.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+
+#else
+
+#error platform unsupported
+
+#endif
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include "message_channel.h"
+
+#ifdef WIN32
+
+int message_channel_parse(const char *name) {
+    (void) name;
+    return -1;
+}
+
+struct message_channel *message_channel_create(int backend) {
+    (void) backend;
+    return NULL;
+}
+
+struct message_channel *message_channel_open(int backend) {
+    (void) backend;
+    return NULL;
+}
+
+int message_channel_publish(
+        struct message_channel *channel,
+        const char *data,
+        size_t length
+) {
+    (void) channel, (void) data, (void) length;
+    return -1;
+}
+
+int message_channel_receive(
+        struct message_channel *channel,
+        struct message_channel_batch *batch,
+        int timeout
+) {
+    (void) channel, (void) batch, (void) timeout;
+    return -1;
+}
+
+uint64_t message_channel_lost(const struct message_channel *channel) {
+    (void) channel;
+    return 0;
+}
+
+void message_channel_close(struct message_channel *channel) {
+    (void) channel;
+}
+
+#elif defined(linux)
+
+/**
+ * Marks a ring laid out as this code expects.
+ */
+#define RING_MAGIC 0x52494E47
+
+/**
+ * Message of the ring. Its sequence is written last, and checked again once
+ * the message is read : a message changed meanwhile was overwritten.
+ */
+struct slot {
+    _Atomic uint64_t sequence; // Sequence number plus one, 0 while written
+    uint32_t length;
+    char data[MESSAGE_CHANNEL_MESSAGE_SIZE];
+};
+
+/**
+ * Ring in shared memory. The publisher writes the next slot and moves the
+ * head. Each reader follows the head with its own cursor, so the publisher
+ * never waits for readers.
+ */
+struct ring {
+    _Atomic uint32_t magic;
+    uint32_t slots;
+    _Atomic uint64_t head; // Sequence number of the next message
+    _Atomic uint32_t signal; // Futex the readers sleep on
+    _Atomic uint32_t waiters; // Readers sleeping, or about to
+    struct slot slot[];
+};
+
+struct message_channel {
+    int backend;
+    pthread_mutex_t lock; // Serializes the publishing threads
+    struct ring *ring;
+    uint64_t cursor; // Sequence number of the next message read
+    _Atomic uint64_t lost;
+    mqd_t queue;
+};
+
+/**
+ * Allocates a channel, without opening it.
+ */
+static struct message_channel *channel_new(int backend);
+
+/**
+ * Maps the ring in shared memory.
+ *
+ * @param create whether it is created if missing
+ *
+ * @return the ring, or NULL on failure
+ */
+static struct ring *map_ring(int create);
+
+/**
+ * Copies the messages of the ring not yet read, up to a batch, without
+ * waiting.
+ *
+ * @return the number of messages read
+ */
+static int read_ring(
+        struct message_channel *channel,
+        struct message_channel_batch *batch
+);
+
+/**
+ * Waits for the ring to move past the cursor of a reader.
+ *
+ * @param timeout milliseconds to wait at most, -1 to wait forever
+ *
+ * @return whether the reader slept
+ */
+static int wait_ring(struct message_channel *channel, int timeout);
+
+/**
+ * Receives the messages of the message queue, waiting for the first.
+ *
+ * @param timeout milliseconds to wait at most, -1 to wait forever
+ *
+ * @return the number of messages received, -1 on failure
+ */
+static int receive_queue(
+        struct message_channel *channel,
+        struct message_channel_batch *batch,
+        int timeout
+);
+
+int message_channel_parse(const char *name) {
+
+    if (strcmp(name, "ring") == 0) return MESSAGE_CHANNEL_RING;
+    if (strcmp(name, "mq") == 0) return MESSAGE_CHANNEL_MQUEUE;
+    return -1;
+}
+
+struct message_channel *message_channel_create(int backend) {
+
+    struct message_channel *channel = channel_new(backend);
+    if (channel == NULL) return NULL;
+
+    if (backend == MESSAGE_CHANNEL_RING) {
+        channel->ring = map_ring(1);
+        if (channel->ring != NULL) return channel;
+    } else {
+        struct mq_attr attributes = {
+                .mq_maxmsg = MESSAGE_CHANNEL_QUEUE_DEPTH,
+                .mq_msgsize = MESSAGE_CHANNEL_MESSAGE_SIZE
+        };
+        channel->queue = mq_open(
+                MESSAGE_CHANNEL_NAME,
+                O_CREAT | O_WRONLY | O_NONBLOCK | O_CLOEXEC,
+                0600,
+                &attributes
+        );
+        if (channel->queue != (mqd_t) -1) return channel;
+    }
+
+    message_channel_close(channel);
+    return NULL;
+}
+
+struct message_channel *message_channel_open(int backend) {
+
+    struct message_channel *channel = channel_new(backend);
+    if (channel == NULL) return NULL;
+
+    if (backend == MESSAGE_CHANNEL_RING) {
+        channel->ring = map_ring(0);
+        if (channel->ring != NULL) {
+            channel->cursor = atomic_load(&channel->ring->head);
+            return channel;
+        }
+    } else {
+        channel->queue = mq_open(
+                MESSAGE_CHANNEL_NAME,
+                O_RDONLY | O_CLOEXEC
+        );
+
+        // Larger messages would not fit in a batch
+        struct mq_attr attributes;
+        if (channel->queue != (mqd_t) -1
+            && mq_getattr(channel->queue, &attributes) == 0
+            && attributes.mq_msgsize <= MESSAGE_CHANNEL_MESSAGE_SIZE) {
+            return channel;
+        }
+    }
+
+    message_channel_close(channel);
+    return NULL;
+}
+
+int message_channel_publish(
+        struct message_channel *channel,
+        const char *data,
+        size_t length
+) {
+    if (length > MESSAGE_CHANNEL_MESSAGE_SIZE) {
+        length = MESSAGE_CHANNEL_MESSAGE_SIZE;
+    }
+
+    if (channel->backend == MESSAGE_CHANNEL_MQUEUE) {
+        if (mq_send(channel->queue, data, length, 0) < 0) {
+            atomic_fetch_add(&channel->lost, 1);
+            return -1;
+        }
+        return 0;
+    }
+
+    struct ring *ring = channel->ring;
+
+    pthread_mutex_lock(&channel->lock);
+
+    uint64_t sequence = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    struct slot *slot = &ring->slot[sequence % ring->slots];
+
+    // Readers of the former message see it changed
+    atomic_store_explicit(&slot->sequence, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->length = (uint32_t) length;
+    memcpy(slot->data, data, length);
+    atomic_store_explicit(&slot->sequence, sequence + 1, memory_order_release);
+
+    atomic_store(&ring->head, sequence + 1);
+
+    pthread_mutex_unlock(&channel->lock);
+
+    // A system call only if a reader sleeps : a reader going to sleep checks
+    // the head after announcing itself
+    if (atomic_load(&ring->waiters) > 0) {
+        atomic_fetch_add(&ring->signal, 1);
+        syscall(
+                SYS_futex,
+                &ring->signal, FUTEX_WAKE,
+                INT_MAX,
+                NULL, NULL, 0
+        );
+    }
+
+    return 0;
+}
+
+int message_channel_receive(
+        struct message_channel *channel,
+        struct message_channel_batch *batch,
+        int timeout
+) {
+    if (channel->backend == MESSAGE_CHANNEL_MQUEUE) {
+        return receive_queue(channel, batch, timeout);
+    }
+
+    while (1) {
+        int count = read_ring(channel, batch);
+        if (count > 0 || timeout == 0) return count;
+
+        int slept = wait_ring(channel, timeout);
+
+        count = read_ring(channel, batch);
+        if (count > 0 || (slept && timeout > 0)) return count;
+    }
+}
+
+uint64_t message_channel_lost(const struct message_channel *channel) {
+    return atomic_load(&channel->lost);
+}
+
+void message_channel_close(struct message_channel *channel) {
+
+    if (channel->ring != NULL) {
+        munmap(
+                channel->ring,
+                sizeof *channel->ring
+                + MESSAGE_CHANNEL_SLOTS * sizeof *channel->ring->slot
+        );
+    }
+    if (channel->queue != (mqd_t) -1) mq_close(channel->queue);
+
+    pthread_mutex_destroy(&channel->lock);
+    free(channel);
+}
+
+/* -------------------------------------------------------------------------- */
+
+struct message_channel *channel_new(int backend) {
+
+    if (backend != MESSAGE_CHANNEL_RING && backend != MESSAGE_CHANNEL_MQUEUE) {
+        return NULL;
+    }
+
+    struct message_channel *channel = calloc(1, sizeof *channel);
+    if (channel == NULL) return NULL;
+
+    channel->backend = backend;
+    channel->queue = (mqd_t) -1;
+    pthread_mutex_init(&channel->lock, NULL);
+    return channel;
+}
+
+struct ring *map_ring(int create) {
+
+    size_t size = sizeof(struct ring)
+                  + MESSAGE_CHANNEL_SLOTS * sizeof(struct slot);
+
+    int fd = shm_open(
+            MESSAGE_CHANNEL_NAME,
+            (create ? O_CREAT : 0) | O_RDWR | O_CLOEXEC,
+            0600
+    );
+    if (fd < 0) return NULL;
+
+    struct stat status;
+    if (fstat(fd, &status) < 0
+        || (create && (size_t) status.st_size < size && ftruncate(
+                fd,
+                (off_t) size
+        ) < 0)
+        || (!create && (size_t) status.st_size < size)) {
+        close(fd);
+        return NULL;
+    }
+
+    struct ring *ring = mmap(
+            NULL, size,
+            PROT_READ | PROT_WRITE, MAP_SHARED,
+            fd, 0
+    );
+    close(fd);
+    if (ring == MAP_FAILED) return NULL;
+
+    if (atomic_load(&ring->magic) == RING_MAGIC
+        && ring->slots == MESSAGE_CHANNEL_SLOTS) {
+        return ring;
+    }
+
+    // A new ring is zeroed by the system, only its layout is written
+    if (create) {
+        ring->slots = MESSAGE_CHANNEL_SLOTS;
+        atomic_store(&ring->magic, RING_MAGIC);
+        return ring;
+    }
+
+    munmap(ring, size);
+    return NULL;
+}
+
+int read_ring(
+        struct message_channel *channel,
+        struct message_channel_batch *batch
+) {
+    struct ring *ring = channel->ring;
+    int count = 0;
+
+    while (count < MESSAGE_CHANNEL_BATCH) {
+        uint64_t head = atomic_load(&ring->head);
+        if (channel->cursor == head) break;
+
+        // Skips the messages overwritten
+        if (head - channel->cursor > ring->slots) {
+            atomic_fetch_add(
+                    &channel->lost,
+                    head - ring->slots - channel->cursor
+            );
+            channel->cursor = head - ring->slots;
+        }
+
+        struct slot *slot = &ring->slot[channel->cursor % ring->slots];
+        uint64_t sequence = atomic_load_explicit(
+                &slot->sequence,
+                memory_order_acquire
+        );
+
+        if (sequence == channel->cursor + 1) {
+            size_t length = slot->length;
+            if (length > MESSAGE_CHANNEL_MESSAGE_SIZE) {
+                length = MESSAGE_CHANNEL_MESSAGE_SIZE;
+            }
+            memcpy(batch->data[count], slot->data, length);
+            atomic_thread_fence(memory_order_acquire);
+
+            if (atomic_load_explicit(
+                    &slot->sequence,
+                    memory_order_relaxed
+            ) == sequence) {
+                batch->lengths[count++] = length;
+                channel->cursor++;
+                continue;
+            }
+        }
+
+        // Overwritten while read
+        atomic_fetch_add(&channel->lost, 1);
+        channel->cursor++;
+    }
+
+    batch->count = (size_t) count;
+    return count;
+}
+
+int wait_ring(struct message_channel *channel, int timeout) {
+
+    struct ring *ring = channel->ring;
+    int slept = 0;
+
+    uint32_t signal = atomic_load(&ring->signal);
+    atomic_fetch_add(&ring->waiters, 1);
+
+    if (atomic_load(&ring->head) == channel->cursor) {
+        struct timespec delay = {
+                .tv_sec = timeout / 1000,
+                .tv_nsec = (long) (timeout % 1000) * 1000000
+        };
+        syscall(
+                SYS_futex,
+                &ring->signal, FUTEX_WAIT,
+                signal,
+                (timeout >= 0) ? &delay : NULL,
+                NULL, 0
+        );
+        slept = 1;
+    }
+
+    atomic_fetch_sub(&ring->waiters, 1);
+    return slept;
+}
+
+int receive_queue(
+        struct message_channel *channel,
+        struct message_channel_batch *batch,
+        int timeout
+) {
+    struct timespec deadline = {0};
+    if (timeout > 0) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout / 1000;
+        deadline.tv_nsec += (long) (timeout % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+
+    int count = 0;
+
+    // Waits for the first message, then takes those already waiting
+    while (count < MESSAGE_CHANNEL_BATCH) {
+        ssize_t length;
+        if (count == 0 && timeout < 0) {
+            length = mq_receive(
+                    channel->queue,
+                    batch->data[count], MESSAGE_CHANNEL_MESSAGE_SIZE,
+                    NULL
+            );
+        } else {
+            length = mq_timedreceive(
+                    channel->queue,
+                    batch->data[count], MESSAGE_CHANNEL_MESSAGE_SIZE,
+                    NULL,
+                    &deadline
+            );
+        }
+
+        if (length < 0) {
+            if (errno == ETIMEDOUT || errno == EINTR) break;
+            if (count == 0) return -1;
+            break;
+        }
+
+        batch->lengths[count++] = (size_t) length;
+        deadline = (struct timespec) {0};
+    }
+
+    batch->count = (size_t) count;
+    return count;
+}
+
+#endif
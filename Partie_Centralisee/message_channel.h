@@ -0,0 +1,130 @@
+#ifndef MESSAGE_CHANNEL_H
+#define MESSAGE_CHANNEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Name of the shared memory object, or of the message queue, the messages
+ * are published to.
+ */
+#define MESSAGE_CHANNEL_NAME "/progsysres_messages"
+
+/**
+ * Number of messages the ring holds : a reader falling further behind loses
+ * the oldest.
+ */
+#define MESSAGE_CHANNEL_SLOTS 4096
+
+/**
+ * Longest message published.
+ */
+#define MESSAGE_CHANNEL_MESSAGE_SIZE 1088
+
+/**
+ * Number of messages the message queue holds, within the default limit of
+ * the system.
+ */
+#define MESSAGE_CHANNEL_QUEUE_DEPTH 10
+
+/**
+ * Largest number of messages received at once.
+ */
+#define MESSAGE_CHANNEL_BATCH 64
+
+/**
+ * Ring in shared memory, written by a single process and read by any number
+ * of processes, each reading every message. Readers sleep on a futex, woken
+ * only when some are waiting.
+ */
+#define MESSAGE_CHANNEL_RING 1
+
+/**
+ * POSIX message queue, each message being read by a single reader. Messages
+ * published while it is full are lost.
+ */
+#define MESSAGE_CHANNEL_MQUEUE 2
+
+/**
+ * Messages published by the central server, for the processes displaying or
+ * sending them.
+ */
+struct message_channel;
+
+/**
+ * Messages received at once.
+ */
+struct message_channel_batch {
+    size_t count;
+    size_t lengths[MESSAGE_CHANNEL_BATCH];
+    char data[MESSAGE_CHANNEL_BATCH][MESSAGE_CHANNEL_MESSAGE_SIZE];
+};
+
+/**
+ * Parses the name of a backend : ring or mq.
+ *
+ * @return the backend, or -1 if unknown
+ */
+extern int message_channel_parse(const char *name);
+
+/**
+ * Creates the channel messages are published to, or reuses it. Its messages
+ * are kept if the publisher is restarted.
+ *
+ * @param backend MESSAGE_CHANNEL_RING or MESSAGE_CHANNEL_MQUEUE
+ *
+ * @return the channel, or NULL on failure
+ */
+extern struct message_channel *message_channel_create(int backend);
+
+/**
+ * Opens the channel created by the publisher, to read the messages published
+ * from now on.
+ *
+ * @param backend MESSAGE_CHANNEL_RING or MESSAGE_CHANNEL_MQUEUE
+ *
+ * @return the channel, or NULL on failure
+ */
+extern struct message_channel *message_channel_open(int backend);
+
+/**
+ * Publishes a message, never waiting for readers. Safe to call from several
+ * threads.
+ *
+ * @param length at most MESSAGE_CHANNEL_MESSAGE_SIZE bytes, longer messages
+ *               being truncated
+ *
+ * @return 0 on success, -1 if the message was lost
+ */
+extern int message_channel_publish(
+        struct message_channel *channel,
+        const char *data,
+        size_t length
+);
+
+/**
+ * Receives the messages published, as many as are waiting up to a batch.
+ * Waits for one if none are.
+ *
+ * @param timeout milliseconds to wait at most, -1 to wait forever
+ *
+ * @return the number of messages received, 0 on timeout, -1 on failure
+ */
+extern int message_channel_receive(
+        struct message_channel *channel,
+        struct message_channel_batch *batch,
+        int timeout
+);
+
+/**
+ * Tells how many messages were lost : by a reader too slow for the ring, or
+ * by a publisher finding the message queue full.
+ */
+extern uint64_t message_channel_lost(const struct message_channel *channel);
+
+/**
+ * Closes a channel, leaving it to the other processes.
+ */
+extern void message_channel_close(struct message_channel *channel);
+
+#endif
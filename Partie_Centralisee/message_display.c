@@ -0,0 +1,79 @@
+#define _GNU_SOURCE
+#include <sys/uio.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "message_channel.h"
+
+/**
+ * Displays the messages sent by the clients of the central server, as it
+ * publishes them. Each batch received is written at once.
+ */
+int main(int argc, char *argv[]) {
+
+    int backend = MESSAGE_CHANNEL_RING;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "x:h")) != -1) {
+        switch (opt) {
+            case 'x':
+                backend = message_channel_parse(optarg);
+                if (backend >= 0) break;
+                // Fall through
+            default:
+                printf(
+                        "Usage: %s [-x channel]\n"
+                        "  -x  channel the central server publishes to :"
+                        " ring or mq (default ring)\n",
+                        argv[0]
+                );
+                exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+
+    struct message_channel *channel = message_channel_open(backend);
+    if (channel == NULL) {
+        perror("Opening message channel, is the central server running");
+        return EXIT_FAILURE;
+    }
+
+    struct message_channel_batch *batch = malloc(sizeof *batch);
+    if (batch == NULL) {
+        fprintf(stderr, "Failed to allocate message batch\n");
+        return EXIT_FAILURE;
+    }
+
+    uint64_t lost = 0;
+    struct iovec lines[MESSAGE_CHANNEL_BATCH];
+
+    while (1) {
+        int count = message_channel_receive(channel, batch, -1);
+        if (count < 0) {
+            perror("Receiving messages");
+            break;
+        }
+
+        if (message_channel_lost(channel) != lost) {
+            fprintf(
+                    stderr,
+                    "%llu messages lost\n",
+                    (unsigned long long) (message_channel_lost(channel) - lost)
+            );
+            lost = message_channel_lost(channel);
+        }
+
+        for (int i = 0; i < count; i++) {
+            lines[i].iov_base = batch->data[i];
+            lines[i].iov_len = batch->lengths[i];
+        }
+        if (count > 0 && writev(STDOUT_FILENO, lines, count) < 0) {
+            perror("Displaying messages");
+            break;
+        }
+    }
+
+    free(batch);
+    message_channel_close(channel);
+    return EXIT_FAILURE;
+}
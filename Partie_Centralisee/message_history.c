@@ -0,0 +1,644 @@
+#ifdef WIN32
+
+#elif defined(linux)
+
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#else
+
+#error platform unsupported
+
+#endif
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "message_history.h"
+
+#ifdef WIN32
+
+struct message_history *message_history_open(const char *directory) {
+    (void) directory;
+    return NULL;
+}
+
+uint64_t message_history_next(struct message_history *history) {
+    (void) history;
+    return 0;
+}
+
+uint64_t message_history_append(
+        struct message_history *history,
+        const char *data,
+        size_t length
+) {
+    (void) history, (void) data, (void) length;
+    return 0;
+}
+
+size_t message_history_replay(
+        struct message_history *history,
+        uint64_t from,
+        uint64_t to,
+        struct message_history_span *spans,
+        size_t size
+) {
+    (void) history, (void) from, (void) to, (void) spans, (void) size;
+    return 0;
+}
+
+size_t message_history_render(
+        struct message_history *history,
+        char *buffer,
+        size_t size
+) {
+    (void) history, (void) buffer, (void) size;
+    return 0;
+}
+
+void message_history_close(struct message_history *history) {
+    (void) history;
+}
+
+#elif defined(linux)
+
+/**
+ * Number of entries of an index, enough for a full segment.
+ */
+#define INDEX_ENTRIES \
+    (MESSAGE_HISTORY_SEGMENT_SIZE / MESSAGE_HISTORY_INDEX_INTERVAL + 1)
+
+/**
+ * Size of the chunks the segments are read by when looking for a message.
+ */
+#define SCAN_SIZE 65536
+
+/**
+ * Place of a message in its segment. Unused entries are zeroed.
+ */
+struct entry {
+    uint64_t sequence;
+    int64_t time;
+    uint64_t offset;
+};
+
+/**
+ * Segment file, named after the number of its first message, with its index
+ * mapped from the file of the same name.
+ */
+struct segment {
+    uint64_t first;
+    int fd;
+    size_t size;
+    time_t created; // Time of its first message
+    time_t modified; // Time of its last message
+    size_t entries;
+    struct entry *index; // INDEX_ENTRIES entries
+};
+
+struct message_history {
+    pthread_mutex_t lock;
+    char *directory;
+    size_t count;
+    struct segment *segments; // Oldest first, appended to the last
+    uint64_t next; // Number of the next message
+};
+
+/**
+ * Opens the segment file of a first message, and maps its index.
+ *
+ * @param create whether the files are created if missing
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int open_segment(
+        struct message_history *history,
+        struct segment *segment,
+        uint64_t first,
+        int create
+);
+
+/**
+ * Rebuilds the index of a segment from its messages, dropping a trailing
+ * partial message.
+ *
+ * @return the number of messages of the segment, or -1 on failure
+ */
+static long long scan_segment(struct segment *segment);
+
+/**
+ * Closes a segment, and removes its files if asked.
+ */
+static void close_segment(
+        struct message_history *history,
+        struct segment *segment,
+        int remove
+);
+
+/**
+ * Starts a new segment, its first message being the next one.
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int roll(struct message_history *history);
+
+/**
+ * Removes the oldest segments while the segments are too large, or too old.
+ * The last segment is kept.
+ */
+static void retain(struct message_history *history);
+
+/**
+ * Finds the offset of a message of a segment, reading forward from the
+ * closest message of its index.
+ */
+static off_t locate(const struct segment *segment, uint64_t sequence);
+
+/**
+ * Writes the path of a file of a segment.
+ *
+ * @param extension "log" for the messages, "index" for the index
+ */
+static void segment_path(
+        const struct message_history *history,
+        uint64_t first,
+        const char *extension,
+        char *path,
+        size_t size
+);
+
+/**
+ * Orders the numbers of first messages.
+ */
+static int compare_first(const void *a, const void *b);
+
+struct message_history *message_history_open(const char *directory) {
+
+    if (mkdir(directory, 0755) < 0 && errno != EEXIST) return NULL;
+
+    DIR *listing = opendir(directory);
+    if (listing == NULL) return NULL;
+
+    struct message_history *history = calloc(1, sizeof *history);
+    uint64_t *firsts = NULL;
+    size_t count = 0;
+
+    if (history == NULL || (history->directory = strdup(directory)) == NULL) {
+        free(history);
+        closedir(listing);
+        return NULL;
+    }
+    pthread_mutex_init(&history->lock, NULL);
+
+    struct dirent *file;
+    while ((file = readdir(listing)) != NULL) {
+        unsigned long long first;
+        char extension[8];
+        if (strlen(file->d_name) != 24
+            || sscanf(file->d_name, "%20llu.%3s", &first, extension) != 2
+            || strcmp(extension, "log") != 0
+            || first == 0) {
+            continue;
+        }
+
+        uint64_t *grown = realloc(firsts, (count + 1) * sizeof *firsts);
+        if (grown == NULL) break;
+        firsts = grown;
+        firsts[count++] = first;
+    }
+    closedir(listing);
+
+    if (count > 1) qsort(firsts, count, sizeof *firsts, &compare_first);
+
+    history->segments = calloc(count + 1, sizeof *history->segments);
+    if (history->segments == NULL) {
+        free(firsts);
+        message_history_close(history);
+        return NULL;
+    }
+
+    history->next = 1;
+    for (size_t i = 0; i < count; i++) {
+        struct segment *segment = &history->segments[history->count];
+        if (open_segment(history, segment, firsts[i], 0) < 0) continue;
+        history->count++;
+
+        // The last segment may have been cut while written
+        if (segment->entries == 0 || i == count - 1) {
+            long long messages = scan_segment(segment);
+            if (messages < 0) {
+                close_segment(history, segment, 0);
+                history->count--;
+                continue;
+            }
+            history->next = segment->first + (uint64_t) messages;
+        }
+    }
+    free(firsts);
+
+    retain(history);
+    return history;
+}
+
+uint64_t message_history_next(struct message_history *history) {
+
+    pthread_mutex_lock(&history->lock);
+    uint64_t next = history->next;
+    pthread_mutex_unlock(&history->lock);
+
+    return next;
+}
+
+uint64_t message_history_append(
+        struct message_history *history,
+        const char *data,
+        size_t length
+) {
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&history->lock);
+
+    struct segment *segment = (history->count > 0)
+                              ? &history->segments[history->count - 1]
+                              : NULL;
+
+    if (segment == NULL || (segment->size > 0 && (
+            segment->size + length > MESSAGE_HISTORY_SEGMENT_SIZE
+            || now - segment->created >= MESSAGE_HISTORY_SEGMENT_AGE
+    ))) {
+        if (roll(history) < 0) {
+            pthread_mutex_unlock(&history->lock);
+            return 0;
+        }
+        segment = &history->segments[history->count - 1];
+    }
+
+    if (segment->size == 0) segment->created = now;
+
+    // Indexes a message every interval, the first of the segment included
+    size_t entries = segment->entries;
+    if (entries == 0 || (entries < INDEX_ENTRIES
+                         && segment->size - segment->index[entries - 1].offset
+                            >= MESSAGE_HISTORY_INDEX_INTERVAL)) {
+        segment->index[segment->entries++] = (struct entry) {
+                .sequence = history->next,
+                .time = now,
+                .offset = segment->size
+        };
+    }
+
+    size_t written = 0;
+    while (written < length) {
+        ssize_t n = pwrite(
+                segment->fd,
+                data + written, length - written,
+                (off_t) (segment->size + written)
+        );
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            // Forgets the partial message
+            if (ftruncate(segment->fd, (off_t) segment->size) < 0) {
+                perror("Truncating history segment");
+            }
+            if (segment->entries > entries) {
+                segment->index[--segment->entries] = (struct entry) {0};
+            }
+            pthread_mutex_unlock(&history->lock);
+            return 0;
+        }
+        written += (size_t) n;
+    }
+
+    segment->size += length;
+    segment->modified = now;
+    uint64_t sequence = history->next++;
+
+    pthread_mutex_unlock(&history->lock);
+    return sequence;
+}
+
+size_t message_history_replay(
+        struct message_history *history,
+        uint64_t from,
+        uint64_t to,
+        struct message_history_span *spans,
+        size_t size
+) {
+    size_t count = 0;
+
+    pthread_mutex_lock(&history->lock);
+
+    if (history->count > 0 && from < history->segments[0].first) {
+        from = history->segments[0].first;
+    }
+    if (to > history->next) to = history->next;
+
+    for (size_t i = 0; i < history->count && from < to && count < size; i++) {
+        const struct segment *segment = &history->segments[i];
+        uint64_t end = (i + 1 < history->count)
+                       ? history->segments[i + 1].first : history->next;
+        if (end <= from || segment->first >= to) continue;
+
+        off_t start = (from > segment->first) ? locate(segment, from) : 0;
+        off_t stop = (to < end) ? locate(segment, to)
+                                : (off_t) segment->size;
+        if (stop <= start) continue;
+
+        int fd = fcntl(segment->fd, F_DUPFD_CLOEXEC, 0);
+        if (fd < 0) break;
+
+        spans[count++] = (struct message_history_span) {
+                .fd = fd,
+                .offset = start,
+                .length = (size_t) (stop - start)
+        };
+    }
+
+    pthread_mutex_unlock(&history->lock);
+    return count;
+}
+
+size_t message_history_render(
+        struct message_history *history,
+        char *buffer,
+        size_t size
+) {
+    pthread_mutex_lock(&history->lock);
+
+    size_t bytes = 0;
+    for (size_t i = 0; i < history->count; i++) {
+        bytes += history->segments[i].size;
+    }
+    uint64_t first = (history->count > 0) ? history->segments[0].first
+                                          : history->next;
+
+    int length = snprintf(
+            buffer, size,
+            "History : messages %llu to %llu, %zu segments, %zu KB",
+            (unsigned long long) first,
+            (unsigned long long) history->next - 1,
+            history->count,
+            bytes / 1024
+    );
+
+    pthread_mutex_unlock(&history->lock);
+
+    if (length < 0 || size == 0) return 0;
+    return ((size_t) length < size) ? (size_t) length : size - 1;
+}
+
+void message_history_close(struct message_history *history) {
+
+    for (size_t i = 0; i < history->count; i++) {
+        close_segment(history, &history->segments[i], 0);
+    }
+
+    pthread_mutex_destroy(&history->lock);
+    free(history->segments);
+    free(history->directory);
+    free(history);
+}
+
+/* -------------------------------------------------------------------------- */
+
+int open_segment(
+        struct message_history *history,
+        struct segment *segment,
+        uint64_t first,
+        int create
+) {
+    char path[4096];
+    int flags = O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0);
+
+    *segment = (struct segment) {.first = first, .fd = -1};
+
+    segment_path(history, first, "log", path, sizeof path);
+    segment->fd = open(path, flags, 0644);
+    if (segment->fd < 0) return -1;
+
+    struct stat status;
+    if (fstat(segment->fd, &status) < 0) {
+        close_segment(history, segment, create);
+        return -1;
+    }
+    segment->size = (size_t) status.st_size;
+    segment->created = segment->modified = status.st_mtime;
+
+    segment_path(history, first, "index", path, sizeof path);
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    size_t length = INDEX_ENTRIES * sizeof *segment->index;
+    if (fd < 0 || ftruncate(fd, (off_t) length) < 0) {
+        if (fd >= 0) close(fd);
+        close_segment(history, segment, create);
+        return -1;
+    }
+
+    segment->index = mmap(
+            NULL, length,
+            PROT_READ | PROT_WRITE, MAP_SHARED,
+            fd, 0
+    );
+    close(fd);
+    if (segment->index == MAP_FAILED) {
+        segment->index = NULL;
+        close_segment(history, segment, create);
+        return -1;
+    }
+
+    while (segment->entries < INDEX_ENTRIES
+           && segment->index[segment->entries].sequence != 0) {
+        segment->entries++;
+    }
+    if (segment->entries > 0) segment->created = segment->index[0].time;
+
+    return 0;
+}
+
+long long scan_segment(struct segment *segment) {
+
+    char *buffer = malloc(SCAN_SIZE);
+    if (buffer == NULL) return -1;
+
+    memset(segment->index, 0, INDEX_ENTRIES * sizeof *segment->index);
+    segment->entries = 0;
+
+    long long messages = 0;
+    size_t offset = 0; // Start of the current message
+    size_t read_at = 0;
+
+    while (read_at < segment->size) {
+        ssize_t n = pread(segment->fd, buffer, SCAN_SIZE, (off_t) read_at);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+
+        for (ssize_t i = 0; i < n; i++) {
+            if (buffer[i] != '\n') continue;
+
+            size_t entries = segment->entries;
+            if (entries == 0 || (entries < INDEX_ENTRIES
+                                 && offset - segment->index[entries - 1].offset
+                                    >= MESSAGE_HISTORY_INDEX_INTERVAL)) {
+                segment->index[segment->entries++] = (struct entry) {
+                        .sequence = segment->first + (uint64_t) messages,
+                        .time = segment->modified,
+                        .offset = offset
+                };
+            }
+
+            messages++;
+            offset = read_at + (size_t) i + 1;
+        }
+        read_at += (size_t) n;
+    }
+    free(buffer);
+
+    // Drops the partial message left by a crash
+    if (offset < segment->size) {
+        if (ftruncate(segment->fd, (off_t) offset) < 0) return -1;
+        segment->size = offset;
+    }
+
+    return messages;
+}
+
+void close_segment(
+        struct message_history *history,
+        struct segment *segment,
+        int remove
+) {
+    if (segment->index != NULL) {
+        munmap(segment->index, INDEX_ENTRIES * sizeof *segment->index);
+    }
+    if (segment->fd >= 0) close(segment->fd);
+
+    if (remove) {
+        char path[4096];
+        segment_path(history, segment->first, "log", path, sizeof path);
+        unlink(path);
+        segment_path(history, segment->first, "index", path, sizeof path);
+        unlink(path);
+    }
+}
+
+int roll(struct message_history *history) {
+
+    struct segment *segments = realloc(
+            history->segments,
+            (history->count + 1) * sizeof *segments
+    );
+    if (segments == NULL) return -1;
+    history->segments = segments;
+
+    if (open_segment(
+            history,
+            &segments[history->count],
+            history->next,
+            1
+    ) < 0) {
+        perror("Creating history segment");
+        return -1;
+    }
+    history->count++;
+
+    retain(history);
+    return 0;
+}
+
+void retain(struct message_history *history) {
+
+    time_t now = time(NULL);
+    size_t bytes = 0;
+    for (size_t i = 0; i < history->count; i++) {
+        bytes += history->segments[i].size;
+    }
+
+    while (history->count > 1 && (
+            bytes > MESSAGE_HISTORY_RETENTION_SIZE
+            || now - history->segments[0].modified
+               > MESSAGE_HISTORY_RETENTION_AGE
+    )) {
+        bytes -= history->segments[0].size;
+        close_segment(history, &history->segments[0], 1);
+
+        history->count--;
+        memmove(
+                history->segments,
+                history->segments + 1,
+                history->count * sizeof *history->segments
+        );
+    }
+}
+
+off_t locate(const struct segment *segment, uint64_t sequence) {
+
+    // Closest message indexed, at most the one looked for
+    size_t low = 0;
+    size_t high = segment->entries;
+    while (high - low > 1) {
+        size_t middle = low + (high - low) / 2;
+        if (segment->index[middle].sequence <= sequence) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+
+    uint64_t current = segment->first;
+    off_t offset = 0;
+    if (segment->entries > 0 && segment->index[low].sequence <= sequence) {
+        current = segment->index[low].sequence;
+        offset = (off_t) segment->index[low].offset;
+    }
+
+    char buffer[MESSAGE_HISTORY_INDEX_INTERVAL];
+    while (current < sequence && (size_t) offset < segment->size) {
+        ssize_t n = pread(segment->fd, buffer, sizeof buffer, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+
+        ssize_t i = 0;
+        while (i < n && current < sequence) {
+            char *end = memchr(buffer + i, '\n', (size_t) (n - i));
+            if (end == NULL) {
+                i = n;
+                break;
+            }
+            i = end - buffer + 1;
+            current++;
+        }
+        offset += i;
+    }
+
+    return offset;
+}
+
+void segment_path(
+        const struct message_history *history,
+        uint64_t first,
+        const char *extension,
+        char *path,
+        size_t size
+) {
+    snprintf(
+            path, size,
+            "%s/%020llu.%s",
+            history->directory, (unsigned long long) first, extension
+    );
+}
+
+int compare_first(const void *a, const void *b) {
+
+    uint64_t first_a = *(const uint64_t *) a;
+    uint64_t first_b = *(const uint64_t *) b;
+    return (first_a > first_b) - (first_a < first_b);
+}
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef MESSAGE_HISTORY_H
+#define MESSAGE_HISTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * Size past which a segment is closed, and the next one started.
+ */
+#define MESSAGE_HISTORY_SEGMENT_SIZE (16 * 1024 * 1024)
+
+/**
+ * Seconds past which a segment is closed, and the next one started.
+ */
+#define MESSAGE_HISTORY_SEGMENT_AGE (60 * 60)
+
+/**
+ * Size of the segments past which the oldest are removed.
+ */
+#define MESSAGE_HISTORY_RETENTION_SIZE (256 * 1024 * 1024)
+
+/**
+ * Seconds since their last message past which segments are removed.
+ */
+#define MESSAGE_HISTORY_RETENTION_AGE (7 * 24 * 60 * 60)
+
+/**
+ * Bytes between two messages of a segment found through its index : the
+ * others are found by reading forward from the closest one.
+ */
+#define MESSAGE_HISTORY_INDEX_INTERVAL 4096
+
+/**
+ * Messages sent to the clients, each numbered, kept in the files of a
+ * directory. The messages are appended to the last segment file, as sent,
+ * one per line, and a sparse index maps some of their numbers to their
+ * place. Segments are rolled by size and age, and removed by the size of all
+ * segments and by age.
+ */
+struct message_history;
+
+/**
+ * Part of a segment file holding some messages, to be sent as is.
+ */
+struct message_history_span {
+    int fd; // Owned by the caller
+    off_t offset;
+    size_t length;
+};
+
+/**
+ * Opens the history kept in a directory, creating it if missing.
+ *
+ * @return the history, or NULL on failure
+ */
+extern struct message_history *message_history_open(const char *directory);
+
+/**
+ * Tells the number the next message appended is given, the first being 1.
+ */
+extern uint64_t message_history_next(struct message_history *history);
+
+/**
+ * Appends a message, a single line ended by a newline. Safe to call from
+ * several threads, though the number of the message is only known ahead if
+ * the callers take turns.
+ *
+ * @return the number of the message, 0 on failure
+ */
+extern uint64_t message_history_append(
+        struct message_history *history,
+        const char *data,
+        size_t length
+);
+
+/**
+ * Finds the messages of some numbers still kept. Each span holds a
+ * descriptor of its own, so the segment may be removed while it is sent.
+ *
+ * @param from number of the first message
+ * @param to number past the last message
+ * @param spans the spans found, one per segment
+ * @param size number of spans at most
+ *
+ * @return the number of spans
+ */
+extern size_t message_history_replay(
+        struct message_history *history,
+        uint64_t from,
+        uint64_t to,
+        struct message_history_span *spans,
+        size_t size
+);
+
+/**
+ * Reports the numbers of the messages kept, and the size of the segments.
+ *
+ * @param buffer the null-terminated report
+ * @param size size of the buffer
+ *
+ * @return the length of the report, truncated if the buffer is too small
+ */
+extern size_t message_history_render(
+        struct message_history *history,
+        char *buffer,
+        size_t size
+);
+
+extern void message_history_close(struct message_history *history);
+
+#endif
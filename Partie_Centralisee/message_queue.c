@@ -0,0 +1,485 @@
+#ifdef WIN32
+
+#include <winsock2.h>
+#include <io.h>
+
+#elif defined(linux)
+
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
+
+#else
+
+#error platform unsupported
+
+#endif
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "message_queue.h"
+
+struct message_queue {
+    size_t size;
+    size_t head; // Index of the oldest message
+    size_t length;
+    size_t offset; // Bytes of the oldest message already sent
+    size_t bytes; // Bytes left to send
+    struct entry {
+        struct message *message; // NULL for a part of a file
+        int droppable; // Whether it may be dropped unsent
+        int fd; // File sent, closed once sent
+        off_t start;
+        size_t length; // Bytes of the file sent
+    } entries[];
+};
+
+/**
+ * Adds an entry at the end of a queue, growing it if full.
+ *
+ * @return 0 on success, -1 if memory is short or the limit reached
+ */
+static int push(struct message_queue **queue, struct entry entry);
+
+/**
+ * Removes the oldest message of a queue.
+ */
+static void pop(struct message_queue *queue);
+
+/**
+ * Tells the bytes an entry sends.
+ */
+static size_t entry_length(const struct entry *entry);
+
+/**
+ * Sends the part of a file at the head of a queue, as much as the socket
+ * takes, without copying it.
+ *
+ * @return the bytes sent, -1 with errno set on failure
+ */
+static ssize_t send_file(struct message_queue *queue, int socket);
+
+/**
+ * Counts memory as used, unless it would pass the limit.
+ *
+ * @return 0 on success, -1 if the limit would be passed
+ */
+static int reserve(size_t size);
+
+/**
+ * Counts memory as no longer used.
+ */
+static void unreserve(size_t size);
+
+/**
+ * Blocks released, to be reused for the next messages. Messages are released
+ * by the reactor sending them last, which is seldom the one creating them.
+ */
+static struct message *pool = NULL;
+
+static size_t pool_count = 0;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Bytes of the messages, including the blocks of the pool, and of the queues.
+ */
+static _Atomic size_t memory = 0;
+
+static _Atomic size_t memory_limit = SIZE_MAX;
+
+static _Atomic uint64_t allocated = 0;
+
+static _Atomic uint64_t reused = 0;
+
+static _Atomic uint64_t copies = 0;
+
+static _Atomic uint64_t pushed = 0;
+
+static _Atomic uint64_t dropped = 0;
+
+static _Atomic uint64_t refused = 0;
+
+static _Atomic uint64_t writes = 0;
+
+struct message *message_alloc(size_t length) {
+
+    struct message *message = NULL;
+    int pooled = sizeof *message + length <= MESSAGE_POOL_BLOCK;
+
+    if (pooled) {
+        pthread_mutex_lock(&pool_lock);
+        message = pool;
+        if (message != NULL) {
+            pool = message->next;
+            pool_count--;
+        }
+        pthread_mutex_unlock(&pool_lock);
+    }
+
+    if (message != NULL) {
+        atomic_fetch_add_explicit(&reused, 1, memory_order_relaxed);
+    } else {
+        size_t size = pooled ? MESSAGE_POOL_BLOCK : sizeof *message + length;
+        if (reserve(size) < 0) return NULL;
+
+        message = malloc(size);
+        if (message == NULL) {
+            unreserve(size);
+            atomic_fetch_add_explicit(&refused, 1, memory_order_relaxed);
+            return NULL;
+        }
+        message->size = size;
+        atomic_fetch_add_explicit(&allocated, 1, memory_order_relaxed);
+    }
+
+    atomic_init(&message->references, 1);
+    message->length = length;
+    message->next = NULL;
+    return message;
+}
+
+struct message *message_create(const char *data, size_t length) {
+
+    struct message *message = message_alloc(length);
+    if (message == NULL) return NULL;
+
+    memcpy(message->data, data, length);
+
+    atomic_fetch_add_explicit(&copies, 1, memory_order_relaxed);
+    return message;
+}
+
+void message_acquire(struct message *message, size_t count) {
+    atomic_fetch_add_explicit(
+            &message->references, count,
+            memory_order_relaxed
+    );
+}
+
+void message_release(struct message *message) {
+
+    // The last owner sees every write of the others
+    if (atomic_fetch_sub_explicit(
+            &message->references, 1,
+            memory_order_acq_rel
+    ) == 1) {
+        if (message->size == MESSAGE_POOL_BLOCK) {
+            pthread_mutex_lock(&pool_lock);
+            if (pool_count < MESSAGE_POOL_SIZE) {
+                message->next = pool;
+                pool = message;
+                pool_count++;
+                message = NULL;
+            }
+            pthread_mutex_unlock(&pool_lock);
+        }
+        if (message != NULL) {
+            unreserve(message->size);
+            free(message);
+        }
+    }
+}
+
+int message_queue_push(
+        struct message_queue **queue,
+        struct message *message,
+        int droppable
+) {
+    if (push(queue, (struct entry) {
+            .message = message,
+            .droppable = droppable,
+            .fd = -1
+    }) < 0) {
+        return -1;
+    }
+
+    message_acquire(message, 1);
+    return 0;
+}
+
+int message_queue_push_file(
+        struct message_queue **queue,
+        int fd,
+        off_t start,
+        size_t length
+) {
+    return push(queue, (struct entry) {
+            .fd = fd,
+            .start = start,
+            .length = length
+    });
+}
+
+int message_queue_flush(struct message_queue **queue, int socket) {
+
+    struct message_queue *q = *queue;
+
+    while (q != NULL && q->length > 0) {
+        size_t count = 0;
+        size_t sent;
+
+        // Messages are written together, up to the next part of a file
+        while (count < q->length && count < MESSAGE_QUEUE_BATCH
+               && q->entries[(q->head + count) % q->size].message != NULL) {
+            count++;
+        }
+
+        if (count == 0) {
+            ssize_t n = send_file(q, socket);
+#ifdef WIN32
+            if (n < 0) {
+                if (WSAGetLastError() == WSAEWOULDBLOCK) return 1;
+                return -1;
+            }
+#elif defined(linux)
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+                return -1;
+            }
+#endif
+            // A file cut meanwhile is left unsent
+            sent = (n > 0) ? (size_t) n
+                           : entry_length(&q->entries[q->head]) - q->offset;
+        } else {
+#ifdef WIN32
+            WSABUF buffers[MESSAGE_QUEUE_BATCH];
+            for (size_t i = 0; i < count; i++) {
+                struct entry *entry = &q->entries[(q->head + i) % q->size];
+                size_t skip = (i == 0) ? q->offset : 0;
+                buffers[i].buf = entry->message->data + skip;
+                buffers[i].len = (ULONG) (entry->message->length - skip);
+            }
+
+            DWORD written;
+            if (WSASend(
+                    (SOCKET) socket,
+                    buffers, (DWORD) count,
+                    &written,
+                    0, NULL, NULL
+            ) == SOCKET_ERROR) {
+                if (WSAGetLastError() == WSAEWOULDBLOCK) return 1;
+                return -1;
+            }
+            sent = written;
+#elif defined(linux)
+            struct iovec buffers[MESSAGE_QUEUE_BATCH];
+            for (size_t i = 0; i < count; i++) {
+                struct entry *entry = &q->entries[(q->head + i) % q->size];
+                size_t skip = (i == 0) ? q->offset : 0;
+                buffers[i].iov_base = entry->message->data + skip;
+                buffers[i].iov_len = entry->message->length - skip;
+            }
+
+            struct msghdr header = {
+                    .msg_iov = buffers,
+                    .msg_iovlen = count
+            };
+            ssize_t n = sendmsg(socket, &header, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+                return -1;
+            }
+            sent = (size_t) n;
+#endif
+        }
+        atomic_fetch_add_explicit(&writes, 1, memory_order_relaxed);
+
+        while (sent > 0) {
+            size_t left = entry_length(&q->entries[q->head]) - q->offset;
+            if (sent < left) {
+                q->offset += sent;
+                q->bytes -= sent;
+                return 1;
+            }
+            sent -= left;
+            pop(q);
+        }
+    }
+
+    message_queue_clear(queue);
+    return 0;
+}
+
+size_t message_queue_drop(struct message_queue **queue, size_t bytes) {
+
+    struct message_queue *q = *queue;
+    if (q == NULL) return 0;
+
+    size_t count = 0;
+    size_t kept = 0;
+
+    // Keeps the message being sent, and those which may not be dropped
+    for (size_t i = 0; i < q->length; i++) {
+        struct entry entry = q->entries[(q->head + i) % q->size];
+        int sending = (i == 0 && q->offset > 0);
+
+        if (q->bytes > bytes && entry.droppable && !sending) {
+            q->bytes -= entry.message->length;
+            message_release(entry.message);
+            count++;
+        } else {
+            q->entries[(q->head + kept++) % q->size] = entry;
+        }
+    }
+    q->length = kept;
+
+    atomic_fetch_add_explicit(&dropped, count, memory_order_relaxed);
+    if (kept == 0) message_queue_clear(queue);
+    return count;
+}
+
+size_t message_queue_bytes(const struct message_queue *queue) {
+    return (queue != NULL) ? queue->bytes : 0;
+}
+
+void message_queue_clear(struct message_queue **queue) {
+
+    struct message_queue *q = *queue;
+    if (q == NULL) return;
+
+    while (q->length > 0) pop(q);
+
+    unreserve(sizeof *q + q->size * sizeof *q->entries);
+    free(q);
+    *queue = NULL;
+}
+
+void message_queue_limit(size_t bytes) {
+    atomic_store(&memory_limit, bytes);
+}
+
+size_t message_queue_render(char *buffer, size_t size) {
+
+    int length = snprintf(
+            buffer, size,
+            "Messages : allocated %llu, reused %llu, copies %llu, "
+            "queued %llu, dropped %llu, refused %llu, writes %llu, "
+            "memory %zu KB",
+            (unsigned long long) atomic_load(&allocated),
+            (unsigned long long) atomic_load(&reused),
+            (unsigned long long) atomic_load(&copies),
+            (unsigned long long) atomic_load(&pushed),
+            (unsigned long long) atomic_load(&dropped),
+            (unsigned long long) atomic_load(&refused),
+            (unsigned long long) atomic_load(&writes),
+            atomic_load(&memory) / 1024
+    );
+
+    if (length < 0 || size == 0) return 0;
+    return ((size_t) length < size) ? (size_t) length : size - 1;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int push(struct message_queue **queue, struct entry entry) {
+
+    struct message_queue *q = *queue;
+
+    if (q == NULL || q->length == q->size) {
+        size_t size = (q != NULL) ? 2 * q->size : MESSAGE_QUEUE_SIZE;
+        if (reserve(sizeof *q + size * sizeof *q->entries) < 0) return -1;
+
+        struct message_queue *grown = malloc(
+                sizeof *grown + size * sizeof *grown->entries
+        );
+        if (grown == NULL) {
+            unreserve(sizeof *q + size * sizeof *q->entries);
+            atomic_fetch_add_explicit(&refused, 1, memory_order_relaxed);
+            return -1;
+        }
+
+        *grown = (struct message_queue) {.size = size};
+        if (q != NULL) {
+            // Unwraps the ring
+            for (size_t i = 0; i < q->length; i++) {
+                grown->entries[i] = q->entries[(q->head + i) % q->size];
+            }
+            grown->length = q->length;
+            grown->offset = q->offset;
+            grown->bytes = q->bytes;
+            unreserve(sizeof *q + q->size * sizeof *q->entries);
+            free(q);
+        }
+        *queue = q = grown;
+    }
+
+    q->entries[(q->head + q->length) % q->size] = entry;
+    q->length++;
+    q->bytes += entry_length(&entry);
+
+    atomic_fetch_add_explicit(&pushed, 1, memory_order_relaxed);
+    return 0;
+}
+
+void pop(struct message_queue *queue) {
+
+    struct entry *entry = &queue->entries[queue->head];
+
+    queue->bytes -= entry_length(entry) - queue->offset;
+    if (entry->message != NULL) {
+        message_release(entry->message);
+    } else {
+        close(entry->fd);
+    }
+    queue->head = (queue->head + 1) % queue->size;
+    queue->length--;
+    queue->offset = 0;
+}
+
+size_t entry_length(const struct entry *entry) {
+    return (entry->message != NULL) ? entry->message->length : entry->length;
+}
+
+ssize_t send_file(struct message_queue *queue, int socket) {
+
+    struct entry *entry = &queue->entries[queue->head];
+    off_t offset = entry->start + (off_t) queue->offset;
+    size_t left = entry->length - queue->offset;
+
+#ifdef WIN32
+    char chunk[4096];
+    if (left > sizeof chunk) left = sizeof chunk;
+
+    if (_lseeki64(entry->fd, offset, SEEK_SET) < 0) return -1;
+    int n = _read(entry->fd, chunk, (unsigned int) left);
+    if (n <= 0) return n;
+
+    // The part not taken by the socket is read again
+    n = send((SOCKET) socket, chunk, n, 0);
+    return (n == SOCKET_ERROR) ? -1 : n;
+#elif defined(linux)
+    return sendfile(socket, entry->fd, &offset, left);
+#endif
+}
+
+int reserve(size_t size) {
+
+    size_t used = atomic_load_explicit(&memory, memory_order_relaxed);
+    size_t limit = atomic_load_explicit(&memory_limit, memory_order_relaxed);
+
+    do {
+        if (used + size > limit || used + size < used) {
+            atomic_fetch_add_explicit(&refused, 1, memory_order_relaxed);
+            return -1;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(
+            &memory,
+            &used, used + size,
+            memory_order_relaxed, memory_order_relaxed
+    ));
+
+    return 0;
+}
+
+void unreserve(size_t size) {
+    atomic_fetch_sub_explicit(&memory, size, memory_order_relaxed);
+}
@@ -0,0 +1,159 @@
+#ifndef MESSAGE_QUEUE_H
+#define MESSAGE_QUEUE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Number of messages a queue initially holds, doubled when full.
+ */
+#define MESSAGE_QUEUE_SIZE 8
+
+/**
+ * Largest number of messages written at once.
+ */
+#define MESSAGE_QUEUE_BATCH 64
+
+/**
+ * Size of the blocks messages are allocated from, kept in a pool once
+ * released. Larger messages are allocated on their own.
+ */
+#define MESSAGE_POOL_BLOCK 2048
+
+/**
+ * Number of released blocks the pool keeps.
+ */
+#define MESSAGE_POOL_SIZE 1024
+
+/**
+ * Data sent to one or many clients, encoded once and shared by the queues it
+ * is pushed to. Released once the last queue holding it has sent it.
+ */
+struct message {
+    _Atomic size_t references;
+    size_t length;
+    size_t size; // Bytes allocated, MESSAGE_POOL_BLOCK for a pool block
+    struct message *next; // In the pool, once released
+    char data[];
+};
+
+/**
+ * Data waiting to be sent to a client, as a ring of messages.
+ */
+struct message_queue;
+
+/**
+ * Allocates a message with a single reference, its data to be written in
+ * place. Taken from the pool if it fits in a block.
+ *
+ * @param length length of the data, which may be lowered once written
+ *
+ * @return the message, or NULL if memory is short or the limit reached
+ */
+extern struct message *message_alloc(size_t length);
+
+/**
+ * Creates a message holding a copy of some data, with a single reference.
+ *
+ * @return the message, or NULL if memory is short or the limit reached
+ */
+extern struct message *message_create(const char *data, size_t length);
+
+/**
+ * Adds references to a message.
+ */
+extern void message_acquire(struct message *message, size_t count);
+
+/**
+ * Removes a reference to a message, and frees it once it has none.
+ */
+extern void message_release(struct message *message);
+
+/**
+ * Adds a message at the end of a queue, the queue holding a reference to it.
+ * The queue is allocated on first push.
+ *
+ * @param queue the queue, NULL if empty
+ * @param droppable whether the message may be dropped unsent
+ *
+ * @return 0 on success, -1 if memory is short or the limit reached
+ */
+extern int message_queue_push(
+        struct message_queue **queue,
+        struct message *message,
+        int droppable
+);
+
+/**
+ * Adds a part of a file at the end of a queue, sent without being copied.
+ * The queue owns the descriptor, and closes it once the part is sent. Such
+ * parts are never dropped.
+ *
+ * @param queue the queue, NULL if empty
+ * @param fd descriptor of the file
+ * @param start offset of the part in the file
+ * @param length bytes of the part
+ *
+ * @return 0 on success, -1 if memory is short or the limit reached
+ */
+extern int message_queue_push_file(
+        struct message_queue **queue,
+        int fd,
+        off_t start,
+        size_t length
+);
+
+/**
+ * Sends as many messages of a queue as the socket takes, several at a time.
+ * The queue is freed once empty.
+ *
+ * @param queue the queue, NULL if empty
+ * @param socket a non-blocking socket
+ *
+ * @return 0 if the queue is empty, 1 if data is left, -1 if the socket failed
+ */
+extern int message_queue_flush(struct message_queue **queue, int socket);
+
+/**
+ * Drops the oldest droppable messages of a queue until it holds no more than
+ * some bytes to send. The message being sent is kept.
+ *
+ * @param queue the queue, NULL if empty
+ * @param bytes bytes left to send once done
+ *
+ * @return the number of messages dropped
+ */
+extern size_t message_queue_drop(struct message_queue **queue, size_t bytes);
+
+/**
+ * Tells how many bytes a queue has left to send.
+ *
+ * @param queue the queue, NULL if empty
+ */
+extern size_t message_queue_bytes(const struct message_queue *queue);
+
+/**
+ * Releases the messages of a queue, and frees it.
+ */
+extern void message_queue_clear(struct message_queue **queue);
+
+/**
+ * Sets the memory the messages and the queues may use at most, past which
+ * they are refused.
+ */
+extern void message_queue_limit(size_t bytes);
+
+/**
+ * Reports how many messages were allocated, taken from the pool, and filled
+ * by copying their data, how many were pushed to queues, dropped or refused,
+ * how many writes sent them, and the memory used.
+ *
+ * @param buffer the null-terminated report
+ * @param size size of the buffer
+ *
+ * @return the length of the report, truncated if the buffer is too small
+ */
+extern size_t message_queue_render(char *buffer, size_t size);
+
+#endif
@@ -6,9 +6,15 @@
 
 #elif defined(linux)
 
+#define _GNU_SOURCE
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 #include <netinet/in.h>
+#include <unistd.h>
 #include <errno.h>
+#include <signal.h>
 
 #define INVALID_SOCKET (-1)
 #define SOCKET_ERROR (-1)
@@ -26,13 +32,63 @@ typedef struct in_addr IN_ADDR;
 
 #include "server_handler.h"
 #include "user_database_handler.h"
+#include "server_log.h"
+#include "server_metrics.h"
+#include "worker_pool.h"
+#include "message_queue.h"
+#include "message_channel.h"
+#include "message_history.h"
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <pthread.h>
 #include <string.h>
+#include <strings.h>
 
 #define SERVER_PORT 24020
-#define SERVER_QUEUE 10
+
+/**
+ * Size of a command, or of its reply.
+ */
+#define REQUEST_SIZE 1024
+
+/**
+ * Size of the reply to a stats command, the longest : the report of the
+ * central server, then that of the account service.
+ */
+#define STATS_SIZE (SERVER_METRICS_REPORT_SIZE + 2 * REQUEST_SIZE)
+
+void sock_err(char *action);
+
+/**
+ * Runs a command of a client.
+ *
+ * @param buffer the null-terminated command as input, its reply as output, of
+ *               STATS_SIZE bytes
+ */
+static void execute(char *buffer);
+
+/**
+ * Reports the metrics of the central server, then those of the account
+ * service.
+ *
+ * @param buffer the report
+ * @param size size of the buffer
+ */
+static void stats(char *buffer, size_t size);
+
+/**
+ * History of the messages sent, NULL if none. Ignored on Windows.
+ */
+static struct message_history *history = NULL;
+
+#ifdef WIN32
+
+/**
+ * Milliseconds a reply may take to be sent before its client is dropped.
+ */
+#define SEND_TIMEOUT 5000
 
 struct client_t {
     pthread_t thread_id;
@@ -41,12 +97,354 @@ struct client_t {
     socklen_t addr_len;
 };
 
-void sock_err(char *action);
-
 void *client_handler(void *arg);
 
+#elif defined(linux)
+
+/**
+ * Size of the buffer the data of the connections are read into.
+ */
+#define READ_SIZE 65536
+
+/**
+ * Number of events handled per wait.
+ */
+#define EVENTS_SIZE 256
+
+/**
+ * Number of commands of a connection waiting to be run from which its data is
+ * left unread, until half of them are run.
+ */
+#define PIPELINE_SIZE 64
+
+/**
+ * Number of connections logged in a reactor initially holds.
+ */
+#define ONLINE_SIZE 64
+
+/**
+ * Number of messages replayed by default, and at most, by a history command.
+ */
+#define REPLAY_DEFAULT 20
+#define REPLAY_MAX 1000
+
+/**
+ * Number of segments of the history a replay spans at most.
+ */
+#define REPLAY_SPANS 16
+
+struct reactor;
+
+/**
+ * Command of a connection, run by the workers. Its data is the command, then
+ * the reply.
+ */
+struct request {
+    struct worker_task task;
+    struct connection *connection;
+    struct request *next;
+    int framed; // Whether the command ended with a newline
+    uint8_t opcode; // Command run by the account service, 0 if unknown
+    int8_t status; // Status of its reply
+    uint64_t user; // User it was run for
+    size_t length;
+    char data[];
+};
+
+/**
+ * Message sent by a client, posted to a reactor to be pushed to the users
+ * logged in on its connections.
+ */
+struct delivery {
+    struct message *message;
+    struct delivery *next;
+};
+
+/**
+ * Connection of a client, served by a single reactor. An idle connection holds
+ * no buffer : the partial command and the unsent reply are allocated only
+ * while there are some.
+ *
+ * A client ending its commands with newlines gets its replies ended with
+ * newlines. Former clients send one command at a time without newline : their
+ * data is run as a command once nothing more is to be read.
+ *
+ * The commands of a connection are run one at a time, so that its replies are
+ * sent in order. Once a user logs in, the messages sent by clients are pushed
+ * to the connection between its replies.
+ */
+struct connection {
+    SOCKET socket;
+    struct reactor *reactor;
+    int framed; // Whether the client ended a command with a newline
+    int writing; // Whether the reactor waits for the socket to be writable
+    int paused; // Whether its data is left unread until its commands run
+    int running; // Whether a command is run by the workers
+    int closed; // Whether the socket is closed
+    int throttled; // Whether its data is left unread until its data is sent
+    size_t queued_count;
+    struct request *queued; // Commands waiting for the running one
+    struct request **queued_tail;
+    size_t in_length;
+    char *in; // Partial command
+    struct message_queue *out; // Unsent replies and messages
+    uint64_t user; // User logged in, 0 if none
+    size_t online_index; // Index in the connections logged in
+    struct connection *next; // In the list of connections to free
+};
+
+/**
+ * Thread serving the connections accepted on its own listening socket, the
+ * sockets of all reactors sharing the port. The commands read are run by the
+ * workers, which post their replies back to the reactor.
+ *
+ * The messages sent by clients are encoded once, and posted to every reactor,
+ * which pushes them to its connections logged in.
+ */
+struct reactor {
+    size_t number;
+    int epoll;
+    SOCKET listener;
+    int wakeup; // Event counter signaled when replies or messages are posted
+    struct request *_Atomic done; // Replies posted, newest first
+    struct delivery *_Atomic inbox; // Messages posted, newest first
+    struct connection *closed; // Connections to free once the events are
+                               // handled
+    size_t online_count;
+    size_t online_size;
+    struct connection **online; // Connections logged in
+    pthread_t thread;
+    char *buffer; // READ_SIZE bytes
+};
+
+static struct reactor *reactors = NULL;
+
+static size_t reactor_count = 0;
+
+static struct server_options settings;
+
+/**
+ * Channel the messages sent are published to, NULL if none.
+ */
+static struct message_channel *channel = NULL;
+
+/**
+ * Number of the last message sent, when no history is kept.
+ */
+static uint64_t sequence = 0;
+
+/**
+ * Numbers the messages sent in the order they are kept and pushed.
+ */
+static pthread_mutex_t sequence_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Command run by the reactors rather than by the account service.
+ */
+struct local_command {
+    const char *name;
+    int (*run)(struct connection *connection, struct request *request);
+};
+
+/**
+ * Creates a non-blocking socket listening on the server port.
+ *
+ * @param backlog length of the queue of connections waiting to be accepted
+ */
+static SOCKET open_listener(int backlog);
+
+/**
+ * Waits for the events of the reactor sockets, and handles them.
+ */
+static void *react(void *arg);
+
+/**
+ * Accepts every waiting connection.
+ */
+static void accept_all(struct reactor *reactor);
+
+/**
+ * Reads every data available on a connection, and queues its commands.
+ *
+ * @return 0 on success, -1 if the connection is to be closed
+ */
+static int receive(struct connection *connection);
+
+/**
+ * Queues the commands of data read from a connection, keeping the trailing
+ * partial command.
+ *
+ * @return 0 on success, -1 if the connection is to be closed
+ */
+static int feed(
+        struct connection *connection,
+        const char *data,
+        size_t length
+);
+
+/**
+ * Queues a command of a connection, to be run once the previous ones are.
+ *
+ * @param framed whether the command ended with a newline
+ *
+ * @return 0 on success, -1 if the connection is to be closed
+ */
+static int submit(
+        struct connection *connection,
+        const char *command,
+        size_t length,
+        int framed
+);
+
+/**
+ * Hands the next command of a connection to the workers, unless one is
+ * running. The messages sent by the client are handled at once.
+ *
+ * @return 0 on success, -1 if the connection is to be closed
+ */
+static int start(struct connection *connection);
+
+/**
+ * Finds the command run by the reactor a request holds.
+ *
+ * @return the command, or NULL if it is for the account service
+ */
+static const struct local_command *find_local(const struct request *request);
+
+/**
+ * Sends a message of a client to the users logged in, and replies to it.
+ * Each message is numbered, and kept in the history if any : a message the
+ * history fails to keep is not sent.
+ *
+ * @param request the command, "send <text>"
+ *
+ * @return 0 on success, -1 if the connection is to be closed
+ */
+static int chat(struct connection *connection, struct request *request);
+
+/**
+ * Sends the messages kept in the history to a client, straight from the
+ * segment files, behind the data already waiting.
+ *
+ * @param request the command, "history", "history <count>" or
+ *                "history since <number>"
+ *
+ * @return 0 on success, -1 if the connection is to be closed
+ */
+static int replay(struct connection *connection, struct request *request);
+
+static const struct local_command local_commands[] = {
+        {"send", &chat},
+        {"history", &replay}
+};
+
+/**
+ * Sends a command to the account service, its reply being posted to the
+ * reactor of its connection. The stats are gathered at once. Run by the
+ * workers.
+ *
+ * @param task the request
+ */
+static void serve(struct worker_task *task);
+
+/**
+ * Posts the reply of the account service to the reactor of its connection.
+ * Called by the account service receiver.
+ *
+ * @param buffer the reply, within the request
+ * @param outcome the command run, and the status of its reply
+ * @param arg the request
+ */
+static void answered(
+        char *buffer,
+        const struct user_message *outcome,
+        void *arg
+);
+
+/**
+ * Posts a reply to the reactor of its connection.
+ *
+ * @param request the request, holding the reply
+ */
+static void post(struct request *request);
+
+/**
+ * Posts a message to every reactor, giving up the reference of the caller.
+ */
+static void broadcast(struct message *message);
+
+/**
+ * Signals the event counter of a reactor.
+ */
+static void wake(struct reactor *reactor);
+
+/**
+ * Sends the replies posted by the workers, and starts the next commands of
+ * their connections. Then pushes the messages posted.
+ */
+static void complete(struct reactor *reactor);
+
+/**
+ * Pushes the messages posted to a reactor to its connections logged in, then
+ * sends them. A connection leaving too many messages unread loses the next.
+ */
+static void deliver(struct reactor *reactor);
+
+/**
+ * Adds a connection to those logged in, or changes its user.
+ */
+static void log_in(struct connection *connection, uint64_t user);
+
+/**
+ * Removes a connection from those logged in.
+ */
+static void log_out(struct connection *connection);
+
+/**
+ * Sends data on a connection. The data which can't be sent at once is kept,
+ * to be sent once the socket is writable.
+ *
+ * @return 0 on success, -1 if the connection is to be closed
+ */
+static int send_all(
+        struct connection *connection,
+        const char *data,
+        size_t length
+);
+
+/**
+ * Sends the replies and messages kept on a connection.
+ *
+ * @return 0 on success, -1 if the connection is to be closed
+ */
+static int flush(struct connection *connection);
+
+/**
+ * Applies the slow consumer policy to a connection past its high watermark.
+ *
+ * @return 0 on success, -1 if the connection is to be closed
+ */
+static int backpressure(struct connection *connection);
+
+/**
+ * Sets whether the reactor waits for a connection to be writable.
+ */
+static void watch(struct connection *connection, int writing);
+
+/**
+ * Closes a connection. It is freed once its running command is answered, and
+ * the events already received are handled.
+ */
+static void disconnect(struct connection *connection);
+
+#endif
+
+#ifdef WIN32
+
 _Noreturn void *server_handler(void *arg) {
 
+    const struct server_options *options = arg;
+
     SOCKET server_socket = socket(AF_INET, SOCK_STREAM, 0);
     if (server_socket == INVALID_SOCKET) {
         sock_err("Creating server socket");
@@ -62,7 +460,7 @@ _Noreturn void *server_handler(void *arg) {
         sock_err("Binding server socket");
     }
 
-    if (listen(server_socket, SERVER_QUEUE) == SOCKET_ERROR) {
+    if (listen(server_socket, options->backlog) == SOCKET_ERROR) {
         sock_err("Setting server socket as listener");
     }
 
@@ -86,6 +484,7 @@ _Noreturn void *server_handler(void *arg) {
                 &client_handler,
                 client
         );
+        pthread_detach(client->thread_id);
     }
 }
 
@@ -93,23 +492,32 @@ void *client_handler(void *arg) {
 
     struct client_t *client = (struct client_t *) arg;
 
-    printf("Accepted connection for client #%d\n", client->socket);
+    SERVER_LOG(
+            SERVER_LOG_INFO,
+            "Accepted connection for client #%d",
+            client->socket
+    );
+
+    char buffer[STATS_SIZE];
 
-    char buffer[1024];
+    // A client not reading its replies can't hold its thread forever
+    DWORD timeout = SEND_TIMEOUT;
+    setsockopt(
+            client->socket, SOL_SOCKET, SO_SNDTIMEO,
+            (const char *) &timeout, sizeof timeout
+    );
 
     ssize_t n;
     while ((n = recvfrom(
             client->socket,
-            buffer, sizeof buffer - 1,
+            buffer, REQUEST_SIZE - 1,
             0,
             (SOCKADDR *) &client->addr,
             &client->addr_len
     )) > 0) {
         buffer[n] = '\0';
 
-        printf("Request submitted by client #%d : %s\n", client->socket, buffer);
-        user_database_request(buffer);
-        printf("Database response : %s\n", buffer);
+        execute(buffer);
 
         if (sendto(
                 client->socket,
@@ -118,18 +526,1004 @@ void *client_handler(void *arg) {
                 (SOCKADDR *) &client->addr,
                 client->addr_len
         ) <= 0) {
-            sock_err("Sending data to client");
+            SERVER_LOG(
+                    SERVER_LOG_WARN,
+                    "Sending data to client #%d failed",
+                    client->socket
+            );
+            break;
         }
     }
 
 
-    printf("Client #%d disconnected\n", client->socket);
+    SERVER_LOG(
+            SERVER_LOG_INFO,
+            "Client #%d disconnected",
+            client->socket
+    );
+    closesocket(client->socket);
     free(client);
     pthread_exit(EXIT_SUCCESS);
 }
 
+#elif defined(linux)
+
+_Noreturn void *server_handler(void *arg) {
+
+    const struct server_options *options = arg;
+    size_t count = (options->reactors > 0) ? options->reactors : 1;
+    size_t workers = (options->workers > 0) ? options->workers
+                                            : worker_pool_cores();
+
+    // Each connection holds a descriptor : allows as many as permitted
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0
+        && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    if (worker_pool_start(workers) < 0) {
+        fprintf(stderr, "Failed to start %zu workers\n", workers);
+        exit(EXIT_FAILURE);
+    }
+
+    settings = *options;
+    message_queue_limit(options->memory_limit);
+
+    if (options->channel != 0) {
+        channel = message_channel_create(options->channel);
+        if (channel == NULL) {
+            perror("Creating message channel");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (options->history != NULL) {
+        history = message_history_open(options->history);
+        if (history == NULL) {
+            perror("Opening message history");
+            exit(EXIT_FAILURE);
+        }
+        // The history is sent with sendfile, which has no MSG_NOSIGNAL
+        signal(SIGPIPE, SIG_IGN);
+    }
+
+    reactors = calloc(count, sizeof *reactors);
+    if (reactors == NULL) {
+        fprintf(stderr, "Failed to allocate %zu reactors\n", count);
+        exit(EXIT_FAILURE);
+    }
+    reactor_count = count;
+
+    for (size_t r = 0; r < count; r++) {
+        struct reactor *reactor = &reactors[r];
+        reactor->number = r;
+        reactor->listener = open_listener(options->backlog);
+        reactor->buffer = malloc(READ_SIZE);
+        reactor->epoll = epoll_create1(EPOLL_CLOEXEC);
+        reactor->wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (reactor->epoll < 0 || reactor->wakeup < 0) {
+            sock_err("Creating event queue");
+        }
+        if (reactor->buffer == NULL) {
+            fprintf(stderr, "Failed to allocate reactor buffers\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // The listener is told apart from connections by its null pointer,
+        // the event counter by the reactor pointer
+        struct epoll_event event = {.events = EPOLLIN | EPOLLET};
+        event.data.ptr = NULL;
+        if (epoll_ctl(
+                reactor->epoll, EPOLL_CTL_ADD,
+                reactor->listener,
+                &event
+        ) < 0) {
+            sock_err("Watching server socket");
+        }
+        event.data.ptr = reactor;
+        if (epoll_ctl(
+                reactor->epoll, EPOLL_CTL_ADD,
+                reactor->wakeup,
+                &event
+        ) < 0) {
+            sock_err("Watching event counter");
+        }
+    }
+
+    for (size_t r = 1; r < count; r++) {
+        if (pthread_create(
+                &reactors[r].thread, NULL,
+                &react,
+                &reactors[r]
+        ) != 0) {
+            perror("Creating reactor thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    SERVER_LOG(
+            SERVER_LOG_INFO,
+            "%zu reactors serving port %d, backlog %d, %zu workers",
+            count, SERVER_PORT, options->backlog, workers
+    );
+
+    // The first reactor runs in this thread
+    react(&reactors[0]);
+    exit(EXIT_FAILURE);
+}
+
+SOCKET open_listener(int backlog) {
+
+    SOCKET listener = socket(
+            AF_INET,
+            SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+            0
+    );
+    if (listener == INVALID_SOCKET) {
+        sock_err("Creating server socket");
+    }
+
+    int enable = 1;
+    if (setsockopt(
+            listener, SOL_SOCKET, SO_REUSEADDR,
+            &enable, sizeof enable
+    ) == SOCKET_ERROR || setsockopt(
+            listener, SOL_SOCKET, SO_REUSEPORT,
+            &enable, sizeof enable
+    ) == SOCKET_ERROR) {
+        sock_err("Sharing server socket port");
+    }
+
+    SOCKADDR_IN sin = {
+            .sin_addr.s_addr = htonl(INADDR_ANY),
+            .sin_family = AF_INET,
+            .sin_port = htons(SERVER_PORT)
+    };
+
+    if (bind(listener, (SOCKADDR *) &sin, sizeof sin) == SOCKET_ERROR) {
+        sock_err("Binding server socket");
+    }
+
+    if (listen(listener, backlog) == SOCKET_ERROR) {
+        sock_err("Setting server socket as listener");
+    }
+
+    return listener;
+}
+
+void *react(void *arg) {
+
+    struct reactor *reactor = arg;
+    struct epoll_event events[EVENTS_SIZE];
+
+    while (1) {
+        int count = epoll_wait(reactor->epoll, events, EVENTS_SIZE, -1);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            sock_err("Waiting for events");
+        }
+
+        for (int i = 0; i < count; i++) {
+            struct connection *connection = events[i].data.ptr;
+
+            if (connection == NULL) {
+                accept_all(reactor);
+                continue;
+            }
+            if (events[i].data.ptr == reactor) {
+                complete(reactor);
+                continue;
+            }
+            if (connection->closed) continue;
+
+            int res = 0;
+            if (events[i].events & EPOLLOUT) {
+                res = flush(connection);
+            }
+            if (res == 0 && events[i].events & (EPOLLIN | EPOLLRDHUP)) {
+                res = receive(connection);
+            }
+            if (res < 0 || events[i].events & (EPOLLERR | EPOLLHUP)) {
+                disconnect(connection);
+            }
+        }
+
+        while (reactor->closed != NULL) {
+            struct connection *next = reactor->closed->next;
+            free(reactor->closed);
+            reactor->closed = next;
+        }
+    }
+
+    return NULL;
+}
+
+void accept_all(struct reactor *reactor) {
+
+    while (1) {
+        SOCKET socket = accept4(
+                reactor->listener,
+                NULL, NULL,
+                SOCK_NONBLOCK | SOCK_CLOEXEC
+        );
+        if (socket == INVALID_SOCKET) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                SERVER_LOG(
+                        SERVER_LOG_WARN,
+                        "Accepting incoming client connection: %s",
+                        strerror(errno)
+                );
+            }
+            return;
+        }
+
+        struct connection *connection = calloc(1, sizeof *connection);
+        if (connection == NULL) {
+            SERVER_LOG(SERVER_LOG_WARN, "Failed to allocate a connection");
+            closesocket(socket);
+            continue;
+        }
+        connection->socket = socket;
+        connection->reactor = reactor;
+        connection->queued_tail = &connection->queued;
+
+        struct epoll_event event = {
+                .events = EPOLLIN | EPOLLRDHUP | EPOLLET,
+                .data.ptr = connection
+        };
+        if (epoll_ctl(reactor->epoll, EPOLL_CTL_ADD, socket, &event) < 0) {
+            SERVER_LOG(
+                    SERVER_LOG_WARN,
+                    "Watching client connection: %s",
+                    strerror(errno)
+            );
+            disconnect(connection);
+            continue;
+        }
+
+        SERVER_LOG(
+                SERVER_LOG_INFO,
+                "Accepted connection for client #%d",
+                connection->socket
+        );
+    }
+}
+
+int receive(struct connection *connection) {
+
+    char *buffer = connection->reactor->buffer;
+    int drained = 0;
+
+    // Edge-triggered : reads until the socket is drained, unless the
+    // connection has too many commands or too much data waiting
+    while (!connection->paused && !connection->throttled) {
+        ssize_t n = recv(connection->socket, buffer, READ_SIZE, 0);
+        if (n == 0) return -1;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                drained = 1;
+                break;
+            }
+            return -1;
+        }
+        if (feed(connection, buffer, (size_t) n) < 0) return -1;
+    }
+
+    // Former clients don't end their commands
+    if (drained && !connection->framed && connection->in_length > 0) {
+        int res = submit(connection, connection->in, connection->in_length, 0);
+        free(connection->in);
+        connection->in = NULL;
+        connection->in_length = 0;
+        return res;
+    }
+
+    return 0;
+}
+
+int feed(
+        struct connection *connection,
+        const char *data,
+        size_t length
+) {
+    const char *end;
+    while ((end = memchr(data, '\n', length)) != NULL) {
+        size_t line = (size_t) (end - data);
+        int res;
+
+        connection->framed = 1;
+        if (connection->in == NULL) {
+            res = submit(connection, data, line, 1);
+        } else {
+            // Completes the partial command, up to the size of a command
+            size_t room = REQUEST_SIZE - 1 - connection->in_length;
+            if (line < room) room = line;
+            memcpy(connection->in + connection->in_length, data, room);
+            res = submit(
+                    connection,
+                    connection->in, connection->in_length + room,
+                    1
+            );
+            free(connection->in);
+            connection->in = NULL;
+            connection->in_length = 0;
+        }
+        if (res < 0) return -1;
+
+        length -= line + 1;
+        data = end + 1;
+    }
+
+    if (length == 0) return 0;
+
+    if (connection->in == NULL) {
+        connection->in = malloc(REQUEST_SIZE);
+        if (connection->in == NULL) return -1;
+    }
+
+    // Longer commands are truncated
+    size_t room = REQUEST_SIZE - 1 - connection->in_length;
+    if (length < room) room = length;
+    memcpy(connection->in + connection->in_length, data, room);
+    connection->in_length += room;
+
+    return 0;
+}
+
+int submit(
+        struct connection *connection,
+        const char *command,
+        size_t length,
+        int framed
+) {
+    if (length > REQUEST_SIZE - 1) length = REQUEST_SIZE - 1;
+    if (length > 0 && command[length - 1] == '\r') length--;
+    if (length == 0) return 0;
+
+    struct request *request = malloc(sizeof *request + length);
+    if (request == NULL) return -1;
+
+    request->task.run = &serve;
+    request->connection = connection;
+    request->next = NULL;
+    request->framed = framed;
+    request->length = length;
+    memcpy(request->data, command, length);
+
+    SERVER_LOG(
+            SERVER_LOG_DEBUG,
+            "Request submitted by client #%d : %.*s",
+            connection->socket, (int) length, command
+    );
+
+    *connection->queued_tail = request;
+    connection->queued_tail = &request->next;
+    connection->queued_count++;
+
+    if (start(connection) < 0) return -1;
+    if (connection->queued_count >= PIPELINE_SIZE) connection->paused = 1;
+    return 0;
+}
+
+int start(struct connection *connection) {
+
+    while (!connection->running && connection->queued != NULL) {
+        struct request *request = connection->queued;
+
+        connection->queued = request->next;
+        if (connection->queued == NULL) {
+            connection->queued_tail = &connection->queued;
+        }
+        connection->queued_count--;
+
+        const struct local_command *command = find_local(request);
+        if (command == NULL) {
+            connection->running = 1;
+            worker_pool_submit(&request->task);
+            return 0;
+        }
+
+        int res = command->run(connection, request);
+        free(request);
+        if (res < 0) return -1;
+    }
+
+    return 0;
+}
+
+const struct local_command *find_local(const struct request *request) {
+
+    size_t count = sizeof local_commands / sizeof *local_commands;
+
+    for (size_t i = 0; i < count; i++) {
+        size_t length = strlen(local_commands[i].name);
+        if (request->length >= length
+            && strncasecmp(request->data, local_commands[i].name, length) == 0
+            && (request->length == length || request->data[length] == ' ')) {
+            return &local_commands[i];
+        }
+    }
+    return NULL;
+}
+
+int chat(struct connection *connection, struct request *request) {
+
+    char reply[REQUEST_SIZE];
+    const char *text = request->data + 4;
+    size_t length = request->length - 4;
+
+    while (length > 0 && *text == ' ') {
+        text++;
+        length--;
+    }
+
+    if (connection->user == 0) {
+        strcpy(reply, "Log in to send messages.");
+    } else if (length == 0) {
+        strcpy(reply, "Missing arguments.");
+    } else {
+        // Encoded once in place, shared by every user it reaches
+        struct message *message = message_alloc(length + 64);
+        if (message == NULL) {
+            strcpy(reply, "Failed to send the message.");
+        } else {
+            // Pushed in the order of their numbers, the same on every
+            // connection as in the history
+            pthread_mutex_lock(&sequence_lock);
+
+            uint64_t number = (history != NULL)
+                              ? message_history_next(history) : ++sequence;
+            message->length = (size_t) snprintf(
+                    message->data, message->length,
+                    "[%llu] User #%llu : %.*s\n",
+                    (unsigned long long) number,
+                    (unsigned long long) connection->user, (int) length, text
+            );
+            // A number the history did not keep is given to the next one
+            if (history != NULL && message_history_append(
+                    history,
+                    message->data, message->length
+            ) == 0) {
+                pthread_mutex_unlock(&sequence_lock);
+                SERVER_LOG(
+                        SERVER_LOG_WARN,
+                        "Failed to keep message #%llu in the history",
+                        (unsigned long long) number
+                );
+                message_release(message);
+                strcpy(reply, "Failed to send the message.");
+            } else {
+                if (channel != NULL) {
+                    message_channel_publish(
+                            channel,
+                            message->data, message->length
+                    );
+                }
+                broadcast(message);
+
+                pthread_mutex_unlock(&sequence_lock);
+                strcpy(reply, "Message sent.");
+            }
+        }
+    }
+
+    size_t size = strlen(reply);
+    if (request->framed) reply[size++] = '\n';
+
+    return send_all(connection, reply, size);
+}
+
+int replay(struct connection *connection, struct request *request) {
+
+    char reply[REQUEST_SIZE];
+    char arguments[32];
+    const char *text = request->data + 7;
+    size_t length = request->length - 7;
+
+    while (length > 0 && *text == ' ') {
+        text++;
+        length--;
+    }
+
+    unsigned long long count = REPLAY_DEFAULT;
+    unsigned long long since = 0;
+    int after = 0; // Whether the messages after a number are asked
+    int parsed = 0;
+
+    if (length < sizeof arguments) {
+        memcpy(arguments, text, length);
+        arguments[length] = '\0';
+
+        int end = 0;
+        if (length == 0) {
+            parsed = 1;
+        } else if (sscanf(arguments, "since %llu%n", &since, &end) == 1) {
+            parsed = (size_t) end == length;
+            after = 1;
+        } else if (sscanf(arguments, "%llu%n", &count, &end) == 1) {
+            parsed = (size_t) end == length && count > 0;
+        }
+    }
+
+    if (history == NULL) {
+        strcpy(reply, "History disabled.");
+    } else if (!parsed) {
+        strcpy(reply, "Invalid arguments.");
+    } else {
+        uint64_t next = message_history_next(history);
+        uint64_t from;
+
+        if (count > REPLAY_MAX) count = REPLAY_MAX;
+        if (after) {
+            from = (since < next) ? since + 1 : next;
+        } else {
+            from = (next > count) ? next - count : 1;
+        }
+        uint64_t to = from + REPLAY_MAX;
+
+        struct message_history_span spans[REPLAY_SPANS];
+        size_t found = message_history_replay(
+                history,
+                from, to,
+                spans, REPLAY_SPANS
+        );
+
+        // Sent once the socket is writable, behind the data already waiting
+        size_t pushed = 0;
+        while (pushed < found && message_queue_push_file(
+                &connection->out,
+                spans[pushed].fd,
+                spans[pushed].offset,
+                spans[pushed].length
+        ) == 0) {
+            pushed++;
+        }
+        for (size_t i = pushed; i < found; i++) close(spans[i].fd);
+
+        if (pushed < found) {
+            strcpy(reply, "Failed to replay the history.");
+        } else if (found == 0) {
+            strcpy(reply, "No message to replay.");
+        } else {
+            strcpy(reply, "History replayed.");
+        }
+    }
+
+    size_t size = strlen(reply);
+    if (request->framed) reply[size++] = '\n';
+
+    return send_all(connection, reply, size);
+}
+
+void serve(struct worker_task *task) {
+
+    struct request *request = (struct request *) task;
+    char buffer[STATS_SIZE];
+
+    // The reply is rendered within the request, a newline past the end
+    if (request->length != 5
+        || strncasecmp(request->data, "stats", 5) != 0) {
+        struct request *pending = realloc(
+                request,
+                sizeof *pending + REQUEST_SIZE + 1
+        );
+        if (pending != NULL) {
+            pending->data[pending->length] = '\0';
+            user_database_request_async(pending->data, &answered, pending);
+            return;
+        }
+    }
+
+    // Stats, or memory short : runs the command in this worker
+    memcpy(buffer, request->data, request->length);
+    buffer[request->length] = '\0';
+    request->opcode = 0;
+
+    execute(buffer);
+
+    size_t length = strlen(buffer);
+    if (request->framed) buffer[length++] = '\n';
+
+    // Keeps the reply within the command if memory is short
+    struct request *reply = realloc(request, sizeof *request + length);
+    if (reply == NULL) {
+        if (length > request->length) length = request->length;
+        reply = request;
+    }
+    memcpy(reply->data, buffer, length);
+    reply->length = length;
+
+    post(reply);
+}
+
+void answered(
+        char *buffer,
+        const struct user_message *outcome,
+        void *arg
+) {
+    struct request *request = arg;
+
+    SERVER_LOG(SERVER_LOG_DEBUG, "Database response : %s", buffer);
+
+    request->opcode = outcome->opcode;
+    request->status = outcome->status;
+    request->user = outcome->user_id;
+
+    request->length = strlen(buffer);
+    if (request->framed) buffer[request->length++] = '\n';
+
+    post(request);
+}
+
+void post(struct request *request) {
+
+    struct reactor *reactor = request->connection->reactor;
+
+    request->next = atomic_load(&reactor->done);
+    while (!atomic_compare_exchange_weak(
+            &reactor->done,
+            &request->next, request
+    ));
+
+    wake(reactor);
+}
+
+void broadcast(struct message *message) {
+
+    for (size_t r = 0; r < reactor_count; r++) {
+        struct reactor *reactor = &reactors[r];
+
+        struct delivery *delivery = malloc(sizeof *delivery);
+        if (delivery == NULL) {
+            SERVER_LOG(
+                    SERVER_LOG_WARN,
+                    "Failed to post a message to reactor %zu",
+                    reactor->number
+            );
+            continue;
+        }
+        message_acquire(message, 1);
+        delivery->message = message;
+
+        delivery->next = atomic_load(&reactor->inbox);
+        while (!atomic_compare_exchange_weak(
+                &reactor->inbox,
+                &delivery->next, delivery
+        ));
+
+        wake(reactor);
+    }
+
+    message_release(message);
+}
+
+void wake(struct reactor *reactor) {
+
+    uint64_t signal = 1;
+    if (write(reactor->wakeup, &signal, sizeof signal) < 0
+        && errno != EAGAIN) {
+        SERVER_LOG(SERVER_LOG_ERROR, "Waking reactor %zu up", reactor->number);
+    }
+}
+
+void complete(struct reactor *reactor) {
+
+    // Resets the counter before taking the replies : those posted afterwards
+    // signal it again
+    uint64_t signals;
+    if (read(reactor->wakeup, &signals, sizeof signals) < 0
+        && errno != EAGAIN) {
+        sock_err("Reading event counter");
+    }
+
+    struct request *reply = atomic_exchange(&reactor->done, NULL);
+    while (reply != NULL) {
+        struct request *next = reply->next;
+        struct connection *connection = reply->connection;
+
+        connection->running = 0;
+        if (connection->closed) {
+            connection->next = reactor->closed;
+            reactor->closed = connection;
+            free(reply);
+            reply = next;
+            continue;
+        }
+
+        if (reply->opcode == USER_OP_LOGIN
+            && reply->status == USER_STATUS_OK) {
+            log_in(connection, reply->user);
+        } else if ((reply->opcode == USER_OP_LOGOUT
+                    || reply->opcode == USER_OP_DELETE)
+                   && reply->status == USER_STATUS_OK
+                   && reply->user == connection->user) {
+            log_out(connection);
+        }
+
+        int res = send_all(connection, reply->data, reply->length);
+        free(reply);
+        reply = next;
+
+        if (res == 0) res = start(connection);
+        if (res == 0) {
+            if (connection->paused
+                && connection->queued_count <= PIPELINE_SIZE / 2) {
+                connection->paused = 0;
+                res = receive(connection);
+            }
+        }
+        if (res < 0) disconnect(connection);
+    }
+
+    deliver(reactor);
+}
+
+void deliver(struct reactor *reactor) {
+
+    struct delivery *posted = atomic_exchange(&reactor->inbox, NULL);
+    if (posted == NULL) return;
+
+    // Pushes the messages in the order they were posted
+    struct delivery *delivery = NULL;
+    while (posted != NULL) {
+        struct delivery *next = posted->next;
+        posted->next = delivery;
+        delivery = posted;
+        posted = next;
+    }
+
+    while (delivery != NULL) {
+        struct delivery *next = delivery->next;
+
+        // Former clients expect nothing but the replies to their commands
+        for (size_t i = 0; i < reactor->online_count; i++) {
+            struct connection *connection = reactor->online[i];
+            if (connection->framed) {
+                message_queue_push(&connection->out, delivery->message, 1);
+            }
+        }
+
+        message_release(delivery->message);
+        free(delivery);
+        delivery = next;
+    }
+
+    // Sends the messages pushed together, from the last connection as a
+    // disconnected one is replaced by the last
+    for (size_t i = reactor->online_count; i-- > 0;) {
+        struct connection *connection = reactor->online[i];
+        if (connection->out == NULL) continue;
+
+        int res = connection->writing ? 0 : flush(connection);
+        if (res == 0) res = backpressure(connection);
+        if (res < 0) disconnect(connection);
+    }
+}
+
+void log_in(struct connection *connection, uint64_t user) {
+
+    struct reactor *reactor = connection->reactor;
+
+    if (connection->user == 0) {
+        if (reactor->online_count == reactor->online_size) {
+            size_t size = (reactor->online_size > 0)
+                          ? 2 * reactor->online_size : ONLINE_SIZE;
+            struct connection **online = realloc(
+                    reactor->online,
+                    size * sizeof *online
+            );
+            if (online == NULL) {
+                SERVER_LOG(
+                        SERVER_LOG_WARN,
+                        "Failed to register client #%d as logged in",
+                        connection->socket
+                );
+                return;
+            }
+            reactor->online = online;
+            reactor->online_size = size;
+        }
+        connection->online_index = reactor->online_count;
+        reactor->online[reactor->online_count++] = connection;
+    }
+
+    connection->user = user;
+}
+
+void log_out(struct connection *connection) {
+
+    struct reactor *reactor = connection->reactor;
+
+    if (connection->user == 0) return;
+
+    struct connection *last = reactor->online[--reactor->online_count];
+    reactor->online[connection->online_index] = last;
+    last->online_index = connection->online_index;
+
+    connection->user = 0;
+}
+
+int send_all(
+        struct connection *connection,
+        const char *data,
+        size_t length
+) {
+    size_t sent = 0;
+
+    // Keeps the order of the replies behind the data already waiting
+    while (connection->out == NULL && sent < length) {
+        ssize_t n = send(
+                connection->socket,
+                data + sent, length - sent,
+                MSG_NOSIGNAL
+        );
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        sent += (size_t) n;
+    }
+
+    if (sent == length) return 0;
+
+    struct message *rest = message_create(data + sent, length - sent);
+    if (rest == NULL) return -1;
+    int res = message_queue_push(&connection->out, rest, 0);
+    message_release(rest);
+    if (res < 0) return -1;
+
+    watch(connection, 1);
+    return backpressure(connection);
+}
+
+int flush(struct connection *connection) {
+
+    int res = message_queue_flush(&connection->out, connection->socket);
+    if (res < 0) return -1;
+
+    watch(connection, res);
+
+    if (connection->throttled && message_queue_bytes(
+            connection->out
+    ) <= settings.low_watermark) {
+        connection->throttled = 0;
+        return receive(connection);
+    }
+    return 0;
+}
+
+int backpressure(struct connection *connection) {
+
+    if (message_queue_bytes(connection->out) < settings.high_watermark) {
+        return 0;
+    }
+
+    switch (settings.policy) {
+        case SERVER_POLICY_DISCONNECT:
+            SERVER_LOG(
+                    SERVER_LOG_WARN,
+                    "Client #%d reads too slowly, disconnecting",
+                    connection->socket
+            );
+            return -1;
+        case SERVER_POLICY_DROP:
+            // Its replies alone may still pass the watermark
+            message_queue_drop(&connection->out, settings.low_watermark);
+            if (message_queue_bytes(
+                    connection->out
+            ) < settings.high_watermark) {
+                return 0;
+            }
+            // Fall through
+        default:
+            connection->throttled = 1;
+            return 0;
+    }
+}
+
+void watch(struct connection *connection, int writing) {
+
+    if (connection->writing == writing) return;
+
+    struct epoll_event event = {
+            .events = EPOLLIN | EPOLLRDHUP | EPOLLET | (writing ? EPOLLOUT : 0),
+            .data.ptr = connection
+    };
+    epoll_ctl(
+            connection->reactor->epoll, EPOLL_CTL_MOD,
+            connection->socket,
+            &event
+    );
+    connection->writing = writing;
+}
+
+void disconnect(struct connection *connection) {
+
+    SERVER_LOG(
+            SERVER_LOG_INFO,
+            "Client #%d disconnected",
+            connection->socket
+    );
+
+    // Closing the socket removes it from the event queue
+    closesocket(connection->socket);
+    free(connection->in);
+    message_queue_clear(&connection->out);
+    log_out(connection);
+
+    while (connection->queued != NULL) {
+        struct request *next = connection->queued->next;
+        free(connection->queued);
+        connection->queued = next;
+    }
+
+    connection->closed = 1;
+    connection->socket = INVALID_SOCKET;
+    connection->in = NULL;
+
+    // The reply of the running command still refers to the connection
+    if (!connection->running) {
+        connection->next = connection->reactor->closed;
+        connection->reactor->closed = connection;
+    }
+}
+
+#endif
+
+int server_policy_parse(const char *name) {
+
+    if (strcmp(name, "drop") == 0) return SERVER_POLICY_DROP;
+    if (strcmp(name, "disconnect") == 0) return SERVER_POLICY_DISCONNECT;
+    if (strcmp(name, "pause") == 0) return SERVER_POLICY_PAUSE;
+    return -1;
+}
+
 /* -------------------------------------------------------------------------- */
 
+void execute(char *buffer) {
+
+    if (strcasecmp(buffer, "stats") == 0) {
+        stats(buffer, STATS_SIZE);
+    } else {
+        user_database_request(buffer);
+    }
+    SERVER_LOG(SERVER_LOG_DEBUG, "Database response : %s", buffer);
+}
+
+void stats(char *buffer, size_t size) {
+
+    char service[REQUEST_SIZE] = "stats";
+    user_database_request(service);
+
+    // Each section is given the room left, which never reaches the end
+    size_t length = 0;
+    server_metrics_print(buffer, size, &length, "Central server :\n");
+    length += server_metrics_render(buffer + length, size - length);
+    server_metrics_print(buffer, size, &length, "\n");
+    length += worker_pool_render(buffer + length, size - length);
+    server_metrics_print(buffer, size, &length, "\n");
+    length += user_database_render(buffer + length, size - length);
+    server_metrics_print(buffer, size, &length, "\n");
+    length += message_queue_render(buffer + length, size - length);
+    if (history != NULL) {
+        server_metrics_print(buffer, size, &length, "\n");
+        length += message_history_render(
+                history,
+                buffer + length, size - length
+        );
+    }
+    server_metrics_print(
+            buffer, size, &length,
+            "\nAccount service :\n%s",
+            service
+    );
+}
+
 void sock_err(char *action) {
 #ifdef WIN32
     int err_code = WSAGetLastError();
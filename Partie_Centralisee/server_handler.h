@@ -1,6 +1,87 @@
 #ifndef CLIENT_HANDLER_H
 #define CLIENT_HANDLER_H
 
+#include <stddef.h>
+
+/**
+ * Default length of the queue of connections waiting to be accepted.
+ */
+#define SERVER_BACKLOG 4096
+
+/**
+ * Default number of threads serving the connections.
+ */
+#define SERVER_REACTORS 4
+
+/**
+ * Default bytes waiting to be sent to a connection past which the slow
+ * consumer policy applies.
+ */
+#define SERVER_HIGH_WATERMARK (256 * 1024)
+
+/**
+ * Default bytes waiting to be sent to a connection below which it is read
+ * again, and down to which its messages are dropped.
+ */
+#define SERVER_LOW_WATERMARK (64 * 1024)
+
+/**
+ * Default memory the messages waiting to be sent may use at most.
+ */
+#define SERVER_MEMORY_LIMIT (256 * 1024 * 1024)
+
+/**
+ * Connections past their high watermark lose their oldest messages, down to
+ * their low watermark. Reads pause if their replies alone pass it.
+ */
+#define SERVER_POLICY_DROP 0
+
+/**
+ * Connections past their high watermark are closed.
+ */
+#define SERVER_POLICY_DISCONNECT 1
+
+/**
+ * Connections past their high watermark are no longer read until their data
+ * drops below their low watermark. Their messages are kept, within the
+ * memory limit.
+ */
+#define SERVER_POLICY_PAUSE 2
+
+/**
+ * Settings of the server.
+ */
+struct server_options {
+    int backlog; // Length of the queue of connections waiting to be accepted
+    size_t reactors; // Number of event loops, ignored on Windows
+    size_t workers; // Number of threads running the commands, 0 for one per
+                    // core, ignored on Windows
+    size_t high_watermark; // Ignored on Windows, as the following
+    size_t low_watermark;
+    int policy; // Handling of slow consumers, as SERVER_POLICY_*
+    size_t memory_limit;
+    int channel; // Backend the messages sent are published to for the other
+                 // processes, 0 for none
+    const char *history; // Directory the messages sent are kept in, NULL for
+                         // none, ignored on Windows
+};
+
+/**
+ * Parses the name of a slow consumer policy : drop, disconnect or pause.
+ *
+ * @return the policy, or -1 if unknown
+ */
+extern int server_policy_parse(const char *name);
+
+/**
+ * Serves the clients of the central server. On Linux, the connections are
+ * spread over a fixed number of event loops, each with its own listening
+ * socket, and an idle connection holds no buffer. The commands read are run
+ * by a pool of workers, so that the loops never wait for the account service.
+ * On Windows, each client is served by its own thread.
+ *
+ * @param arg the server_options
+ */
 _Noreturn void *server_handler(void *arg);
 
 #endif
@@ -3,6 +3,7 @@
 #include <winsock2.h>
 #include <windows.h>
 #include <ws2tcpip.h>
+#define SOCKET_TIMED_OUT() (WSAGetLastError() == WSAETIMEDOUT)
 
 #elif defined(linux)
 
@@ -17,6 +18,8 @@ typedef int SOCKET;
 typedef struct sockaddr_in SOCKADDR_IN;
 typedef struct sockaddr SOCKADDR;
 typedef struct in_addr IN_ADDR;
+#define SOCKET_TIMED_OUT() \
+    (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
 
 #else
 
@@ -27,11 +30,94 @@ typedef struct in_addr IN_ADDR;
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <pthread.h>
 #include "user_database_handler.h"
+#include "user_database_protocol.h"
+#include "server_log.h"
+#include "server_metrics.h"
 
 #define DATABASE_ADDR "localhost"
 #define DATABASE_PORT 24030
 
+/**
+ * Size of the buffer of a request, as given by the callers.
+ */
+#define REQUEST_SIZE 1024
+
+/**
+ * Time to wait for a reply before sending the request again, in milliseconds.
+ * The time doubles at each retry.
+ */
+#define DATABASE_TIMEOUT 200
+
+/**
+ * Number of times a request is sent again before giving up. The account
+ * service replays the reply of a request it already ran, so that retrying is
+ * safe for every command.
+ */
+#define DATABASE_RETRIES 4
+
+/**
+ * Interval at which the replies overdue are looked for, in milliseconds.
+ */
+#define DATABASE_TICK 50
+
+/**
+ * Time the replies of read-only commands are kept, in milliseconds.
+ */
+#define DATABASE_CACHE_TTL 500
+
+/**
+ * Number of buckets of the table of the datagrams waiting for a reply.
+ */
+#define FLIGHT_BUCKETS 256
+
+/**
+ * Request waiting to be sent to the account service, or for its reply.
+ */
+struct pending {
+    struct user_message message; // Points into the command
+    char command[REQUEST_SIZE];
+    char *request; // The command as input, its reply as output
+    uint64_t begin; // Time the request was submitted
+    void (*done)( // Called once the reply is rendered
+            char *request,
+            const struct user_message *outcome,
+            void *arg
+    );
+    void *arg;
+    int owned; // Whether the entry is to be freed once answered
+    int finished; // Whether a waiting caller got its reply, set under the lock
+    uint64_t generation; // Generation of the cache when sent
+    struct pending *next;
+};
+
+/**
+ * Reply of a read-only command, served without reaching the account service
+ * until it expires, or a command changes the users connected.
+ */
+struct cached {
+    uint8_t opcode;
+    uint64_t expires; // Time it expires, in milliseconds, 0 if empty
+    char reply[REQUEST_SIZE];
+};
+
+/**
+ * Datagram sent to the account service, waiting for its reply. It holds a
+ * single request, or a batch of them.
+ */
+struct flight {
+    uint32_t id; // Id of the datagram, that of its reply
+    unsigned attempt; // Number of times it was sent again
+    uint64_t deadline; // Time it is sent again, in milliseconds
+    struct pending *batch;
+    struct flight *next; // In its bucket
+    size_t length;
+    char datagram[REQUEST_SIZE];
+};
+
 /**
  * Displays a message corresponding to the last error, depending on the
  * implementation given by the platform.
@@ -40,10 +126,178 @@ typedef struct in_addr IN_ADDR;
  */
 static void sock_err(char *action);
 
+/**
+ * Queues requests, their callbacks being called once answered. The first
+ * thread finding no other one sending sends every queued request, its own and
+ * the ones queued meanwhile by other threads, in as few datagrams as
+ * possible. Malformed requests are answered at once.
+ *
+ * @param entries the requests
+ * @param count number of requests
+ */
+static void submit(struct pending *entries, size_t count);
+
+/**
+ * Takes from the queue the requests fitting a single datagram. To be called
+ * with the lock held.
+ *
+ * @return the list of requests
+ */
+static struct pending *take();
+
+/**
+ * Encodes requests in a datagram, and adds it to the table of the datagrams
+ * waiting for a reply. To be called with the lock held.
+ *
+ * @param batch the list of requests
+ *
+ * @return the datagram, or NULL if memory is short
+ */
+static struct flight *board(struct pending *batch);
+
+/**
+ * Removes a datagram from the table. To be called with the lock held.
+ *
+ * @param id id of the datagram
+ *
+ * @return the datagram, or NULL if it is not waiting
+ */
+static struct flight *unlink_flight(uint32_t id);
+
+/**
+ * Sends a datagram to the account service.
+ */
+static void transmit(const char *datagram, size_t length);
+
+/**
+ * Receives the replies of the account service, and answers their requests.
+ * Sends again the datagrams whose reply is overdue.
+ */
+static void *receive(void *arg);
+
+/**
+ * Answers the requests of a datagram.
+ *
+ * @param flight the datagram
+ * @param reply its reply
+ */
+static void land(struct flight *flight, const struct user_message *reply);
+
+/**
+ * Sends again the datagrams whose reply is overdue, and answers the requests
+ * of those sent too many times as failed.
+ *
+ * @param now the current time, in milliseconds
+ */
+static void expire(uint64_t now);
+
+/**
+ * Answers a list of requests with a status.
+ */
+static void fail(struct pending *batch, int8_t status);
+
+/**
+ * Renders the reply to a request, keeps it if the command is read-only, and
+ * finishes the request.
+ *
+ * @param entry the request
+ * @param reply its reply
+ */
+static void answer(struct pending *entry, const struct user_message *reply);
+
+/**
+ * Counts a request as served, and calls its callback. The entry may be freed.
+ *
+ * @param entry the request, its reply rendered
+ * @param status status of the reply
+ */
+static void finish(struct pending *entry, int8_t status);
+
+/**
+ * Gets the reply kept for the command of a request.
+ *
+ * @param entry the request
+ *
+ * @return 1 if the reply was rendered, 0 if the command is to be sent
+ */
+static int cache_lookup(struct pending *entry);
+
+/**
+ * Keeps the reply of a read-only command, unless a command changed the users
+ * connected since it was sent. Forgets every reply kept once such a command
+ * succeeds.
+ *
+ * @param entry the request, its reply rendered
+ * @param status status of the reply
+ */
+static void cache_update(const struct pending *entry, int8_t status);
+
+/**
+ * Tells a caller waiting for a request that it was answered.
+ *
+ * @param request the reply
+ * @param outcome the request, with the status of its reply
+ * @param arg the entry of the request
+ */
+static void wake(
+        char *request,
+        const struct user_message *outcome,
+        void *arg
+);
+
+/**
+ * Waits until requests are answered.
+ */
+static void wait_all(struct pending *entries, size_t count);
+
+/**
+ * Gets the current time of a monotonic clock, in milliseconds.
+ */
+static uint64_t now_ms();
+
 static SOCKET database_socket;
 
+/**
+ * Guards the queue and the table : a single thread at a time sends queued
+ * requests.
+ */
+static pthread_mutex_t database_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Signaled when requests of waiting callers are answered. */
+static pthread_cond_t database_done = PTHREAD_COND_INITIALIZER;
+
+static struct pending *queue = NULL;
+
+static struct pending **queue_tail = &queue;
+
+static int sending = 0;
+
+/** Id of the last request. */
+static uint32_t request_id = 0;
+
+/** Datagrams waiting for a reply, by id. */
+static struct flight *flights[FLIGHT_BUCKETS];
+
+static pthread_t receiver;
+
+static atomic_int receiving = 0;
+
 static SOCKADDR_IN to = {0};
 
+/** Guards the replies kept. */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct cached cache[] = {{.opcode = USER_OP_LIST}};
+
+/** Increased whenever the users connected change. */
+static uint64_t cache_generation = 0;
+
+static _Atomic uint64_t cache_hits = 0;
+
+static _Atomic uint64_t cache_misses = 0;
+
+static _Atomic uint64_t cache_invalidations = 0;
+
 void user_database_open() {
 
     database_socket = socket(AF_INET, SOCK_DGRAM, 0);
@@ -60,46 +314,519 @@ void user_database_open() {
     to.sin_addr = *(IN_ADDR *) hostinfo->h_addr;
     to.sin_port = htons(DATABASE_PORT);
     to.sin_family = AF_INET;
+
+    // The receiver wakes up regularly to send the overdue datagrams again
+#ifdef WIN32
+    DWORD delay = DATABASE_TICK;
+#elif defined(linux)
+    struct timeval delay = {.tv_usec = DATABASE_TICK * 1000};
+#endif
+    if (setsockopt(
+            database_socket, SOL_SOCKET, SO_RCVTIMEO,
+            (const char *) &delay, sizeof delay
+    ) < 0) {
+        sock_err("Setting socket timeout");
+    }
+
+    atomic_store(&receiving, 1);
+    if (pthread_create(&receiver, NULL, &receive, NULL) != 0) {
+        perror("Creating receiver thread");
+        exit(EXIT_FAILURE);
+    }
 }
 
 void user_database_close() {
+
+    if (atomic_exchange(&receiving, 0)) pthread_join(receiver, NULL);
+
     closesocket(database_socket);
     to = (SOCKADDR_IN) {0};
 }
 
-int user_database_request(char* request) {
+int user_database_request(char *request) {
+
+    struct pending entry = {.request = request, .done = &wake};
+    entry.arg = &entry;
+
+    submit(&entry, 1);
+    wait_all(&entry, 1);
+
+    return (int) strlen(request);
+}
+
+void user_database_request_batch(char **requests, size_t count) {
+
+    struct pending *entries = calloc(count, sizeof *entries);
+
+    // Sends the requests one by one if memory is short
+    if (entries == NULL) {
+        for (size_t i = 0; i < count; i++) {
+            user_database_request(requests[i]);
+        }
+        return;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        entries[i].request = requests[i];
+        entries[i].done = &wake;
+        entries[i].arg = &entries[i];
+    }
 
-    char buffer[1024];
-    strcpy(buffer, request);
+    submit(entries, count);
+    wait_all(entries, count);
 
-    size_t n = sendto(
+    free(entries);
+}
+
+void user_database_request_async(
+        char *request,
+        void (*done)(
+                char *request,
+                const struct user_message *outcome,
+                void *arg
+        ),
+        void *arg
+) {
+    struct pending *entry = calloc(1, sizeof *entry);
+
+    // Waits for the reply if memory is short, its outcome being unknown
+    if (entry == NULL) {
+        struct user_message unknown = {0};
+        user_database_request(request);
+        done(request, &unknown, arg);
+        return;
+    }
+
+    entry->request = request;
+    entry->done = done;
+    entry->arg = arg;
+    entry->owned = 1;
+
+    submit(entry, 1);
+}
+
+size_t user_database_render(char *buffer, size_t size) {
+
+    int length = snprintf(
+            buffer, size,
+            "Cache : hits %llu, misses %llu, invalidations %llu",
+            (unsigned long long) atomic_load(&cache_hits),
+            (unsigned long long) atomic_load(&cache_misses),
+            (unsigned long long) atomic_load(&cache_invalidations)
+    );
+
+    if (length < 0 || size == 0) return 0;
+    return ((size_t) length < size) ? (size_t) length : size - 1;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void submit(struct pending *entries, size_t count) {
+
+    struct pending *first = NULL;
+    struct pending **last = &first;
+
+    for (size_t i = 0; i < count; i++) {
+        struct pending *entry = &entries[i];
+        entry->begin = server_metrics_begin();
+        strncpy(entry->command, entry->request, sizeof entry->command - 1);
+        entry->command[sizeof entry->command - 1] = '\0';
+
+        // Malformed commands are answered without reaching the service
+        if (user_message_parse(entry->command, &entry->message) < 0) {
+            answer(entry, &entry->message);
+        } else if (!cache_lookup(entry)) {
+            *last = entry;
+            last = &entry->next;
+        }
+    }
+
+    if (first == NULL) return;
+
+    pthread_mutex_lock(&database_lock);
+
+    *queue_tail = first;
+    queue_tail = last;
+
+    if (sending) {
+        pthread_mutex_unlock(&database_lock);
+        return;
+    }
+
+    // Requests queued while a datagram is sent go in the next one
+    sending = 1;
+    while (queue != NULL) {
+        char datagram[REQUEST_SIZE];
+        struct pending *batch = take();
+        struct flight *flight = board(batch);
+
+        if (flight == NULL) {
+            pthread_mutex_unlock(&database_lock);
+            fail(batch, USER_STATUS_INTERNAL_ERROR);
+            pthread_mutex_lock(&database_lock);
+            continue;
+        }
+
+        // The datagram may be answered, and freed, as soon as it is sent
+        size_t length = flight->length;
+        memcpy(datagram, flight->datagram, length);
+
+        pthread_mutex_unlock(&database_lock);
+        transmit(datagram, length);
+        pthread_mutex_lock(&database_lock);
+    }
+    sending = 0;
+
+    pthread_mutex_unlock(&database_lock);
+}
+
+struct pending *take() {
+
+    struct pending *batch = queue;
+    struct pending *last = queue;
+    size_t length = USER_PROTOCOL_HEADER_SIZE + queue->message.length;
+    int listing = (queue->message.opcode == USER_OP_LIST);
+
+    // A list reply may fill the datagram : a batch holds a single list
+    while (last->next != NULL) {
+        const struct user_message *next = &last->next->message;
+        length += USER_PROTOCOL_HEADER_SIZE + next->length;
+        if (length > USER_PROTOCOL_PAYLOAD_MAX
+            || (listing && next->opcode == USER_OP_LIST)) {
+            break;
+        }
+        listing |= (next->opcode == USER_OP_LIST);
+        last = last->next;
+    }
+
+    queue = last->next;
+    if (queue == NULL) queue_tail = &queue;
+    last->next = NULL;
+
+    return batch;
+}
+
+struct flight *board(struct pending *batch) {
+
+    struct flight *flight = malloc(sizeof *flight);
+    if (flight == NULL) return NULL;
+
+    for (struct pending *entry = batch; entry; entry = entry->next) {
+        entry->message.request_id = ++request_id;
+    }
+
+    if (batch->next == NULL) {
+        flight->id = batch->message.request_id;
+        flight->length = user_message_encode(
+                &batch->message,
+                flight->datagram, sizeof flight->datagram
+        );
+    } else {
+        struct user_message message = {
+                .opcode = USER_OP_BATCH,
+                .request_id = ++request_id,
+                .payload = flight->datagram + USER_PROTOCOL_HEADER_SIZE
+        };
+        for (struct pending *entry = batch; entry; entry = entry->next) {
+            message.length += user_message_encode(
+                    &entry->message,
+                    flight->datagram + USER_PROTOCOL_HEADER_SIZE
+                    + message.length,
+                    USER_PROTOCOL_PAYLOAD_MAX - message.length
+            );
+        }
+        flight->id = message.request_id;
+        flight->length = user_message_encode(
+                &message,
+                flight->datagram, sizeof flight->datagram
+        );
+    }
+
+    flight->attempt = 0;
+    flight->deadline = now_ms() + DATABASE_TIMEOUT;
+    flight->batch = batch;
+
+    struct flight **bucket = &flights[flight->id % FLIGHT_BUCKETS];
+    flight->next = *bucket;
+    *bucket = flight;
+
+    return flight;
+}
+
+struct flight *unlink_flight(uint32_t id) {
+
+    struct flight **link = &flights[id % FLIGHT_BUCKETS];
+    while (*link != NULL && (*link)->id != id) {
+        link = &(*link)->next;
+    }
+
+    struct flight *flight = *link;
+    if (flight != NULL) *link = flight->next;
+
+    return flight;
+}
+
+void transmit(const char *datagram, size_t length) {
+
+    // A lost datagram is sent again once its reply is overdue
+    if (sendto(
             database_socket,
-            buffer, (int) strlen(buffer),
+            datagram, (int) length,
             0,
             (SOCKADDR *) &to,
             sizeof to
+    ) < 0) {
+        SERVER_LOG(SERVER_LOG_WARN, "Sending request to the account service");
+    }
+}
+
+void *receive(void *arg) {
+
+    char buffer[REQUEST_SIZE];
+    struct user_message reply;
+    uint64_t check = now_ms() + DATABASE_TICK;
+
+    while (atomic_load(&receiving)) {
+        ssize_t n = recvfrom(
+                database_socket,
+                buffer, sizeof buffer - 1,
+                0,
+                NULL, NULL
+        );
+        if (n < 0 && !SOCKET_TIMED_OUT()) {
+            SERVER_LOG(SERVER_LOG_WARN, "Receiving account service reply");
+        }
+
+        if (n >= 0 && user_message_decode(buffer, (size_t) n, &reply) == 0) {
+            pthread_mutex_lock(&database_lock);
+            struct flight *flight = unlink_flight(reply.request_id);
+            pthread_mutex_unlock(&database_lock);
+
+            // Late replies to datagrams sent again are skipped
+            if (flight != NULL) {
+                land(flight, &reply);
+                free(flight);
+            }
+        }
+
+        uint64_t now = now_ms();
+        if (now >= check) {
+            expire(now);
+            check = now + DATABASE_TICK;
+        }
+    }
+
+    return NULL;
+}
+
+void land(struct flight *flight, const struct user_message *reply) {
+
+    struct user_message result;
+
+    if (reply->opcode != USER_OP_BATCH) {
+        if (flight->batch->next == NULL) {
+            answer(flight->batch, reply);
+            return;
+        }
+
+        // A batch rejected as a whole, as malformed or unknown to the service
+        fail(
+                flight->batch,
+                (reply->status < USER_STATUS_OK) ? reply->status
+                                                 : USER_STATUS_INTERNAL_ERROR
+        );
+        return;
+    }
+
+    // Entries are unlinked before being answered, as they may be freed
+    size_t offset = 0;
+    while (user_message_next(reply->payload, reply->length, &offset,
+                             &result) == 0) {
+        struct pending **link = &flight->batch;
+        while (*link && (*link)->message.request_id != result.request_id) {
+            link = &(*link)->next;
+        }
+        if (*link != NULL) {
+            struct pending *entry = *link;
+            *link = entry->next;
+            answer(entry, &result);
+        }
+    }
+
+    // The requests left out of the reply batch
+    fail(flight->batch, USER_STATUS_INTERNAL_ERROR);
+}
+
+void expire(uint64_t now) {
+
+    struct flight *expired = NULL;
+
+    pthread_mutex_lock(&database_lock);
+
+    for (size_t b = 0; b < FLIGHT_BUCKETS; b++) {
+        struct flight **link = &flights[b];
+        while (*link != NULL) {
+            struct flight *flight = *link;
+
+            if (flight->deadline > now) {
+                link = &flight->next;
+            } else if (flight->attempt < DATABASE_RETRIES) {
+                flight->attempt++;
+                flight->deadline = now + (DATABASE_TIMEOUT << flight->attempt);
+                transmit(flight->datagram, flight->length);
+                link = &flight->next;
+            } else {
+                *link = flight->next;
+                flight->next = expired;
+                expired = flight;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&database_lock);
+
+    while (expired != NULL) {
+        struct flight *next = expired->next;
+        SERVER_LOG(SERVER_LOG_WARN, "Account service unavailable");
+        fail(expired->batch, USER_STATUS_UNAVAILABLE);
+        free(expired);
+        expired = next;
+    }
+}
+
+void fail(struct pending *batch, int8_t status) {
+
+    struct user_message result = {.status = status};
+
+    while (batch != NULL) {
+        struct pending *next = batch->next;
+        answer(batch, &result);
+        batch = next;
+    }
+}
+
+void answer(struct pending *entry, const struct user_message *reply) {
+
+    user_message_render(
+            &entry->message, reply,
+            entry->request, REQUEST_SIZE
     );
-    if (n < 0) {
-        sock_err("Sending request");
+
+    cache_update(entry, reply->status);
+    finish(entry, reply->status);
+}
+
+void finish(struct pending *entry, int8_t status) {
+
+    server_metrics_end(entry->message.opcode, status, entry->begin);
+
+    void (*done)(char *, const struct user_message *, void *) = entry->done;
+    char *request = entry->request;
+    void *arg = entry->arg;
+
+    // The payload points into the entry
+    struct user_message outcome = entry->message;
+    outcome.status = status;
+    outcome.payload = NULL;
+    outcome.length = 0;
+
+    if (entry->owned) free(entry);
+    done(request, &outcome, arg);
+}
+
+int cache_lookup(struct pending *entry) {
+
+    struct cached *cached = NULL;
+    for (size_t c = 0; c < sizeof cache / sizeof *cache; c++) {
+        if (cache[c].opcode == entry->message.opcode) cached = &cache[c];
     }
 
-    n = recvfrom(
-            database_socket,
-            buffer, sizeof buffer - 1,
-            0,
-            NULL, NULL
+    pthread_mutex_lock(&cache_lock);
+    entry->generation = cache_generation;
+    int hit = (cached != NULL && cached->expires > now_ms());
+    if (hit) strcpy(entry->request, cached->reply);
+    pthread_mutex_unlock(&cache_lock);
+
+    if (cached == NULL) return 0;
+
+    atomic_fetch_add_explicit(
+            hit ? &cache_hits : &cache_misses, 1,
+            memory_order_relaxed
     );
-    if (n < 0) {
-        sock_err("Acquiring response");
+    if (hit) finish(entry, USER_STATUS_OK);
+
+    return hit;
+}
+
+void cache_update(const struct pending *entry, int8_t status) {
+
+    uint8_t opcode = entry->message.opcode;
+
+    if (status == USER_STATUS_OK && (opcode == USER_OP_LOGIN
+                                     || opcode == USER_OP_LOGOUT
+                                     || opcode == USER_OP_DELETE)) {
+        pthread_mutex_lock(&cache_lock);
+        cache_generation++;
+        for (size_t c = 0; c < sizeof cache / sizeof *cache; c++) {
+            cache[c].expires = 0;
+        }
+        pthread_mutex_unlock(&cache_lock);
+        atomic_fetch_add_explicit(
+                &cache_invalidations, 1,
+                memory_order_relaxed
+        );
+        return;
     }
 
-    buffer[n] = '\0';
-    strcpy(request, buffer);
+    // Truncated lists are kept too
+    if (status < 0) return;
 
-    return (int) n;
+    pthread_mutex_lock(&cache_lock);
+    for (size_t c = 0; c < sizeof cache / sizeof *cache; c++) {
+        if (cache[c].opcode == opcode
+            && entry->generation == cache_generation) {
+            strncpy(cache[c].reply, entry->request, REQUEST_SIZE - 1);
+            cache[c].reply[REQUEST_SIZE - 1] = '\0';
+            cache[c].expires = now_ms() + DATABASE_CACHE_TTL;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
 }
 
-/* -------------------------------------------------------------------------- */
+void wake(
+        char *request,
+        const struct user_message *outcome,
+        void *arg
+) {
+
+    struct pending *entry = arg;
+
+    pthread_mutex_lock(&database_lock);
+    entry->finished = 1;
+    pthread_cond_broadcast(&database_done);
+    pthread_mutex_unlock(&database_lock);
+}
+
+void wait_all(struct pending *entries, size_t count) {
+
+    pthread_mutex_lock(&database_lock);
+    for (size_t i = 0; i < count; i++) {
+        while (!entries[i].finished) {
+            pthread_cond_wait(&database_done, &database_lock);
+        }
+    }
+    pthread_mutex_unlock(&database_lock);
+}
+
+uint64_t now_ms() {
+    struct timespec now;
+#ifdef WIN32
+    timespec_get(&now, TIME_UTC);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &now);
+#endif
+    return (uint64_t) now.tv_sec * 1000 + (uint64_t) now.tv_nsec / 1000000;
+}
 
 void sock_err(char *action) {
 #ifdef WIN32
@@ -1,10 +1,72 @@
 #ifndef USER_DATABASE_HANDLER_H
 #define USER_DATABASE_HANDLER_H
 
+#include <stddef.h>
+#include "user_database_protocol.h"
+
 extern void user_database_open();
 
 extern void user_database_close();
 
+/*
+ * Requests of every caller share a single socket : each datagram is tagged with
+ * an id, and a receiver thread hands each reply to the requests it answers.
+ * Requests queued while another thread sends are sent together.
+ *
+ * The replies of read-only commands are kept for a short time, and forgotten
+ * as soon as a command changing the users connected succeeds.
+ */
+
+/**
+ * Runs a command on the account service, and waits for its reply.
+ *
+ * @param buffer the command as input, its reply as output, of 1024 bytes
+ *
+ * @return the length of the reply
+ */
 extern int user_database_request(char *buffer);
 
+/**
+ * Runs several commands on the account service, sent in as few datagrams as
+ * possible.
+ *
+ * @param buffers the commands as input, their replies as output, of 1024 bytes
+ *                each
+ * @param count number of commands
+ */
+extern void user_database_request_batch(char **buffers, size_t count);
+
+/**
+ * Sends a command to the account service, without waiting for its reply.
+ *
+ * @param buffer the command as input, its reply as output, of 1024 bytes, to
+ *               be kept until the callback is called
+ * @param done called once the reply is rendered, from the receiver thread, or
+ *             from the calling thread when answered at once : it must not
+ *             wait. It is given the buffer, the parsed command with the status
+ *             of its reply and no payload, its opcode being 0 if the outcome
+ *             is unknown, and arg.
+ * @param arg argument given to the callback
+ */
+extern void user_database_request_async(
+        char *buffer,
+        void (*done)(
+                char *buffer,
+                const struct user_message *outcome,
+                void *arg
+        ),
+        void *arg
+);
+
+/**
+ * Reports how many read-only commands were served from the replies kept, how
+ * many were sent, and how many times the replies were forgotten.
+ *
+ * @param buffer the null-terminated report
+ * @param size size of the buffer
+ *
+ * @return the length of the report, truncated if the buffer is too small
+ */
+extern size_t user_database_render(char *buffer, size_t size);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,283 @@
+#ifdef WIN32
+
+#include <windows.h>
+
+#elif defined(linux)
+
+#include <unistd.h>
+
+#else
+
+#error platform unsupported
+
+#endif
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "worker_pool.h"
+#include "server_metrics.h"
+
+/**
+ * Tasks of a worker, as a ring growing when full. The worker takes the oldest
+ * tasks, the other workers steal the newest ones.
+ */
+struct worker_queue {
+    pthread_mutex_t lock;
+    struct worker_task **tasks;
+    size_t size;
+    size_t head; // Index of the oldest task
+    size_t length;
+    size_t deepest; // Largest length seen
+    _Atomic uint64_t run;
+    _Atomic uint64_t stolen; // Tasks of this queue run by other workers
+    pthread_t thread;
+};
+
+/**
+ * Adds a task to a queue.
+ *
+ * @return 0 on success, -1 if the queue could not grow
+ */
+static int push(struct worker_queue *queue, struct worker_task *task);
+
+/**
+ * Takes the oldest task of a queue.
+ *
+ * @return the task, or NULL if the queue is empty
+ */
+static struct worker_task *take(struct worker_queue *queue);
+
+/**
+ * Takes the newest task of a queue.
+ *
+ * @return the task, or NULL if the queue is empty
+ */
+static struct worker_task *steal(struct worker_queue *queue);
+
+/**
+ * Runs the tasks of its queue, then those of the other queues, and sleeps
+ * when all are empty.
+ *
+ * @param arg the queue of the worker
+ */
+static void *work(void *arg);
+
+static struct worker_queue *queues = NULL;
+
+static size_t queue_count = 0;
+
+/** Queue the next task is added to. */
+static _Atomic size_t queue_next = 0;
+
+/**
+ * Number of tasks waiting in every queue. Briefly negative when a task is
+ * taken before being counted.
+ */
+static _Atomic long queued = 0;
+
+static _Atomic size_t sleeping = 0;
+
+/** Guards the sleep of the workers. */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Signaled when a task is added while workers sleep. */
+static pthread_cond_t pool_wakeup = PTHREAD_COND_INITIALIZER;
+
+int worker_pool_start(size_t count) {
+
+    if (count == 0) count = worker_pool_cores();
+
+    queues = calloc(count, sizeof *queues);
+    if (queues == NULL) return -1;
+
+    for (size_t q = 0; q < count; q++) {
+        struct worker_queue *queue = &queues[q];
+        pthread_mutex_init(&queue->lock, NULL);
+        queue->size = WORKER_QUEUE_SIZE;
+        queue->tasks = malloc(queue->size * sizeof *queue->tasks);
+        if (queue->tasks == NULL) return -1;
+    }
+
+    // Workers steal from every queue : all exist before the first one starts
+    queue_count = count;
+    for (size_t q = 0; q < count; q++) {
+        if (pthread_create(&queues[q].thread, NULL, &work, &queues[q]) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void worker_pool_submit(struct worker_task *task) {
+
+    size_t q = atomic_fetch_add_explicit(
+            &queue_next, 1,
+            memory_order_relaxed
+    ) % queue_count;
+
+    // Runs the task at once if memory is short
+    if (push(&queues[q], task) < 0) {
+        task->run(task);
+        return;
+    }
+
+    // Either the task is counted before a worker checks for one before
+    // sleeping, or the worker is counted as sleeping before the check below
+    atomic_fetch_add(&queued, 1);
+    if (atomic_load(&sleeping) > 0) {
+        pthread_mutex_lock(&pool_lock);
+        pthread_cond_signal(&pool_wakeup);
+        pthread_mutex_unlock(&pool_lock);
+    }
+}
+
+size_t worker_pool_render(char *buffer, size_t size) {
+
+    uint64_t run = 0;
+    uint64_t stolen = 0;
+    size_t deepest = 0;
+    size_t length = 0;
+
+    if (size > 0) *buffer = '\0';
+
+    server_metrics_print(
+            buffer, size, &length,
+            "Workers : %zu, queued", queue_count
+    );
+
+    for (size_t q = 0; q < queue_count; q++) {
+        struct worker_queue *queue = &queues[q];
+
+        pthread_mutex_lock(&queue->lock);
+        size_t depth = queue->length;
+        if (queue->deepest > deepest) deepest = queue->deepest;
+        pthread_mutex_unlock(&queue->lock);
+
+        run += atomic_load_explicit(&queue->run, memory_order_relaxed);
+        stolen += atomic_load_explicit(&queue->stolen, memory_order_relaxed);
+        server_metrics_print(buffer, size, &length, " %zu", depth);
+    }
+
+    server_metrics_print(
+            buffer, size, &length,
+            ", deepest %zu, run %llu, stolen %llu",
+            deepest,
+            (unsigned long long) run,
+            (unsigned long long) stolen
+    );
+
+    return length;
+}
+
+size_t worker_pool_cores() {
+#ifdef WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (info.dwNumberOfProcessors > 0) ? info.dwNumberOfProcessors : 1;
+#elif defined(linux)
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return (cores > 0) ? (size_t) cores : 1;
+#endif
+}
+
+/* -------------------------------------------------------------------------- */
+
+int push(struct worker_queue *queue, struct worker_task *task) {
+
+    pthread_mutex_lock(&queue->lock);
+
+    if (queue->length == queue->size) {
+        struct worker_task **tasks = malloc(
+                2 * queue->size * sizeof *tasks
+        );
+        if (tasks == NULL) {
+            pthread_mutex_unlock(&queue->lock);
+            return -1;
+        }
+
+        // Unwraps the ring
+        size_t first = queue->size - queue->head;
+        memcpy(tasks, queue->tasks + queue->head, first * sizeof *tasks);
+        memcpy(tasks + first, queue->tasks, queue->head * sizeof *tasks);
+        free(queue->tasks);
+        queue->tasks = tasks;
+        queue->head = 0;
+        queue->size *= 2;
+    }
+
+    queue->tasks[(queue->head + queue->length) % queue->size] = task;
+    queue->length++;
+    if (queue->length > queue->deepest) queue->deepest = queue->length;
+
+    pthread_mutex_unlock(&queue->lock);
+    return 0;
+}
+
+struct worker_task *take(struct worker_queue *queue) {
+
+    struct worker_task *task = NULL;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->length > 0) {
+        task = queue->tasks[queue->head];
+        queue->head = (queue->head + 1) % queue->size;
+        queue->length--;
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return task;
+}
+
+struct worker_task *steal(struct worker_queue *queue) {
+
+    struct worker_task *task = NULL;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->length > 0) {
+        queue->length--;
+        task = queue->tasks[(queue->head + queue->length) % queue->size];
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    if (task != NULL) {
+        atomic_fetch_add_explicit(&queue->stolen, 1, memory_order_relaxed);
+    }
+
+    return task;
+}
+
+void *work(void *arg) {
+
+    struct worker_queue *own = arg;
+    size_t index = (size_t) (own - queues);
+
+    while (1) {
+        struct worker_task *task = take(own);
+
+        for (size_t i = 1; task == NULL && i < queue_count; i++) {
+            task = steal(&queues[(index + i) % queue_count]);
+        }
+
+        if (task != NULL) {
+            atomic_fetch_sub(&queued, 1);
+            task->run(task);
+            atomic_fetch_add_explicit(&own->run, 1, memory_order_relaxed);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool_lock);
+        atomic_fetch_add(&sleeping, 1);
+        while (atomic_load(&queued) <= 0) {
+            pthread_cond_wait(&pool_wakeup, &pool_lock);
+        }
+        atomic_fetch_sub(&sleeping, 1);
+        pthread_mutex_unlock(&pool_lock);
+    }
+
+    return NULL;
+}
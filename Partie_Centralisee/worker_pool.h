@@ -0,0 +1,51 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <stddef.h>
+
+/**
+ * Initial number of tasks a worker queue holds, doubled when full.
+ */
+#define WORKER_QUEUE_SIZE 64
+
+/**
+ * Work to be run by the pool, to be embedded as the first member of the
+ * structure holding its data.
+ */
+struct worker_task {
+    void (*run)(struct worker_task *task);
+};
+
+/**
+ * Starts the workers. Each worker owns a queue it runs the oldest tasks of,
+ * and steals the newest tasks of the other queues once its own is empty.
+ *
+ * @param count number of workers, 0 for one per available core
+ *
+ * @return 0 on success, -1 if the workers could not start
+ */
+extern int worker_pool_start(size_t count);
+
+/**
+ * Queues a task, the queues being filled in turn. The task may be run before
+ * the function returns.
+ */
+extern void worker_pool_submit(struct worker_task *task);
+
+/**
+ * Reports the number of tasks waiting in each queue, the largest number seen,
+ * and how many tasks were run and stolen.
+ *
+ * @param buffer the null-terminated report
+ * @param size size of the buffer
+ *
+ * @return the length of the report, truncated if the buffer is too small
+ */
+extern size_t worker_pool_render(char *buffer, size_t size);
+
+/**
+ * Gets the number of available cores.
+ */
+extern size_t worker_pool_cores();
+
+#endif
@@ -6,6 +6,7 @@
 #elif defined(linux)
 
 #include <sys/socket.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <errno.h>
@@ -40,6 +41,16 @@ unsigned long hash(const char *str);
 
 int client_close();
 
+#ifdef linux
+
+/**
+ * Prints the data sent by the server until the user types a command : the
+ * messages of the other users are shown as they arrive.
+ */
+void wait_input();
+
+#endif
+
 void sock_err(char *action);
 
 int main(void) {
@@ -79,12 +90,17 @@ int main(void) {
     }
 
     char buffer[1024];
-    int n;
 
     while (1) {
         printf(">> ");
-        fgets(buffer, 10000, stdin);
-        buffer[strlen(buffer) - 1] = 0; // Remove trailing newline
+        fflush(stdout);
+#ifdef linux
+        wait_input();
+#endif
+        if (fgets(buffer, sizeof buffer - 1, stdin) == NULL) {
+            return client_close();
+        }
+        buffer[strcspn(buffer, "\n")] = 0; // Remove trailing newline
         if (strcmp(buffer, "") == 0) {
             continue;
         }
@@ -98,7 +114,11 @@ int main(void) {
                     "login <id> <password> : log in to the server\n"
                     "logout <id> <password> : log out of the server\n"
                     "password <id> <old password> <new password> : change your password\n"
-                    "list : displays a list of connected users"
+                    "list : displays a list of connected users\n"
+                    "send <message> : sends a message to connected users\n"
+                    "history [count | since <number>] : displays the last"
+                    " messages, or those after a number\n"
+                    "stats : displays the metrics of the servers"
             );
             continue;
 
@@ -133,6 +153,21 @@ int main(void) {
         } else if (strcmp(cmd, "list") == 0) {
             sprintf(buffer, "list");
 
+        } else if (strcmp(cmd, "send") == 0) {
+            const char *text = strtok(NULL, "");
+            if (text == NULL) text = "";
+            memmove(buffer + 5, text, strlen(text) + 1);
+            memcpy(buffer, "send ", 5);
+
+        } else if (strcmp(cmd, "history") == 0) {
+            const char *range = strtok(NULL, "");
+            if (range == NULL) range = "";
+            memmove(buffer + 8, range, strlen(range) + 1);
+            memcpy(buffer, "history ", 8);
+
+        } else if (strcmp(cmd, "stats") == 0) {
+            sprintf(buffer, "stats");
+
         } else if (strcmp(cmd, "exit") == 0) {
             return client_close();
 
@@ -141,18 +176,63 @@ int main(void) {
             continue;
         }
 
+#ifdef linux
+        // Commands ended with a newline let the server push messages
+        strcat(buffer, "\n");
+#endif
         if (send(client_socket, buffer, strlen(buffer), 0) < 0) {
             sock_err("Sending request");
         }
 
+#ifdef WIN32
+        // A single reply is read per command : the commands are sent
+        // unframed, so that the server pushes no messages
+        int n;
         if ((n = recv(client_socket, buffer, sizeof buffer - 1, 0)) < 0) {
             sock_err("Acquiring server response");
         }
         buffer[n] = '\0';
-        puts(buffer);
+        fputs(buffer, stdout);
+#endif
+    }
+}
+
+#ifdef linux
+
+void wait_input() {
+
+    struct pollfd watched[2] = {
+            {.fd = STDIN_FILENO, .events = POLLIN},
+            {.fd = client_socket, .events = POLLIN}
+    };
+    char buffer[1024];
+
+    while (1) {
+        if (poll(watched, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            sock_err("Waiting for input");
+        }
+
+        if (watched[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t n = recv(client_socket, buffer, sizeof buffer - 1, 0);
+            if (n < 0) {
+                sock_err("Acquiring server response");
+            }
+            if (n == 0) {
+                puts("\nServer closed the connection");
+                exit(client_close());
+            }
+            buffer[n] = '\0';
+            printf("\r%s>> ", buffer);
+            fflush(stdout);
+        }
+
+        if (watched[0].revents & (POLLIN | POLLHUP)) return;
     }
 }
 
+#endif
+
 int client_close() {
     closesocket(client_socket);
 